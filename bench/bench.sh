@@ -0,0 +1,98 @@
+#!/bin/sh
+# compares the requests per second of the GET, INCR and scan paths of the
+# module built at two revisions, the baseline and HEAD by default:
+#   bench/bench.sh [<baseline rev> [<rev>]]
+# needs redis-server, redis-cli and redis-benchmark on PATH. each revision
+# is built in a git worktree and loaded into a fresh server, the results go
+# to bench_output.txt as CSV
+set -e
+
+ROOT=$(git rev-parse --show-toplevel)
+BASE=${1:-$(git -C "$ROOT" rev-list --max-parents=0 HEAD | tail -n 1)}
+HEAD_REV=${2:-HEAD}
+PORT=${BENCH_PORT:-6399}
+REQUESTS=${BENCH_REQUESTS:-100000}
+SCAN_REQUESTS=${BENCH_SCAN_REQUESTS:-200}
+CLIENTS=${BENCH_CLIENTS:-50}
+DIMS=${BENCH_DIMS:-20} #values per dimension, the schema has DIMS^3 cells
+OUT="$ROOT/bench_output.txt"
+WORK=$(mktemp -d)
+SERVER=
+
+cleanup() {
+  if [ -n "$SERVER" ]; then
+    kill "$SERVER" 2>/dev/null || true
+  fi
+  for tree in "$WORK"/*; do
+    if [ -d "$tree" ]; then
+      git -C "$ROOT" worktree remove --force "$tree"
+    fi
+  done
+  rm -rf "$WORK"
+}
+trap cleanup EXIT INT TERM
+
+for tool in redis-server redis-cli redis-benchmark; do
+  command -v $tool >/dev/null || { echo "$tool not found" >&2; exit 1; }
+done
+
+# the first column of redis-benchmark's CSV names the command, all of it
+label_rows() {
+  sed -e '/^"test"/d' -e "s/^\"[^\"]*\"/\"$1\"/"
+}
+
+cli() {
+  redis-cli -p "$PORT" "$@"
+}
+
+values() {
+  i=0; sep=
+  while [ $i -lt "$DIMS" ]; do
+    printf '%s"%s%d"' "$sep" "$1" $i
+    sep=", "; i=$((i + 1))
+  done
+}
+
+# the cells as the protocol, piped in one go
+cells() {
+  awk -v n="$DIMS" -v prefix="$1" 'BEGIN {
+    for(c = 0; c < n; ++c) for(l = 0; l < n; ++l) for(s = 0; s < n; ++s) {
+      key = prefix "c" c ":l" l ":s" s
+      printf "*3\r\n$3\r\nSET\r\n$%d\r\n%s\r\n$1\r\n1\r\n", length(key), key
+    }
+  }'
+}
+
+run() {
+  label=$1 rev=$2 tree="$WORK/$1"
+  git -C "$ROOT" worktree add --detach "$tree" "$rev" >/dev/null
+  make -C "$tree" >/dev/null
+  # the baseline has a single unnamed schema over the whole keyspace
+  if grep -q SCHEMA_NAME_ARG "$tree/redischema.h"; then
+    name=bench prefix=bench:
+  else
+    name= prefix=
+  fi
+  redis-server --port "$PORT" --save '' --appendonly no \
+    --loadmodule "$tree/redischema.so" >/dev/null &
+  SERVER=$!
+  until cli ping >/dev/null 2>&1; do sleep 0.1; done
+  cells "$prefix" | cli --pipe >/dev/null
+  cli schemaload $name "{ \"company\": [$(values c)], \"location\": [$(values l)], \"size\": [$(values s)] }" >/dev/null
+  cell='{ "company": "c1", "location": "l2", "size": "s3" }'
+  echo "$label $(git -C "$ROOT" rev-parse --short "$rev")" >> "$OUT"
+  redis-benchmark -p "$PORT" -c "$CLIENTS" -n "$REQUESTS" --csv \
+    schemaget $name "$cell" | label_rows get >> "$OUT"
+  redis-benchmark -p "$PORT" -c "$CLIENTS" -n "$REQUESTS" --csv \
+    schemainc $name "$cell" | label_rows inc >> "$OUT"
+  redis-benchmark -p "$PORT" -c "$CLIENTS" -n "$SCAN_REQUESTS" --csv \
+    schemaget $name '{ "size": "s3" }' | label_rows scan >> "$OUT"
+  kill "$SERVER"
+  wait "$SERVER" 2>/dev/null || true
+  SERVER=
+}
+
+: > "$OUT"
+run baseline "$BASE"
+run head "$HEAD_REV"
+cat "$OUT"
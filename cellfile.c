@@ -0,0 +1,204 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "cellfile.h"
+
+static int write_csv(FILE *out, const CELL_RECORD *records, size_t len) {
+  for(size_t i=0; i < len; ++i) {
+    const CELL_RECORD *rec = &records[i];
+    if(memchr(rec->key, '\n', rec->key_len) != NULL)
+      return -1; //it would not read back as one line
+    int rsp = rec->is_int?
+      fprintf(out, "%.*s,%lld\n", (int)rec->key_len, rec->key,
+        (long long)rec->ival) :
+      fprintf(out, "%.*s,%.17g\n", (int)rec->key_len, rec->key, rec->dval);
+    if(rsp < 0)
+      return -1;
+  }
+  return 0;
+}
+
+static int write_binary(FILE *out, const CELL_RECORD *records, size_t len) {
+  uint8_t version = CELL_FILE_VERSION;
+  uint64_t count = len;
+  fwrite(CELL_FILE_MAGIC, 1, CELL_FILE_MAGIC_LEN, out);
+  fwrite(&version, 1, 1, out);
+  fwrite(&count, sizeof(uint64_t), 1, out);
+  for(size_t i=0; i < len; ++i) {
+    if(records[i].key_len > UINT32_MAX)
+      return -1;
+    uint32_t key_len = records[i].key_len;
+    fwrite(&key_len, sizeof(uint32_t), 1, out);
+  }
+  for(size_t i=0; i < len; ++i) {
+    uint8_t kind = records[i].is_int;
+    fwrite(&kind, 1, 1, out);
+  }
+  for(size_t i=0; i < len; ++i) {
+    int64_t val = records[i].ival;
+    if(!records[i].is_int)
+      memcpy(&val, &records[i].dval, sizeof(int64_t));
+    fwrite(&val, sizeof(int64_t), 1, out);
+  }
+  for(size_t i=0; i < len; ++i)
+    fwrite(records[i].key, 1, records[i].key_len, out);
+  return ferror(out)? -1 : 0;
+}
+
+int cell_file_write(const char *path, int format, const CELL_RECORD *records,
+  size_t len) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0644);
+  if(fd < 0)
+    return -1;
+  FILE *out = fdopen(fd, "wb");
+  if(out == NULL) {
+    close(fd);
+    unlink(path);
+    return -1;
+  }
+  int rsp = (format == CELL_FILE_BINARY)? write_binary(out, records, len) :
+    write_csv(out, records, len);
+  if(fclose(out) != 0)
+    rsp = -1;
+  if(rsp != 0)
+    unlink(path); //the file was created here, a partial one is not left
+  return rsp;
+}
+
+/* the columns sit back to back after the header, the keys fill the rest
+*/
+static int open_binary(CELL_FILE *file) {
+  const size_t header = CELL_FILE_MAGIC_LEN + 1 + sizeof(uint64_t);
+  const size_t per_cell = sizeof(uint32_t) + 1 + sizeof(int64_t);
+  if(file->size < header ||
+    memcmp(file->map, CELL_FILE_MAGIC, CELL_FILE_MAGIC_LEN) != 0 ||
+    (uint8_t)file->map[CELL_FILE_MAGIC_LEN] != CELL_FILE_VERSION)
+    return -1;
+  memcpy(&file->count, file->map + CELL_FILE_MAGIC_LEN + 1, sizeof(uint64_t));
+  if(file->count > (file->size - header) / per_cell)
+    return -1;
+  file->lens = file->map + header;
+  file->kinds = file->lens + file->count * sizeof(uint32_t);
+  file->vals = file->kinds + file->count;
+  file->keys = file->vals + file->count * sizeof(int64_t);
+  return 0;
+}
+
+CELL_FILE *cell_file_open(const char *path, int format) {
+  CELL_FILE *file = calloc(1, sizeof(CELL_FILE));
+  if(file == NULL)
+    return NULL;
+  file->format = format;
+  int fd = open(path, O_RDONLY | O_NOFOLLOW);
+  struct stat st;
+  if(fd < 0 || fstat(fd, &st) != 0) {
+    if(fd >= 0)
+      close(fd);
+    free(file);
+    return NULL;
+  }
+  file->size = st.st_size;
+  if(file->size > 0) {
+    void *map = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    file->map = (map == MAP_FAILED)? NULL : map;
+    if(file->map != NULL)
+      madvise(map, file->size, MADV_SEQUENTIAL);
+  }
+  close(fd);
+  if((file->size > 0 && file->map == NULL) ||
+    (format == CELL_FILE_BINARY && open_binary(file) != 0)) {
+    cell_file_close(file);
+    return NULL;
+  }
+  return file;
+}
+
+void cell_file_close(CELL_FILE *file) {
+  if(file == NULL)
+    return;
+  if(file->map != NULL)
+    munmap((void*)file->map, file->size);
+  free(file);
+}
+
+/* an integer when all of it parses as one, a finite double otherwise
+*/
+static int parse_value(const char *str, size_t len, CELL_RECORD *record) {
+  char buf[CELL_FILE_VALUE_MAX_LEN], *end;
+  if(len == 0 || len >= sizeof(buf))
+    return -1;
+  memcpy(buf, str, len);
+  buf[len] = '\0';
+  errno = 0;
+  long long ival = strtoll(buf, &end, 10);
+  if(*end == '\0' && errno == 0) {
+    record->is_int = 1;
+    record->ival = ival;
+    record->dval = ival;
+    return 0;
+  }
+  record->is_int = 0;
+  record->dval = strtod(buf, &end);
+  return (*end == '\0' && isfinite(record->dval))? 0 : -1;
+}
+
+static int next_csv(CELL_FILE *file, CELL_RECORD *record) {
+  while(file->pos < file->size) {
+    const char *line = file->map + file->pos;
+    const char *nl = memchr(line, '\n', file->size - file->pos);
+    size_t len = (nl == NULL)? file->size - file->pos : (size_t)(nl - line);
+    file->pos += len + (nl != NULL);
+    if(len > 0 && line[len - 1] == '\r')
+      len--;
+    if(len == 0)
+      continue;
+    size_t comma = len;
+    while(comma > 0 && line[comma - 1] != ',')
+      comma--;
+    if(comma <= 1 ||
+      parse_value(line + comma, len - comma, record) != 0)
+      return -1;
+    record->key = line;
+    record->key_len = comma - 1;
+    return 1;
+  }
+  return 0;
+}
+
+static int next_binary(CELL_FILE *file, CELL_RECORD *record) {
+  if(file->pos >= file->count)
+    return 0;
+  uint32_t key_len;
+  int64_t val;
+  memcpy(&key_len, file->lens + file->pos * sizeof(uint32_t),
+    sizeof(uint32_t));
+  memcpy(&val, file->vals + file->pos * sizeof(int64_t), sizeof(int64_t));
+  if(key_len == 0 ||
+    key_len > (size_t)(file->map + file->size - file->keys))
+    return -1;
+  record->key = file->keys;
+  record->key_len = key_len;
+  record->is_int = file->kinds[file->pos] != 0;
+  record->ival = val;
+  if(record->is_int)
+    record->dval = val;
+  else {
+    memcpy(&record->dval, &val, sizeof(double));
+    if(!isfinite(record->dval))
+      return -1;
+  }
+  file->keys += key_len;
+  file->pos++;
+  return 1;
+}
+
+int cell_file_next(CELL_FILE *file, CELL_RECORD *record) {
+  return (file->format == CELL_FILE_BINARY)? next_binary(file, record) :
+    next_csv(file, record);
+}
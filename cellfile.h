@@ -0,0 +1,58 @@
+#ifndef CELLFILE_H
+#define CELLFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CELL_FILE_CSV 0
+#define CELL_FILE_BINARY 1
+#define CELL_FILE_MAGIC "SCHC"
+#define CELL_FILE_MAGIC_LEN 4
+#define CELL_FILE_VERSION 1
+#define CELL_FILE_VALUE_MAX_LEN 64
+
+/* a cell as it is kept in a file, its key without the schema name
+*/
+typedef struct cell_record {
+  const char *key; //not terminated, points into the mapped file when read
+  size_t key_len;
+  int is_int; //ival holds the value when set, dval otherwise
+  int64_t ival;
+  double dval;
+} CELL_RECORD;
+
+/* a file of cells mapped for reading.
+   CSV holds a "<cell>,<value>" line per cell, the value after the last
+   comma. BINARY is columnar: the magic, a version byte and a 64 bit cell
+   count, then a column of 32 bit key lengths, one of value kinds (1 for
+   an integer), one of 64 bit values (the bits of a double for the rest)
+   and the key bytes, all in host byte order
+*/
+typedef struct cell_file {
+  const char *map;
+  size_t size;
+  int format;
+  size_t pos; //offset of the next CSV line, index of the next BINARY cell
+  uint64_t count;
+  const char *lens;
+  const char *kinds;
+  const char *vals;
+  const char *keys; //where the key of the next BINARY cell starts
+} CELL_FILE;
+
+/* writes len records to a new file at path. fails when the file exists,
+   even as a link, or can not be written
+*/
+int cell_file_write(const char *path, int format, const CELL_RECORD *records,
+  size_t len);
+/* returned pointer must be freed with cell_file_close, NULL when the file
+   is a link, can not be read or is not a BINARY file of this version
+*/
+CELL_FILE *cell_file_open(const char *path, int format);
+void cell_file_close(CELL_FILE *file);
+/* 1 when record got the next cell, 0 past the last one and -1 when the
+   file is malformed from there on
+*/
+int cell_file_next(CELL_FILE *file, CELL_RECORD *record);
+
+#endif /* CELLFILE_H */
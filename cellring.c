@@ -0,0 +1,74 @@
+#include <stdlib.h>
+#include "cellring.h"
+
+CELL_RING *cell_ring_new(long long resolution, size_t size) {
+  CELL_RING *ring = malloc(sizeof(CELL_RING));
+  if(ring == NULL)
+    return NULL;
+  ring->buckets = calloc(size, sizeof(long long));
+  if(ring->buckets == NULL) {
+    free(ring);
+    return NULL;
+  }
+  ring->resolution = resolution;
+  ring->size = size;
+  ring->head = 0;
+  return ring;
+}
+
+size_t cell_ring_mem_usage(const CELL_RING *ring) {
+  return sizeof(CELL_RING) + ring->size * sizeof(long long);
+}
+
+void cell_ring_free(CELL_RING *ring) {
+  if(ring == NULL)
+    return;
+  free(ring->buckets);
+  free(ring);
+}
+
+long long cell_ring_bucket_of(CELL_RING *ring, long long now) {
+  return now / ring->resolution;
+}
+
+void cell_ring_advance(CELL_RING *ring, long long now) {
+  long long bucket = cell_ring_bucket_of(ring, now);
+  if(bucket <= ring->head)
+    return;
+  long long expired = bucket - ring->head;
+  if(expired > (long long)ring->size)
+    expired = ring->size;
+  for(long long b = bucket - expired + 1; b <= bucket; ++b)
+    ring->buckets[b % ring->size] = 0;
+  ring->head = bucket;
+}
+
+void cell_ring_incrby(CELL_RING *ring, long long now, long long delta) {
+  cell_ring_advance(ring, now);
+  ring->buckets[ring->head % ring->size] += delta;
+}
+
+void cell_ring_set(CELL_RING *ring, long long now, long long val) {
+  cell_ring_advance(ring, now);
+  ring->buckets[ring->head % ring->size] = val;
+}
+
+long long cell_ring_sum(CELL_RING *ring, long long now, long long window) {
+  long long newest = cell_ring_bucket_of(ring, now);
+  long long span = (window <= 0)? (long long)ring->size :
+    (window + ring->resolution - 1) / ring->resolution;
+  if(span > (long long)ring->size)
+    span = ring->size;
+  //only buckets that are both inside the window and still retained count
+  long long from = newest - span + 1, to = ring->head;
+  if(from <= ring->head - (long long)ring->size)
+    from = ring->head - ring->size + 1;
+  if(from < 0)
+    from = 0;
+  if(to > newest)
+    to = newest;
+  long long sum = 0;
+  for(long long b = from; b <= to; ++b)
+    sum += ring->buckets[b % ring->size];
+  return sum;
+}
@@ -0,0 +1,35 @@
+#ifndef CELLRING_H
+#define CELLRING_H
+
+#include <stddef.h>
+
+/* a fixed size ring of per-interval counters.
+   bucket b covers the time [b*resolution, (b+1)*resolution) and lives in
+   slot b % size, head is the newest bucket that was written to.
+*/
+typedef struct cell_ring {
+  long long resolution; //bucket width in milliseconds
+  size_t size; //number of buckets kept, retention is size * resolution
+  long long head;
+  long long *buckets;
+} CELL_RING;
+
+/* returned pointer must be freed with cell_ring_free
+*/
+CELL_RING *cell_ring_new(long long resolution, size_t size);
+void cell_ring_free(CELL_RING *ring);
+/* bytes allocated for the ring
+*/
+size_t cell_ring_mem_usage(const CELL_RING *ring);
+long long cell_ring_bucket_of(CELL_RING *ring, long long now);
+/* moves head forward to the bucket of now, clearing expired buckets
+*/
+void cell_ring_advance(CELL_RING *ring, long long now);
+void cell_ring_incrby(CELL_RING *ring, long long now, long long delta);
+void cell_ring_set(CELL_RING *ring, long long now, long long val);
+/* sums the buckets of the last window milliseconds (rounded up to whole
+   buckets), a window of 0 or beyond the retention sums the whole ring
+*/
+long long cell_ring_sum(CELL_RING *ring, long long now, long long window);
+
+#endif /* CELLRING_H */
@@ -0,0 +1,389 @@
+#include <stdlib.h>
+#include <string.h>
+#include "cellstore.h"
+
+typedef struct cell {
+  uint64_t coord;
+  int64_t val;
+  uint8_t flag;
+} CELL;
+
+/* bits needed for ordinals 0..card
+*/
+static uint8_t bits_for(size_t card) {
+  uint8_t bits = 0;
+  while(bits < CELL_STORE_COORD_BITS && ((uint64_t)1 << bits) <= card)
+    bits++;
+  return bits;
+}
+
+static uint64_t field_mask(uint8_t bits) {
+  return (bits == 0)? 0 : ((uint64_t)1 << bits) - 1;
+}
+
+static size_t field_shift(const uint8_t *bits, size_t dims, size_t dim) {
+  size_t shift = 0;
+  for(size_t d = dim + 1; d < dims; ++d)
+    shift += bits[d];
+  return shift;
+}
+
+static uint64_t pack(const uint8_t *bits, size_t dims, const uint32_t *ords) {
+  uint64_t coord = 0;
+  for(size_t d=0; d < dims; ++d)
+    coord = (coord << bits[d]) | (ords[d] & field_mask(bits[d]));
+  return coord;
+}
+
+static void unpack(const uint8_t *bits, size_t dims, uint64_t coord,
+  uint32_t *ords) {
+  for(size_t d = dims; d-- > 0;) {
+    ords[d] = coord & field_mask(bits[d]);
+    coord >>= bits[d];
+  }
+}
+
+CELL_STORE *cell_store_new(void) {
+  CELL_STORE *store = calloc(1, sizeof(CELL_STORE));
+  if(store == NULL)
+    return NULL;
+  store->cap = CELL_STORE_INITIAL_CAP;
+  store->coords = malloc(store->cap * sizeof(uint64_t));
+  store->vals = malloc(store->cap * sizeof(int64_t));
+  store->flags = malloc(store->cap * sizeof(uint8_t));
+  if(store->coords == NULL || store->vals == NULL || store->flags == NULL) {
+    cell_store_free(store);
+    return NULL;
+  }
+  return store;
+}
+
+/* the last store to let go of shared columns frees them
+*/
+static void release_columns(CELL_STORE *store) {
+  if(store->refs != NULL &&
+    __atomic_sub_fetch(store->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+    store->refs = NULL;
+    return;
+  }
+  free(store->refs);
+  free(store->coords);
+  free(store->vals);
+  free(store->flags);
+  store->refs = NULL;
+}
+
+/* called before every write, a snapshot keeps reading the old columns
+*/
+static int own_columns(CELL_STORE *store) {
+  if(store->refs == NULL)
+    return 0;
+  if(__atomic_load_n(store->refs, __ATOMIC_ACQUIRE) == 1) {
+    free(store->refs);
+    store->refs = NULL;
+    return 0;
+  }
+  uint64_t *coords = malloc(store->cap * sizeof(uint64_t));
+  int64_t *vals = malloc(store->cap * sizeof(int64_t));
+  uint8_t *flags = malloc(store->cap * sizeof(uint8_t));
+  if(coords == NULL || vals == NULL || flags == NULL) {
+    free(coords); free(vals); free(flags);
+    return -1;
+  }
+  memcpy(coords, store->coords, store->len * sizeof(uint64_t));
+  memcpy(vals, store->vals, store->len * sizeof(int64_t));
+  memcpy(flags, store->flags, store->len * sizeof(uint8_t));
+  release_columns(store);
+  store->coords = coords;
+  store->vals = vals;
+  store->flags = flags;
+  return 0;
+}
+
+void cell_store_free(CELL_STORE *store) {
+  if(store == NULL)
+    return;
+  release_columns(store);
+  free(store);
+}
+
+CELL_STORE *cell_store_snapshot(CELL_STORE *store) {
+  if(cell_store_compact(store) != 0)
+    return NULL;
+  CELL_STORE *snapshot = malloc(sizeof(CELL_STORE));
+  if(snapshot == NULL)
+    return NULL;
+  if(store->refs == NULL) {
+    store->refs = malloc(sizeof(int));
+    if(store->refs == NULL) {
+      free(snapshot);
+      return NULL;
+    }
+    *store->refs = 1;
+  }
+  __atomic_add_fetch(store->refs, 1, __ATOMIC_ACQ_REL);
+  *snapshot = *store;
+  return snapshot;
+}
+
+size_t cell_store_mem_usage(const CELL_STORE *store) {
+  return sizeof(CELL_STORE) + store->cap * CELL_STORE_CELL_BYTES;
+}
+
+int cell_store_fit(CELL_STORE *store, size_t dims, const size_t *cards) {
+  uint8_t bits[CELL_STORE_MAX_DIMS];
+  size_t total = 0, new_dims = (dims > store->dims)? dims : store->dims;
+  int changed = (new_dims != store->dims);
+  if(new_dims > CELL_STORE_MAX_DIMS)
+    return -1;
+  for(size_t d=0; d < new_dims; ++d) {
+    uint8_t old = (d < store->dims)? store->bits[d] : 0;
+    bits[d] = (d < dims && bits_for(cards[d]) > old)? bits_for(cards[d]) : old;
+    changed |= (bits[d] != old);
+    total += bits[d];
+  }
+  if(total > CELL_STORE_COORD_BITS)
+    return -1;
+  if(!changed)
+    return 0;
+  if(own_columns(store) != 0)
+    return -1;
+  //widening fields keeps the order of the coordinates
+  uint32_t ords[CELL_STORE_MAX_DIMS] = {0};
+  for(size_t i=0; i < store->len; ++i) {
+    unpack(store->bits, store->dims, store->coords[i], ords);
+    store->coords[i] = pack(bits, new_dims, ords);
+  }
+  memcpy(store->bits, bits, new_dims);
+  store->dims = new_dims;
+  return 0;
+}
+
+uint64_t cell_store_pack(const CELL_STORE *store, const uint32_t *ords) {
+  return pack(store->bits, store->dims, ords);
+}
+
+uint32_t cell_store_ord(const CELL_STORE *store, uint64_t coord, size_t dim) {
+  if(dim >= store->dims)
+    return 0;
+  return (coord >> field_shift(store->bits, store->dims, dim)) &
+    field_mask(store->bits[dim]);
+}
+
+size_t cell_store_seek(const CELL_STORE *store, uint64_t coord) {
+  size_t lo = 0, hi = store->sorted;
+  while(lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if(store->coords[mid] < coord)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* index of the cell, live or deleted, -1 when it was never stored
+*/
+static long find_any(const CELL_STORE *store, uint64_t coord) {
+  size_t lo = cell_store_seek(store, coord);
+  if(lo < store->sorted && store->coords[lo] == coord)
+    return lo;
+  for(size_t i = store->sorted; i < store->len; ++i) {
+    if(store->coords[i] == coord)
+      return i;
+  }
+  return -1;
+}
+
+long cell_store_find(const CELL_STORE *store, uint64_t coord) {
+  long i = find_any(store, coord);
+  return (i >= 0 && store->flags[i] == CELL_STORE_DEAD)? -1 : i;
+}
+
+static int grow(CELL_STORE *store) {
+  size_t cap = store->cap * 2;
+  uint64_t *coords = realloc(store->coords, cap * sizeof(uint64_t));
+  if(coords == NULL)
+    return -1;
+  store->coords = coords;
+  int64_t *vals = realloc(store->vals, cap * sizeof(int64_t));
+  if(vals == NULL)
+    return -1;
+  store->vals = vals;
+  uint8_t *flags = realloc(store->flags, cap * sizeof(uint8_t));
+  if(flags == NULL)
+    return -1;
+  store->flags = flags;
+  store->cap = cap;
+  return 0;
+}
+
+long cell_store_insert(CELL_STORE *store, uint64_t coord) {
+  long i = find_any(store, coord);
+  if(own_columns(store) != 0)
+    return -1;
+  if(i >= 0) {
+    if(store->flags[i] == CELL_STORE_DEAD) {
+      store->flags[i] = CELL_STORE_INT;
+      store->vals[i] = 0;
+      store->dead--;
+    }
+    return i;
+  }
+  if(store->len - store->sorted >= CELL_STORE_TAIL_MAX &&
+    cell_store_compact(store) != 0)
+    return -1;
+  if(store->len == store->cap && grow(store) != 0)
+    return -1;
+  i = store->len++;
+  store->coords[i] = coord;
+  store->vals[i] = 0;
+  store->flags[i] = CELL_STORE_INT;
+  return i;
+}
+
+int cell_store_set_int(CELL_STORE *store, size_t i, int64_t val) {
+  if(own_columns(store) != 0)
+    return -1;
+  store->vals[i] = val;
+  store->flags[i] = CELL_STORE_INT;
+  return 0;
+}
+
+int cell_store_set_double(CELL_STORE *store, size_t i, double val) {
+  if(own_columns(store) != 0)
+    return -1;
+  memcpy(&store->vals[i], &val, sizeof(double));
+  store->flags[i] = CELL_STORE_DOUBLE;
+  return 0;
+}
+
+double cell_store_double(const CELL_STORE *store, size_t i) {
+  double val;
+  if(store->flags[i] != CELL_STORE_DOUBLE)
+    return store->vals[i];
+  memcpy(&val, &store->vals[i], sizeof(double));
+  return val;
+}
+
+int cell_store_delete(CELL_STORE *store, size_t i) {
+  if(store->flags[i] == CELL_STORE_DEAD)
+    return 0;
+  if(own_columns(store) != 0)
+    return -1;
+  store->flags[i] = CELL_STORE_DEAD;
+  store->dead++;
+  return 0;
+}
+
+static int cell_cmp(const void *a, const void *b) {
+  uint64_t x = ((const CELL*)a)->coord, y = ((const CELL*)b)->coord;
+  return (x > y) - (x < y);
+}
+
+int cell_store_compact(CELL_STORE *store) {
+  size_t tail = store->len - store->sorted;
+  if(tail == 0 && store->dead == 0)
+    return 0;
+  CELL *cells = malloc((tail + 1) * sizeof(CELL));
+  uint64_t *coords = malloc(store->cap * sizeof(uint64_t));
+  int64_t *vals = malloc(store->cap * sizeof(int64_t));
+  uint8_t *flags = malloc(store->cap * sizeof(uint8_t));
+  if(cells == NULL || coords == NULL || vals == NULL || flags == NULL) {
+    free(cells); free(coords); free(vals); free(flags);
+    return -1;
+  }
+  for(size_t i=0; i < tail; ++i) {
+    size_t at = store->sorted + i;
+    cells[i] = (CELL){ store->coords[at], store->vals[at], store->flags[at] };
+  }
+  qsort(cells, tail, sizeof(CELL), cell_cmp);
+  size_t i = 0, j = 0, n = 0;
+  while(i < store->sorted || j < tail) {
+    CELL cell;
+    if(j == tail || (i < store->sorted && store->coords[i] < cells[j].coord)) {
+      cell = (CELL){ store->coords[i], store->vals[i], store->flags[i] };
+      i++;
+    }
+    else
+      cell = cells[j++];
+    if(cell.flag == CELL_STORE_DEAD)
+      continue;
+    coords[n] = cell.coord;
+    vals[n] = cell.val;
+    flags[n++] = cell.flag;
+  }
+  free(cells);
+  release_columns(store);
+  store->coords = coords;
+  store->vals = vals;
+  store->flags = flags;
+  store->len = store->sorted = n;
+  store->dead = 0;
+  return 0;
+}
+
+char *cell_store_serialize(const CELL_STORE *store, size_t *len) {
+  uint64_t sorted = store->sorted, count = store->len;
+  size_t size = 2 + store->dims + 2 * sizeof(uint64_t) +
+    count * (sizeof(uint64_t) + sizeof(int64_t) + sizeof(uint8_t));
+  char *buf = malloc(size), *pos = buf;
+  if(buf == NULL)
+    return NULL;
+  *pos++ = CELL_STORE_SERIAL_VERSION;
+  *pos++ = store->dims;
+  memcpy(pos, store->bits, store->dims); pos += store->dims;
+  memcpy(pos, &sorted, sizeof(uint64_t)); pos += sizeof(uint64_t);
+  memcpy(pos, &count, sizeof(uint64_t)); pos += sizeof(uint64_t);
+  memcpy(pos, store->coords, count * sizeof(uint64_t));
+  pos += count * sizeof(uint64_t);
+  memcpy(pos, store->vals, count * sizeof(int64_t));
+  pos += count * sizeof(int64_t);
+  memcpy(pos, store->flags, count * sizeof(uint8_t));
+  *len = size;
+  return buf;
+}
+
+CELL_STORE *cell_store_deserialize(const char *buf, size_t len) {
+  const char *pos = buf, *end = buf + len;
+  if(len < 2 || buf[0] != CELL_STORE_SERIAL_VERSION ||
+    (uint8_t)buf[1] > CELL_STORE_MAX_DIMS)
+    return NULL;
+  CELL_STORE *store = cell_store_new();
+  if(store == NULL)
+    return NULL;
+  uint64_t sorted, count;
+  size_t total = 0;
+  store->dims = (uint8_t)buf[1];
+  pos += 2;
+  if(end - pos < store->dims + 2 * sizeof(uint64_t))
+    goto corrupt;
+  memcpy(store->bits, pos, store->dims); pos += store->dims;
+  for(size_t d=0; d < store->dims; ++d)
+    total += store->bits[d];
+  memcpy(&sorted, pos, sizeof(uint64_t)); pos += sizeof(uint64_t);
+  memcpy(&count, pos, sizeof(uint64_t)); pos += sizeof(uint64_t);
+  if(total > CELL_STORE_COORD_BITS || sorted > count ||
+    count > (end - pos) / (sizeof(uint64_t) + sizeof(int64_t) + 1))
+    goto corrupt;
+  while(store->cap < count) {
+    if(grow(store) != 0)
+      goto corrupt;
+  }
+  memcpy(store->coords, pos, count * sizeof(uint64_t));
+  pos += count * sizeof(uint64_t);
+  memcpy(store->vals, pos, count * sizeof(int64_t));
+  pos += count * sizeof(int64_t);
+  memcpy(store->flags, pos, count * sizeof(uint8_t));
+  store->len = count;
+  store->sorted = sorted;
+  for(size_t i=0; i < count; ++i) {
+    if(store->flags[i] > CELL_STORE_DEAD)
+      goto corrupt;
+    store->dead += (store->flags[i] == CELL_STORE_DEAD);
+  }
+  return store;
+  corrupt:
+  cell_store_free(store);
+  return NULL;
+}
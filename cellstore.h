@@ -0,0 +1,84 @@
+#ifndef CELLSTORE_H
+#define CELLSTORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CELL_STORE_MAX_DIMS 32
+#define CELL_STORE_COORD_BITS 64
+#define CELL_STORE_TAIL_MAX 128 //unsorted appends before a compaction
+#define CELL_STORE_INITIAL_CAP 16
+#define CELL_STORE_SERIAL_VERSION 1
+#define CELL_STORE_CELL_BYTES (sizeof(uint64_t) + sizeof(int64_t) + sizeof(uint8_t))
+
+#define CELL_STORE_INT 0
+#define CELL_STORE_DOUBLE 1
+#define CELL_STORE_DEAD 2
+
+/* the populated cells of a sparse schema in one value.
+   a cell's coordinate packs the ordinal of each of its segments (rank + 1,
+   0 when the cell has no such segment) into cardinality sized bit fields,
+   the first dimension in the high bits, so sorted coordinates keep the
+   cells of a slice next to each other. values sit in a parallel column.
+   snapshots share the columns until the store next writes, which then
+   copies them
+*/
+typedef struct cell_store {
+  size_t dims;
+  uint8_t bits[CELL_STORE_MAX_DIMS];
+  size_t sorted; //coords[0, sorted) are in order, the rest is an append tail
+  size_t dead; //deleted cells a compaction will drop
+  size_t len;
+  size_t cap;
+  uint64_t *coords;
+  int64_t *vals; //an integer, or the bits of a double
+  uint8_t *flags; //CELL_STORE_INT, CELL_STORE_DOUBLE or CELL_STORE_DEAD
+  int *refs; //stores sharing the columns, NULL while this one owns them
+} CELL_STORE;
+
+/* returned pointer must be freed with cell_store_free
+*/
+CELL_STORE *cell_store_new(void);
+void cell_store_free(CELL_STORE *store);
+/* a compacted read only view of the store as it is now, NULL on no memory.
+   it is freed with cell_store_free, from any thread
+*/
+CELL_STORE *cell_store_snapshot(CELL_STORE *store);
+/* bytes allocated for the store, its spare capacity included
+*/
+size_t cell_store_mem_usage(const CELL_STORE *store);
+/* widens the bit fields to hold dims dimensions of the given cardinalities,
+   repacking the stored cells if needed. fails if they need over 64 bits
+*/
+int cell_store_fit(CELL_STORE *store, size_t dims, const size_t *cards);
+/* ords holds store->dims ordinals, each already rank + 1
+*/
+uint64_t cell_store_pack(const CELL_STORE *store, const uint32_t *ords);
+uint32_t cell_store_ord(const CELL_STORE *store, uint64_t coord, size_t dim);
+/* index of a live cell, -1 when the cell is not populated
+*/
+long cell_store_find(const CELL_STORE *store, uint64_t coord);
+/* index of the first sorted coordinate not below coord, the tail is not
+   looked at so compact first
+*/
+size_t cell_store_seek(const CELL_STORE *store, uint64_t coord);
+/* index of the cell, appending it when not populated, -1 on no memory.
+   appending may compact the store, earlier indexes are then stale
+*/
+long cell_store_insert(CELL_STORE *store, uint64_t coord);
+/* writes fail only when the columns had to be copied off a snapshot and
+   there was no memory for it
+*/
+int cell_store_set_int(CELL_STORE *store, size_t i, int64_t val);
+int cell_store_set_double(CELL_STORE *store, size_t i, double val);
+double cell_store_double(const CELL_STORE *store, size_t i);
+int cell_store_delete(CELL_STORE *store, size_t i);
+/* sorts the tail into place and drops deleted cells
+*/
+int cell_store_compact(CELL_STORE *store);
+/* returned pointer must be freed
+*/
+char *cell_store_serialize(const CELL_STORE *store, size_t *len);
+CELL_STORE *cell_store_deserialize(const char *buf, size_t len);
+
+#endif /* CELLSTORE_H */
@@ -0,0 +1,57 @@
+#!/bin/sh
+# runs every check/<name>.in, or those named, through redis-cli against a
+# fresh redis-server with the module loaded and compares the replies with
+# check/<name>.out:
+#   check/run.sh [<name>...]
+# check/<name>.args holds the module arguments of a check, @DIR@ in them
+# stands for the server's directory. needs redis-server and redis-cli on
+# PATH and the module built
+set -e
+
+CHECKS=$(cd "$(dirname "$0")" && pwd)
+MODULE="$CHECKS/../redischema.so"
+PORT=${CHECK_PORT:-6398}
+WORK=$(mktemp -d)
+SERVER=
+FAILED=0
+
+cleanup() {
+  if [ -n "$SERVER" ]; then
+    kill "$SERVER" 2>/dev/null || true
+  fi
+  rm -rf "$WORK"
+}
+trap cleanup EXIT INT TERM
+
+for tool in redis-server redis-cli; do
+  command -v $tool >/dev/null || { echo "$tool not found" >&2; exit 1; }
+done
+[ -f "$MODULE" ] || { echo "build the module first" >&2; exit 1; }
+
+if [ $# -eq 0 ]; then
+  set -- $(cd "$CHECKS" && ls *.in | sed 's/\.in$//')
+fi
+
+for name in "$@"; do
+  dir="$WORK/$name"
+  mkdir -p "$dir"
+  args=
+  if [ -f "$CHECKS/$name.args" ]; then
+    args=$(sed "s|@DIR@|$dir|g" "$CHECKS/$name.args")
+  fi
+  redis-server --port "$PORT" --dir "$dir" --save '' --appendonly no \
+    --loadmodule "$MODULE" $args >/dev/null &
+  SERVER=$!
+  until redis-cli -p "$PORT" ping >/dev/null 2>&1; do sleep 0.1; done
+  redis-cli -p "$PORT" < "$CHECKS/$name.in" > "$dir/replies" 2>&1
+  kill "$SERVER"
+  wait "$SERVER" 2>/dev/null || true
+  SERVER=
+  if diff -u "$CHECKS/$name.out" "$dir/replies"; then
+    echo "$name ok"
+  else
+    echo "$name FAILED"
+    FAILED=1
+  fi
+done
+exit $FAILED
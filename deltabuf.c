@@ -0,0 +1,142 @@
+#include <stdlib.h>
+#include <string.h>
+#include "deltabuf.h"
+
+static uint64_t hash_key(const char *key) {
+  uint64_t hash = 14695981039346656037ULL; //FNV-1a
+  for(; *key != '\0'; ++key) {
+    hash ^= (unsigned char)*key;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+static DELTA_ENTRY *find_slot(DELTA_ENTRY *slots, size_t cap,
+  const char *key) {
+  size_t i = hash_key(key) & (cap - 1);
+  while(slots[i].key != NULL && strcmp(slots[i].key, key) != 0)
+    i = (i + 1) & (cap - 1);
+  return &slots[i];
+}
+
+/* moves the entries into a table of cap slots
+*/
+static int rehash(DELTA_BUF *buf, size_t cap) {
+  DELTA_ENTRY *slots = calloc(cap, sizeof(DELTA_ENTRY));
+  if(slots == NULL)
+    return -1;
+  for(size_t i=0; i < buf->cap; ++i) {
+    if(buf->slots[i].key != NULL)
+      *find_slot(slots, cap, buf->slots[i].key) = buf->slots[i];
+  }
+  free(buf->slots);
+  buf->slots = slots;
+  buf->cap = cap;
+  return 0;
+}
+
+DELTA_BUF *delta_buf_new(void) {
+  DELTA_BUF *buf = calloc(1, sizeof(DELTA_BUF));
+  if(buf == NULL)
+    return NULL;
+  buf->slots = calloc(DELTA_BUF_INITIAL_CAP, sizeof(DELTA_ENTRY));
+  if(buf->slots == NULL) {
+    free(buf);
+    return NULL;
+  }
+  buf->cap = DELTA_BUF_INITIAL_CAP;
+  return buf;
+}
+
+void delta_buf_free(DELTA_BUF *buf) {
+  if(buf == NULL)
+    return;
+  for(size_t i=0; i < buf->cap; ++i)
+    free(buf->slots[i].key);
+  free(buf->slots);
+  free(buf);
+}
+
+int delta_buf_add(DELTA_BUF *buf, const char *key, int64_t delta) {
+  if((buf->len + 1) * 2 > buf->cap && rehash(buf, buf->cap * 2) != 0)
+    return -1;
+  DELTA_ENTRY *slot = find_slot(buf->slots, buf->cap, key);
+  if(slot->key == NULL) {
+    slot->key = strdup(key);
+    if(slot->key == NULL)
+      return -1;
+    slot->delta = 0;
+    buf->len++;
+  }
+  if(__builtin_add_overflow(slot->delta, delta, &slot->delta))
+    slot->delta = (delta > 0)? INT64_MAX : INT64_MIN;
+  return 0;
+}
+
+static int taken(const char *key, const char *prefix, size_t prefix_len) {
+  return key != NULL && (prefix == NULL || strncmp(key, prefix, prefix_len) == 0);
+}
+
+int delta_buf_pending(const DELTA_BUF *buf, const char *prefix) {
+  size_t prefix_len = (prefix == NULL)? 0 : strlen(prefix);
+  for(size_t i=0; i < buf->cap; ++i) {
+    if(taken(buf->slots[i].key, prefix, prefix_len))
+      return 1;
+  }
+  return 0;
+}
+
+DELTA_ENTRY *delta_buf_take(DELTA_BUF *buf, const char *prefix, size_t *len) {
+  size_t prefix_len = (prefix == NULL)? 0 : strlen(prefix), count = 0;
+  *len = 0;
+  for(size_t i=0; i < buf->cap; ++i)
+    count += taken(buf->slots[i].key, prefix, prefix_len);
+  if(count == 0)
+    return NULL;
+  //probe chains may run through the slots taken, the rest is placed again
+  DELTA_ENTRY *entries = malloc(count * sizeof(DELTA_ENTRY));
+  DELTA_ENTRY *slots = calloc(buf->cap, sizeof(DELTA_ENTRY));
+  if(entries == NULL || slots == NULL) {
+    free(entries);
+    free(slots);
+    return NULL;
+  }
+  for(size_t i=0; i < buf->cap; ++i) {
+    if(taken(buf->slots[i].key, prefix, prefix_len))
+      entries[(*len)++] = buf->slots[i];
+    else if(buf->slots[i].key != NULL)
+      *find_slot(slots, buf->cap, buf->slots[i].key) = buf->slots[i];
+  }
+  free(buf->slots);
+  buf->slots = slots;
+  buf->len -= count;
+  return entries;
+}
+
+/* whether the slot hashing to home is probed through from, so that it may
+   move back into from when that slot empties
+*/
+static int probes_past(size_t home, size_t from, size_t to) {
+  return (from <= to)? (home <= from || home > to) :
+    (home <= from && home > to);
+}
+
+int delta_buf_drop(DELTA_BUF *buf, const char *key) {
+  DELTA_ENTRY *slot = find_slot(buf->slots, buf->cap, key);
+  if(slot->key == NULL)
+    return 0;
+  free(slot->key);
+  slot->key = NULL;
+  buf->len--;
+  //the entries after it on its probe chain move back into the hole
+  size_t hole = slot - buf->slots, mask = buf->cap - 1;
+  for(size_t i = (hole + 1) & mask; buf->slots[i].key != NULL;
+    i = (i + 1) & mask) {
+    if(probes_past(hash_key(buf->slots[i].key) & mask, hole, i)) {
+      buf->slots[hole] = buf->slots[i];
+      buf->slots[i].key = NULL;
+      hole = i;
+    }
+  }
+  return 1;
+}
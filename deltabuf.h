@@ -0,0 +1,44 @@
+#ifndef DELTABUF_H
+#define DELTABUF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DELTA_BUF_INITIAL_CAP 64 //slots, a power of two
+
+typedef struct delta_entry {
+  char *key; //NULL for an empty slot
+  int64_t delta;
+} DELTA_ENTRY;
+
+/* increments not yet written to their cells, summed per key in an open
+   addressing table kept at most half full
+*/
+typedef struct delta_buf {
+  DELTA_ENTRY *slots;
+  size_t cap;
+  size_t len;
+} DELTA_BUF;
+
+/* returned pointer must be freed with delta_buf_free
+*/
+DELTA_BUF *delta_buf_new(void);
+void delta_buf_free(DELTA_BUF *buf);
+/* adds delta to what key has pending, saturating at the int64 bounds.
+   fails only when there is no memory
+*/
+int delta_buf_add(DELTA_BUF *buf, const char *key, int64_t delta);
+/* removes the entries of the keys starting with prefix, every entry when
+   prefix is NULL, and returns them. the array and its keys must be freed,
+   NULL when none is pending or there is no memory for it
+*/
+DELTA_ENTRY *delta_buf_take(DELTA_BUF *buf, const char *prefix, size_t *len);
+/* whether a key starting with prefix has an entry, any key when prefix is
+   NULL
+*/
+int delta_buf_pending(const DELTA_BUF *buf, const char *prefix);
+/* discards what key has pending, 0 when it has none
+*/
+int delta_buf_drop(DELTA_BUF *buf, const char *key);
+
+#endif /* DELTABUF_H */
@@ -0,0 +1,175 @@
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include "expr.h"
+
+typedef struct compiler {
+  const char *pos;
+  const char **names;
+  size_t name_count;
+  EXPR *expr;
+  size_t height; //values on the stack after the ops emitted so far
+  int nesting;
+} COMPILER;
+
+static int parse_sum(COMPILER *c);
+
+static void skip_spaces(COMPILER *c) {
+  while(isspace((unsigned char)*c->pos))
+    c->pos++;
+}
+
+/* ops never outnumber the characters of the source, so there is room
+*/
+static void emit(COMPILER *c, int type, double num, size_t var) {
+  EXPR_OP *op = &c->expr->ops[c->expr->len++];
+  op->type = type;
+  op->num = num;
+  op->var = var;
+  if(type == EXPR_NUM || type == EXPR_VAR)
+    c->height++;
+  else if(type != EXPR_NEG)
+    c->height--;
+  if(c->height > c->expr->depth)
+    c->expr->depth = c->height;
+}
+
+static int parse_name(COMPILER *c) {
+  const char *start = c->pos;
+  while(isalnum((unsigned char)*c->pos) || *c->pos == '_')
+    c->pos++;
+  size_t len = c->pos - start;
+  for(size_t i=0; i < c->name_count; ++i) {
+    if(strlen(c->names[i]) == len && strncmp(c->names[i], start, len) == 0) {
+      emit(c, EXPR_VAR, 0, i);
+      return 0;
+    }
+  }
+  return -1;
+}
+
+static int parse_primary(COMPILER *c) {
+  skip_spaces(c);
+  if(*c->pos == '(') {
+    c->pos++;
+    if(parse_sum(c) != 0)
+      return -1;
+    skip_spaces(c);
+    if(*c->pos != ')')
+      return -1;
+    c->pos++;
+    return 0;
+  }
+  if(isdigit((unsigned char)*c->pos) || *c->pos == '.') {
+    char *end;
+    double num = strtod(c->pos, &end);
+    if(end == c->pos)
+      return -1;
+    c->pos = end;
+    emit(c, EXPR_NUM, num, 0);
+    return 0;
+  }
+  if(isalpha((unsigned char)*c->pos) || *c->pos == '_')
+    return parse_name(c);
+  return -1;
+}
+
+static int parse_unary(COMPILER *c) {
+  skip_spaces(c);
+  if(*c->pos != '-')
+    return parse_primary(c);
+  c->pos++;
+  if(++c->nesting > EXPR_MAX_NESTING || parse_unary(c) != 0)
+    return -1;
+  c->nesting--;
+  emit(c, EXPR_NEG, 0, 0);
+  return 0;
+}
+
+static int parse_product(COMPILER *c) {
+  if(parse_unary(c) != 0)
+    return -1;
+  for(skip_spaces(c); *c->pos == '*' || *c->pos == '/'; skip_spaces(c)) {
+    int type = (*c->pos++ == '*')? EXPR_MUL : EXPR_DIV;
+    if(parse_unary(c) != 0)
+      return -1;
+    emit(c, type, 0, 0);
+  }
+  return 0;
+}
+
+static int parse_sum(COMPILER *c) {
+  if(++c->nesting > EXPR_MAX_NESTING || parse_product(c) != 0)
+    return -1;
+  for(skip_spaces(c); *c->pos == '+' || *c->pos == '-'; skip_spaces(c)) {
+    int type = (*c->pos++ == '+')? EXPR_ADD : EXPR_SUB;
+    if(parse_product(c) != 0)
+      return -1;
+    emit(c, type, 0, 0);
+  }
+  c->nesting--;
+  return 0;
+}
+
+EXPR *expr_compile(const char *src, const char **names, size_t name_count) {
+  EXPR *expr = calloc(1, sizeof(EXPR));
+  if(expr == NULL)
+    return NULL;
+  expr->ops = malloc((strlen(src) + 1) * sizeof(EXPR_OP));
+  COMPILER c = {.pos = src, .names = names, .name_count = name_count,
+    .expr = expr};
+  if(expr->ops == NULL || parse_sum(&c) != 0) {
+    expr_free(expr);
+    return NULL;
+  }
+  skip_spaces(&c);
+  if(*c.pos != '\0') {
+    expr_free(expr);
+    return NULL;
+  }
+  return expr;
+}
+
+void expr_free(EXPR *expr) {
+  if(expr == NULL)
+    return;
+  free(expr->ops);
+  free(expr);
+}
+
+double expr_eval(const EXPR *expr, const double *vals) {
+  double *stack = malloc(expr->depth * sizeof(double));
+  size_t top = 0;
+  if(stack == NULL)
+    return NAN;
+  for(size_t i=0; i < expr->len; ++i) {
+    const EXPR_OP *op = &expr->ops[i];
+    if(op->type == EXPR_NUM || op->type == EXPR_VAR) {
+      stack[top++] = (op->type == EXPR_NUM)? op->num : vals[op->var];
+      continue;
+    }
+    if(op->type == EXPR_NEG) {
+      stack[top - 1] = -stack[top - 1];
+      continue;
+    }
+    double b = stack[--top], *a = &stack[top - 1];
+    switch(op->type) {
+      case EXPR_ADD:
+        *a += b;
+        break;
+      case EXPR_SUB:
+        *a -= b;
+        break;
+      case EXPR_MUL:
+        *a *= b;
+        break;
+      case EXPR_DIV:
+        *a = (b == 0)? NAN : *a / b;
+        break;
+    }
+  }
+  double ret = stack[0];
+  free(stack);
+  return ret;
+}
@@ -0,0 +1,41 @@
+#ifndef EXPR_H
+#define EXPR_H
+
+#include <stddef.h>
+
+#define EXPR_MAX_NESTING 64
+
+#define EXPR_NUM 0
+#define EXPR_VAR 1
+#define EXPR_ADD 2
+#define EXPR_SUB 3
+#define EXPR_MUL 4
+#define EXPR_DIV 5
+#define EXPR_NEG 6
+
+typedef struct expr_op {
+  int type;
+  double num; //EXPR_NUM
+  size_t var; //EXPR_VAR, index into the names the expression was compiled with
+} EXPR_OP;
+
+/* an arithmetic expression over named values, "(large - small) / small",
+   compiled to postfix so evaluating it needs no parsing
+*/
+typedef struct expr {
+  EXPR_OP *ops;
+  size_t len;
+  size_t depth; //stack slots evaluation needs
+} EXPR;
+
+/* returned pointer must be freed with expr_free, NULL when src does not
+   parse or uses a name not in names
+*/
+EXPR *expr_compile(const char *src, const char **names, size_t name_count);
+void expr_free(EXPR *expr);
+/* vals holds a value per name. NaN when a value used is NaN or when the
+   expression divides by zero
+*/
+double expr_eval(const EXPR *expr, const double *vals);
+
+#endif /* EXPR_H */
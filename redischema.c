@@ -1,9 +1,40 @@
 #include "redismodule.h"
 #include <string.h>
 #include <stdlib.h>
+#include <strings.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
 #include "jsmn.h"
+#include "cellring.h"
+#include "sketch.h"
+#include "tdigest.h"
+#include "cellstore.h"
+#include "expr.h"
+#include "deltabuf.h"
+#include "cellfile.h"
 #include "redischema.h"
 
+static RedisModuleType *CellRingType;
+static RedisModuleType *SketchType;
+static RedisModuleType *CellStoreType;
+static SCHEMA *Schemas; //compiled schemas, see get_schema
+static KEY_CURSOR *KeyCursors; //most recently used first
+static unsigned long long NextCursorId = 1;
+static PREPARED *Prepared; //most recently run first
+static unsigned long long NextPreparedId = 1;
+static long long SliceKeys = SLICE_KEYS_DEFAULT;
+static long long SliceMicros = SLICE_MICROS_DEFAULT;
+static long long BackgroundCells = BACKGROUND_CELLS_DEFAULT;
+static long long BackgroundReads = BACKGROUND_READS_DEFAULT;
+static long long ActiveReads; //background reads not freed yet
+static long long CoalesceMs = COALESCE_MS_DEFAULT;
+static long long ApproxSampleMax = APPROX_SAMPLE_MAX_DEFAULT;
+static char *FileDir; //where SchemaIMPORT and SchemaEXPORT files live, none when NULL
+static DELTA_BUF *PendingDeltas; //"<db>:<cell key>" to the increments not written yet
+static bool FlushScheduled;
+
 int report_error(RedisModuleCtx *ctx, C_CHARS msg, PARSER_STATE *parser) {
   RedisModule_ReplyWithSimpleString(ctx, msg);
   return REDISMODULE_ERR;
@@ -30,6 +61,33 @@ int walk_array(RedisModuleCtx *ctx, jsmntok_t *root, PARSER_STATE *parser) {
   return steps;
 }
 
+/* walk a predicate object, {"gte": "medium", "not": ["dell"]}. each
+   operator's values go through the handler like listed values do
+*/
+int walk_predicate(RedisModuleCtx *ctx, jsmntok_t *root, PARSER_STATE *parser) {
+  int steps = 1; //skip the object opener '{'
+  for (int i=0; i < root->size; ++i) {
+    jsmntok_t *node = root + steps;
+    if (node->type != JSMN_STRING) {
+      parser->err_msg = ERR_MSG_INVALID_INPUT; return MODULE_ERROR;
+    }
+    parser->pred = node;
+    parser->val_ord = 0;
+    steps++;
+    node = root + steps;
+    if (node->type != JSMN_ARRAY && node->type != JSMN_PRIMITIVE &&
+      node->type != JSMN_STRING) {
+      parser->err_msg = ERR_MSG_INVALID_INPUT; return MODULE_ERROR;
+    }
+    int resp = walk_array(ctx, node, parser);
+    if(resp < 0)
+      return MODULE_ERROR;
+    steps += resp;
+  }
+  parser->pred = NULL;
+  return steps;
+}
+
 /* walk a json map walk_object
 */
 int walk_object(RedisModuleCtx *ctx, jsmntok_t *root, PARSER_STATE *parser) {
@@ -50,11 +108,14 @@ int walk_object(RedisModuleCtx *ctx, jsmntok_t *root, PARSER_STATE *parser) {
     parser->val_ord = 0;
     steps++;
     node = root + steps;
-    if (node->type != JSMN_ARRAY && node->type != JSMN_PRIMITIVE &&
+    if (node->type == JSMN_OBJECT && parser->predicates)
+      resp = walk_predicate(ctx, node, parser);
+    else if (node->type != JSMN_ARRAY && node->type != JSMN_PRIMITIVE &&
       node->type != JSMN_STRING) {
       parser->err_msg = ERR_MSG_INVALID_INPUT; return MODULE_ERROR;
     }
-    resp = walk_array(ctx, node, parser);
+    else
+      resp = walk_array(ctx, node, parser);
     if(resp < 0)
       return MODULE_ERROR;
     steps += resp;
@@ -66,7 +127,7 @@ int walk_object(RedisModuleCtx *ctx, jsmntok_t *root, PARSER_STATE *parser) {
 /* walk a json from user input
 */
 int json_walk(RedisModuleCtx *ctx, jsmntok_t *root, PARSER_STATE *parser) {
-  parser->key_ord=0; parser->val_ord= 0;
+  parser->key_ord=0; parser->val_ord= 0; parser->pred = NULL;
   if (root->type != JSMN_OBJECT) {
     parser->err_msg = ERR_MSG_INVALID_INPUT;
     return MODULE_ERROR;
@@ -94,59 +155,79 @@ char* concat_prefix(C_CHARS prefix, C_CHARS str) {
   return ret;
 }
 
-/* returned pointer must be freed
+/* the members of a zset in rank order, read straight off the key.
+   returned array and its strings must be freed
 */
-char *get_string_from_reply(RedisModuleCallReply *reply) {
-  if(reply == NULL)
-    return NULL;
-  size_t len=0;
-  C_CHARS reply_str = RedisModule_CallReplyStringPtr(reply, &len);
-  char *ret = strndup(reply_str, len);
-  return ret;
+char **zset_members(RedisModuleCtx *ctx, C_CHARS key, size_t *count) {
+  RedisModuleString *key_str = RM_CreateString(ctx, key);
+  RedisModuleKey *redis_key = RedisModule_OpenKey(ctx,key_str,REDISMODULE_READ);
+  char **members = NULL;
+  *count = 0;
+  if(RedisModule_KeyType(redis_key) == REDISMODULE_KEYTYPE_ZSET) {
+    members = malloc(sizeof(char*) * RedisModule_ValueLength(redis_key));
+    RedisModule_ZsetFirstInScoreRange(redis_key, 0,
+      REDISMODULE_POSITIVE_INFINITE, 0, 0);
+    while(!RedisModule_ZsetRangeEndReached(redis_key)) {
+      RedisModuleString *elem = RedisModule_ZsetRangeCurrentElement(redis_key,
+        NULL);
+      size_t len;
+      C_CHARS str = RedisModule_StringPtrLen(elem, &len);
+      members[(*count)++] = strndup(str, len);
+      RedisModule_FreeString(ctx, elem);
+      RedisModule_ZsetRangeNext(redis_key);
+    }
+    RedisModule_ZsetRangeStop(redis_key);
+  }
+  RedisModule_CloseKey(redis_key);
+  RedisModule_FreeString(ctx, key_str);
+  return members;
 }
 
-/* returned pointer must be freed
+/* returns the ring held by an open key, creating one when the key is empty,
+   NULL if the key holds anything else
 */
-char *get_reply_element_at(RedisModuleCallReply *reply, int index) {
-  RedisModuleCallReply *elem = RedisModule_CallReplyArrayElement(reply,index);
-  return get_string_from_reply(elem);
+CELL_RING *cell_ring_at(RedisModuleKey *redis_key, SCHEMA_OPTIONS *options) {
+  int type = RedisModule_KeyType(redis_key);
+  if(type == REDISMODULE_KEYTYPE_EMPTY) {
+    CELL_RING *ring = cell_ring_new(options->bucket_resolution,
+      options->bucket_count);
+    if(ring != NULL)
+      RedisModule_ModuleTypeSetValue(redis_key, CellRingType, ring);
+    return ring;
+  }
+  if(type == REDISMODULE_KEYTYPE_MODULE &&
+    RedisModule_ModuleTypeGetType(redis_key) == CellRingType)
+    return RedisModule_ModuleTypeGetValue(redis_key);
+  return NULL;
 }
 
-int get_zset_size(RedisModuleCtx *ctx, C_CHARS key) {
-  RedisModuleCallReply *reply = RedisModule_Call(ctx,ZCOUNT_CMD,ZCOUNT_FMT,
-    key,0,REDISMODULE_POSITIVE_INFINITE);
-  int size = RedisModule_CallReplyInteger(reply);
-  RedisModule_FreeCallReply(reply);
-  return size;
+/* write into the current bucket of a time bucketed cell, returns
+   MODULE_ERROR when the key holds a plain (not bucketed) value
+*/
+int update_cell_ring(RedisModuleCtx *ctx, C_CHARS key,
+  SCHEMA_OPTIONS *options, long long val, bool incr) {
+  RedisModuleString *key_str = RM_CreateString(ctx, key);
+  RedisModuleKey *redis_key=RedisModule_OpenKey(ctx,key_str,REDISMODULE_WRITE);
+  CELL_RING *ring = cell_ring_at(redis_key, options);
+  if(ring != NULL && incr)
+    cell_ring_incrby(ring, options->now, val);
+  else if(ring != NULL)
+    cell_ring_set(ring, options->now, val);
+  RedisModule_CloseKey(redis_key);
+  RedisModule_FreeString(ctx, key_str);
+  return (ring == NULL)? MODULE_ERROR : REDISMODULE_OK;
 }
 
 /* returned pointer must be freed
 */
-char* zset_get_element_by_index(RedisModuleCtx *ctx, C_CHARS key, int index) {
-  RedisModuleCallReply *reply = RedisModule_Call(ctx,ZRANGE_CMD,ZRANGE_FMT,
-    key,index,index);
-  char *elem = get_reply_element_at(reply,0);
-  RedisModule_FreeCallReply(reply);
-  return elem;
-}
-
-//TODO: test for increment of float and string keys, check for errors
-int increment_key(RedisModuleCtx *ctx, C_CHARS key) {
-  RedisModuleCallReply *reply = RedisModule_Call(ctx,INCR_CMD,INCR_FMT,key);
-  if(reply == NULL)
-    return MODULE_ERROR;
-  RedisModule_FreeCallReply(reply);
-  return REDISMODULE_OK;
-}
-
-int zset_get_rank(RedisModuleCtx *ctx, C_CHARS key, C_CHARS member) {
-  RedisModuleCallReply *reply = RedisModule_Call(ctx,ZRANK_CMD,ZRANK_FMT,
-    key,member);
-  if(reply == NULL || RedisModule_CallReplyType(reply)==REDISMODULE_REPLY_NULL)
-    return MODULE_ERROR;
-  int rank = RedisModule_CallReplyInteger(reply);
-  RedisModule_FreeCallReply(reply);
-  return rank;
+char *join_ring_buckets(CELL_RING *ring) {
+  char *buckets = malloc(ring->size * CELL_RING_BUCKET_MAX_LEN + 1), *pos;
+  pos = buckets;
+  for(size_t i=0; i < ring->size; ++i)
+    pos += sprintf(pos, (i == 0)? "%lld" : CELL_RING_BUCKET_DELIM "%lld",
+      ring->buckets[i]);
+  *pos = '\0';
+  return buckets;
 }
 
 int delete_key_with_prefix(RedisModuleCtx *ctx, C_CHARS prefix, C_CHARS key) {
@@ -157,16 +238,470 @@ int delete_key_with_prefix(RedisModuleCtx *ctx, C_CHARS prefix, C_CHARS key) {
 }
 
 int cleanup_schema(RedisModuleCtx *ctx, C_CHARS elem_loc, C_CHARS val_prefix) {
-  int i=0;
-  char *elem = zset_get_element_by_index(ctx, elem_loc,i++);
-  while(elem != NULL) {
-    delete_key_with_prefix(ctx, val_prefix, elem);
-    free(elem);
-    elem = zset_get_element_by_index(ctx, elem_loc,i++);
+  size_t count;
+  char **elems = zset_members(ctx, elem_loc, &count);
+  for(size_t i=0; i < count; ++i) {
+    delete_key_with_prefix(ctx, val_prefix, elems[i]);
+    free(elems[i]);
   }
+  free(elems);
   return delete_key(ctx,elem_loc);
 }
 
+int load_schema_options(RedisModuleCtx *ctx, SCHEMA *schema) {
+  SCHEMA_OPTIONS *options = &schema->options;
+  memset(options, 0, sizeof(*options));
+  RedisModuleString *key_str = RM_CreateString(ctx, schema->options_key);
+  RedisModuleKey *redis_key = RedisModule_OpenKey(ctx,key_str,REDISMODULE_READ);
+  RedisModuleString *resolution = NULL, *count = NULL, *sketch = NULL;
+  RedisModuleString *hashtag = NULL, *sparse = NULL;
+  long long sketch_type = SKETCH_NONE, tagged = 0, packed = 0;
+  if(RedisModule_KeyType(redis_key) == REDISMODULE_KEYTYPE_HASH)
+    RedisModule_HashGet(redis_key, REDISMODULE_HASH_CFIELDS,
+      OPT_BUCKET_RESOLUTION, &resolution, OPT_BUCKET_COUNT, &count,
+      OPT_SKETCH, &sketch, OPT_HASHTAG, &hashtag, OPT_SPARSE, &sparse, NULL);
+  if(resolution != NULL && count != NULL &&
+    (RedisModule_StringToLongLong(resolution, &options->bucket_resolution) ||
+    RedisModule_StringToLongLong(count, &options->bucket_count)))
+    memset(options, 0, sizeof(*options));
+  if(sketch != NULL &&
+    RedisModule_StringToLongLong(sketch, &sketch_type) == REDISMODULE_OK)
+    options->sketch = sketch_type;
+  if(hashtag != NULL &&
+    RedisModule_StringToLongLong(hashtag, &tagged) == REDISMODULE_OK)
+    options->hashtag = tagged;
+  if(sparse != NULL &&
+    RedisModule_StringToLongLong(sparse, &packed) == REDISMODULE_OK)
+    options->sparse = (packed != 0);
+  if(sparse != NULL)
+    RedisModule_FreeString(ctx, sparse);
+  if(hashtag != NULL)
+    RedisModule_FreeString(ctx, hashtag);
+  if(resolution != NULL)
+    RedisModule_FreeString(ctx, resolution);
+  if(count != NULL)
+    RedisModule_FreeString(ctx, count);
+  if(sketch != NULL)
+    RedisModule_FreeString(ctx, sketch);
+  RedisModule_CloseKey(redis_key);
+  RedisModule_FreeString(ctx, key_str);
+  return REDISMODULE_OK;
+}
+
+int save_schema_options(RedisModuleCtx *ctx, SCHEMA *schema) {
+  SCHEMA_OPTIONS *options = &schema->options;
+  if(options->bucket_count == 0 && options->sketch == SKETCH_NONE &&
+    options->hashtag == HASHTAG_NONE && !options->sparse)
+    return REDISMODULE_OK;
+  RedisModuleString *key_str = RM_CreateString(ctx, schema->options_key);
+  RedisModuleKey *redis_key=RedisModule_OpenKey(ctx,key_str,REDISMODULE_WRITE);
+  RedisModuleString *resolution = RedisModule_CreateStringFromLongLong(ctx,
+    options->bucket_resolution);
+  RedisModuleString *count = RedisModule_CreateStringFromLongLong(ctx,
+    options->bucket_count);
+  RedisModuleString *sketch = RedisModule_CreateStringFromLongLong(ctx,
+    options->sketch);
+  RedisModuleString *hashtag = RedisModule_CreateStringFromLongLong(ctx,
+    options->hashtag);
+  RedisModuleString *sparse = RedisModule_CreateStringFromLongLong(ctx,
+    options->sparse);
+  RedisModule_HashSet(redis_key, REDISMODULE_HASH_CFIELDS,
+    OPT_BUCKET_RESOLUTION, resolution, OPT_BUCKET_COUNT, count,
+    OPT_SKETCH, sketch, OPT_HASHTAG, hashtag, OPT_SPARSE, sparse, NULL);
+  RedisModule_FreeString(ctx, sparse);
+  RedisModule_FreeString(ctx, hashtag);
+  RedisModule_FreeString(ctx, sketch);
+  RedisModule_FreeString(ctx, count);
+  RedisModule_FreeString(ctx, resolution);
+  RedisModule_CloseKey(redis_key);
+  RedisModule_FreeString(ctx, key_str);
+  return REDISMODULE_OK;
+}
+
+/* names end up in key names and KEYS patterns, so they are kept plain
+*/
+bool valid_schema_name(C_CHARS name) {
+  return name[0] != '\0' && strspn(name, SCHEMA_NAME_CHARS) == strlen(name) &&
+    strcmp(name, SCHEMA_RESERVED_NAME) != 0;
+}
+
+/* returned pointer must be freed, "module:schema:{<name>}:" followed by
+   what. the metadata of a schema shares the slot of its name
+*/
+char *schema_meta_key(C_CHARS name, C_CHARS what) {
+  char *ret = malloc(strlen(SCHEMA_META_PREFIX) + strlen(name) +
+    strlen(what) + 4);
+  sprintf(ret, "%s%c%s%c" REDIS_HIERARCHY_DELIM "%s", SCHEMA_META_PREFIX,
+    HASHTAG_OPEN, name, HASHTAG_CLOSE, what);
+  return ret;
+}
+
+/* "<name>:", or "{<name>}:" when HASHTAG NAME keeps every cell in the
+   slot of the name
+*/
+void set_schema_prefix(SCHEMA *schema) {
+  free(schema->prefix);
+  if(schema->options.hashtag != HASHTAG_NAME) {
+    schema->prefix = concat_prefix(schema->name, REDIS_HIERARCHY_DELIM);
+    return;
+  }
+  schema->prefix = malloc(strlen(schema->name) + 4);
+  sprintf(schema->prefix, "%c%s%c" REDIS_HIERARCHY_DELIM, HASHTAG_OPEN,
+    schema->name, HASHTAG_CLOSE);
+}
+
+/* returned pointer must be released with release_schema, holds no
+   dimensions yet. every version keeps its metadata under its own keys
+*/
+SCHEMA *new_schema(C_CHARS name, long long version) {
+  SCHEMA *schema = calloc(1, sizeof(SCHEMA));
+  char ver[CELL_VALUE_MAX_LEN];
+  sprintf(ver, "%lld", version);
+  char *meta = schema_meta_key(name, ver);
+  schema->name = strdup(name);
+  schema->version = version;
+  schema->refs = 1;
+  schema->prefix = concat_prefix(name, REDIS_HIERARCHY_DELIM);
+  schema->version_key = schema_meta_key(name, SCHEMA_VERSION_KEY);
+  schema->order_key = concat_prefix(meta, SCHEMA_KEY_SET);
+  schema->keys_prefix = concat_prefix(meta, SCHEMA_KEY_PREFIX);
+  schema->options_key = concat_prefix(meta, SCHEMA_OPTIONS_KEY);
+  schema->store_key = schema_meta_key(name, SCHEMA_STORE_KEY);
+  schema->parents_prefix = concat_prefix(meta, SCHEMA_PARENTS_PREFIX);
+  schema->rollup_key = concat_prefix(meta, SCHEMA_ROLLUP_KEY);
+  free(meta);
+  return schema;
+}
+
+void free_schema(SCHEMA *schema) {
+  for(size_t i=0; i < schema->dim_count; ++i) {
+    for(size_t j=0; j < schema->dims[i].val_count; ++j)
+      free(schema->dims[i].vals[j]);
+    for(size_t j=0; j < schema->dims[i].group_count; ++j)
+      free(schema->dims[i].groups[j]);
+    free(schema->dims[i].vals);
+    free(schema->dims[i].by_name);
+    free(schema->dims[i].val_parents);
+    free(schema->dims[i].groups);
+    free(schema->dims[i].group_parents);
+    free(schema->dims[i].name);
+  }
+  free(schema->dims);
+  free(schema->rollup_key);
+  free(schema->parents_prefix);
+  free(schema->store_key);
+  free(schema->options_key);
+  free(schema->keys_prefix);
+  free(schema->order_key);
+  free(schema->version_key);
+  free(schema->prefix);
+  free(schema->name);
+  free(schema);
+}
+
+/* a command holds a reference for as long as it runs, so a version that
+   was swapped out is only freed once nothing uses it anymore
+*/
+SCHEMA *retain_schema(SCHEMA *schema) {
+  schema->refs++;
+  return schema;
+}
+
+void release_schema(SCHEMA *schema) {
+  if(--schema->refs == 0)
+    free_schema(schema);
+}
+
+int schema_dim_rank(SCHEMA *schema, C_CHARS dim) {
+  for(size_t i=0; i < schema->dim_count; ++i) {
+    if(strcmp(schema->dims[i].name, dim) == 0)
+      return i;
+  }
+  return MODULE_ERROR;
+}
+
+/* position in by_name of the first of its first n ranks not below val
+*/
+size_t schema_val_bound(SCHEMA_DIM *dim, size_t n, C_CHARS val) {
+  size_t lo = 0, hi = n;
+  while(lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if(strcmp(dim->vals[dim->by_name[mid]], val) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* a binary search, every key segment of every scanned cell is looked up
+*/
+int schema_val_rank(SCHEMA *schema, int dim, C_CHARS val) {
+  SCHEMA_DIM *schema_dim = &schema->dims[dim];
+  size_t at = schema_val_bound(schema_dim, schema_dim->val_count, val);
+  if(at < schema_dim->val_count &&
+    strcmp(schema_dim->vals[schema_dim->by_name[at]], val) == 0)
+    return schema_dim->by_name[at];
+  return MODULE_ERROR;
+}
+
+/* files vals[rank] into by_name, which holds the ranks below it
+*/
+void index_schema_val(SCHEMA_DIM *dim, size_t rank) {
+  size_t at = schema_val_bound(dim, rank, dim->vals[rank]);
+  memmove(&dim->by_name[at + 1], &dim->by_name[at],
+    (rank - at) * sizeof(size_t));
+  dim->by_name[at] = rank;
+}
+
+/* reads the dimensions, values and options of a schema once, queries use
+   the compiled copy instead of going back to the zsets
+*/
+SCHEMA *compile_schema(RedisModuleCtx *ctx, C_CHARS name, long long version) {
+  SCHEMA *schema = new_schema(name, version);
+  load_schema_options(ctx, schema);
+  set_schema_prefix(schema);
+  char **names = zset_members(ctx, schema->order_key, &schema->dim_count);
+  schema->dims = calloc(schema->dim_count, sizeof(SCHEMA_DIM));
+  for(size_t i=0; i < schema->dim_count; ++i) {
+    SCHEMA_DIM *dim = &schema->dims[i];
+    dim->name = names[i];
+    char *full_key = concat_prefix(schema->keys_prefix, dim->name);
+    dim->vals = zset_members(ctx, full_key, &dim->val_count);
+    dim->by_name = malloc(sizeof(size_t) * dim->val_count);
+    for(size_t j=0; j < dim->val_count; ++j)
+      index_schema_val(dim, j);
+    free(full_key);
+  }
+  free(names);
+  return schema;
+}
+
+int schema_group_index(SCHEMA_DIM *dim, C_CHARS name) {
+  for(size_t g=0; g < dim->group_count; ++g) {
+    if(strcmp(dim->groups[g], name) == 0)
+      return g;
+  }
+  return MODULE_ERROR;
+}
+
+/* the parent named in a "<child>:<parent>" pair, added to groups when new
+*/
+int compile_group(SCHEMA_DIM *dim, C_CHARS parent) {
+  int g = schema_group_index(dim, parent);
+  if(g != MODULE_ERROR)
+    return g;
+  dim->groups[dim->group_count] = strdup(parent);
+  dim->group_parents[dim->group_count] = -1;
+  return dim->group_count++;
+}
+
+/* reads the PARENTS pairs of every dimension. a pair that gives a child a
+   second parent, a parent that is also a value or a loop is left out and
+   fails the compilation, SchemaLoad refuses such a hierarchy
+*/
+int compile_parents(RedisModuleCtx *ctx, SCHEMA *schema) {
+  int rsp = REDISMODULE_OK;
+  for(size_t d=0; d < schema->dim_count; ++d) {
+    SCHEMA_DIM *dim = &schema->dims[d];
+    size_t count;
+    char *full_key = concat_prefix(schema->parents_prefix, dim->name);
+    char **pairs = zset_members(ctx, full_key, &count);
+    free(full_key);
+    dim->val_parents = malloc(sizeof(int) * (dim->val_count + 1));
+    dim->groups = malloc(sizeof(char*) * (count + 1));
+    dim->group_parents = malloc(sizeof(int) * (count + 1));
+    for(size_t r=0; r < dim->val_count; ++r)
+      dim->val_parents[r] = -1;
+    for(size_t i=0; i < count; ++i) {
+      char *parent = strchr(pairs[i], REDIS_HIERARCHY_DELIM[0]);
+      if(parent == NULL || parent == pairs[i] ||
+        schema_val_rank(schema, d, parent + 1) != MODULE_ERROR) {
+        pairs[i][0] = '\0';
+        rsp = MODULE_ERROR;
+        continue;
+      }
+      *parent = '\0';
+      compile_group(dim, parent + 1);
+    }
+    for(size_t i=0; i < count; ++i) {
+      if(pairs[i][0] == '\0')
+        continue;
+      C_CHARS child = pairs[i], parent = child + strlen(child) + 1;
+      int g = schema_group_index(dim, parent);
+      int rank = schema_val_rank(schema, d, child);
+      int child_g = schema_group_index(dim, child);
+      if(rank != MODULE_ERROR && dim->val_parents[rank] == -1)
+        dim->val_parents[rank] = g;
+      else if(child_g != MODULE_ERROR && dim->group_parents[child_g] == -1)
+        dim->group_parents[child_g] = g;
+      else
+        rsp = MODULE_ERROR;
+    }
+    for(size_t g=0; g < dim->group_count; ++g) {
+      int up = dim->group_parents[g];
+      for(size_t steps=0; up != -1 && steps < dim->group_count; ++steps)
+        up = dim->group_parents[up];
+      if(up != -1) { //a loop, cut where it was found
+        dim->group_parents[g] = -1;
+        rsp = MODULE_ERROR;
+      }
+    }
+    for(size_t i=0; i < count; ++i)
+      free(pairs[i]);
+    free(pairs);
+  }
+  return rsp;
+}
+
+/* whether rank sits anywhere below group g
+*/
+bool under_group(SCHEMA_DIM *dim, size_t rank, int g) {
+  for(int up = dim->val_parents[rank]; up != -1; up = dim->group_parents[up]) {
+    if(up == g)
+      return true;
+  }
+  return false;
+}
+
+/* returned pointer must be released with release_schema. SchemaADDVALUE
+   and SchemaADDDIM change a compiled schema in place, a reader off the
+   main thread works on a copy
+*/
+SCHEMA *copy_schema(SCHEMA *schema) {
+  SCHEMA *copy = new_schema(schema->name, schema->version);
+  copy->options = schema->options;
+  set_schema_prefix(copy);
+  copy->dim_count = schema->dim_count;
+  copy->dims = calloc(schema->dim_count, sizeof(SCHEMA_DIM));
+  for(size_t i=0; i < schema->dim_count; ++i) {
+    SCHEMA_DIM *from = &schema->dims[i], *to = &copy->dims[i];
+    to->name = strdup(from->name);
+    to->val_count = from->val_count;
+    to->vals = malloc(sizeof(char*) * from->val_count);
+    to->by_name = malloc(sizeof(size_t) * from->val_count);
+    // a dimension SchemaADDDIM just appended has no arrays to copy yet
+    if(from->val_count > 0)
+      memcpy(to->by_name, from->by_name, sizeof(size_t) * from->val_count);
+    for(size_t j=0; j < from->val_count; ++j)
+      to->vals[j] = strdup(from->vals[j]);
+    to->group_count = from->group_count;
+    to->val_parents = malloc(sizeof(int) * (from->val_count + 1));
+    to->groups = malloc(sizeof(char*) * (from->group_count + 1));
+    to->group_parents = malloc(sizeof(int) * (from->group_count + 1));
+    if(from->val_count > 0)
+      memcpy(to->val_parents, from->val_parents,
+        sizeof(int) * from->val_count);
+    if(from->group_count > 0)
+      memcpy(to->group_parents, from->group_parents,
+        sizeof(int) * from->group_count);
+    for(size_t j=0; j < from->group_count; ++j)
+      to->groups[j] = strdup(from->groups[j]);
+  }
+  return copy;
+}
+
+void unregister_schema(C_CHARS name) {
+  for(SCHEMA **at = &Schemas; *at != NULL; at = &(*at)->next) {
+    if(strcmp((*at)->name, name) == 0) {
+      SCHEMA *schema = *at;
+      *at = schema->next;
+      release_schema(schema);
+      return;
+    }
+  }
+}
+
+/* the published version of a schema, 0 when it was never loaded
+*/
+long long read_schema_version(RedisModuleCtx *ctx, C_CHARS version_key) {
+  RedisModuleString *key_str = RM_CreateString(ctx, version_key);
+  RedisModuleKey *redis_key = RedisModule_OpenKey(ctx,key_str,REDISMODULE_READ);
+  long long version = 0;
+  if(RedisModule_KeyType(redis_key) == REDISMODULE_KEYTYPE_STRING) {
+    size_t len;
+    C_CHARS str = RedisModule_StringDMA(redis_key, &len, REDISMODULE_READ);
+    char buf[CELL_VALUE_MAX_LEN];
+    if(len < sizeof(buf)) {
+      memcpy(buf, str, len);
+      buf[len] = '\0';
+      version = strtoll(buf, NULL, 10);
+    }
+  }
+  RedisModule_CloseKey(redis_key);
+  RedisModule_FreeString(ctx, key_str);
+  return version;
+}
+
+/* publishing a version is a single key write, readers see either the old
+   or the new schema and never one that is half built
+*/
+int publish_schema_version(RedisModuleCtx *ctx, SCHEMA *schema) {
+  RedisModuleString *key_str = RM_CreateString(ctx, schema->version_key);
+  RedisModuleKey *redis_key=RedisModule_OpenKey(ctx,key_str,REDISMODULE_WRITE);
+  RedisModuleString *version = RedisModule_CreateStringFromLongLong(ctx,
+    schema->version);
+  int rsp = RedisModule_StringSet(redis_key, version);
+  RedisModule_FreeString(ctx, version);
+  RedisModule_CloseKey(redis_key);
+  RedisModule_FreeString(ctx, key_str);
+  return rsp;
+}
+
+/* the compiled published version of a schema, NULL when it was never
+   loaded. a version published by someone else (a replica stream, an AOF)
+   replaces the compiled one
+*/
+SCHEMA *get_schema(RedisModuleCtx *ctx, C_CHARS name) {
+  SCHEMA *schema = Schemas;
+  while(schema != NULL && strcmp(schema->name, name) != 0)
+    schema = schema->next;
+  char *version_key = schema_meta_key(name, SCHEMA_VERSION_KEY);
+  long long version = read_schema_version(ctx, version_key);
+  free(version_key);
+  if(schema != NULL && schema->version == version)
+    return schema;
+  unregister_schema(name);
+  if(version == 0)
+    return NULL;
+  schema = compile_schema(ctx, name, version);
+  compile_parents(ctx, schema);
+  if(schema->dim_count == 0) {
+    release_schema(schema);
+    return NULL;
+  }
+  schema->next = Schemas;
+  Schemas = schema;
+  return schema;
+}
+
+/* deletes the metadata of one version, cells are kept
+*/
+int drop_schema_version(RedisModuleCtx *ctx, C_CHARS name, long long version) {
+  SCHEMA *schema = new_schema(name, version);
+  size_t count;
+  char **dims = zset_members(ctx, schema->order_key, &count);
+  for(size_t i=0; i < count; ++i) {
+    delete_key_with_prefix(ctx, schema->parents_prefix, dims[i]);
+    free(dims[i]);
+  }
+  free(dims);
+  delete_key(ctx, schema->rollup_key);
+  delete_key(ctx, schema->options_key);
+  int rsp = cleanup_schema(ctx, schema->order_key, schema->keys_prefix);
+  release_schema(schema);
+  return rsp;
+}
+
+int drop_schema(RedisModuleCtx *ctx, C_CHARS name) {
+  char *version_key = schema_meta_key(name, SCHEMA_VERSION_KEY);
+  long long version = read_schema_version(ctx, version_key);
+  unregister_schema(name);
+  delete_key(ctx, version_key);
+  free(version_key);
+  return drop_schema_version(ctx, name, version);
+}
+
 int add_elm_to_zset(RedisModuleCtx *ctx, C_CHARS key, C_CHARS key_set,int ord) {
   RedisModuleString *key_str = RM_CreateString(ctx, key);
   RedisModuleString *key_set_str = RM_CreateString(ctx, key_set);
@@ -192,6 +727,66 @@ int add_schema_val(RedisModuleCtx *ctx, C_CHARS val, C_CHARS key,
   return rsp;
 }
 
+/* appends a value with the next ordinal of its dimension, to the zset and to
+   the compiled schema. MODULE_ERROR if the value is already there
+*/
+int append_schema_val(RedisModuleCtx *ctx, SCHEMA *schema, int dim,
+  C_CHARS val) {
+  SCHEMA_DIM *schema_dim = &schema->dims[dim];
+  if(schema_val_rank(schema, dim, val) != MODULE_ERROR)
+    return MODULE_ERROR;
+  char **vals = realloc(schema_dim->vals,
+    sizeof(char*) * (schema_dim->val_count + 1));
+  if(vals == NULL)
+    return MODULE_ERROR;
+  schema_dim->vals = vals;
+  size_t *by_name = realloc(schema_dim->by_name,
+    sizeof(size_t) * (schema_dim->val_count + 1));
+  if(by_name == NULL)
+    return MODULE_ERROR;
+  schema_dim->by_name = by_name;
+  int *val_parents = realloc(schema_dim->val_parents,
+    sizeof(int) * (schema_dim->val_count + 1));
+  if(val_parents == NULL)
+    return MODULE_ERROR;
+  schema_dim->val_parents = val_parents;
+  val_parents[schema_dim->val_count] = -1;
+  if(add_schema_val(ctx, val, schema_dim->name, schema->keys_prefix,
+    schema_dim->val_count) != REDISMODULE_OK)
+    return MODULE_ERROR;
+  schema_dim->vals[schema_dim->val_count] = strdup(val);
+  index_schema_val(schema_dim, schema_dim->val_count++);
+  schema->changes++;
+  return REDISMODULE_OK;
+}
+
+/* appends a dimension after the existing ones, cells written before it
+   simply have no segment for it
+*/
+int append_schema_dim(RedisModuleCtx *ctx, SCHEMA *schema, C_CHARS dim) {
+  if(schema_dim_rank(schema, dim) != MODULE_ERROR)
+    return MODULE_ERROR;
+  SCHEMA_DIM *dims = realloc(schema->dims,
+    sizeof(SCHEMA_DIM) * (schema->dim_count + 1));
+  if(dims == NULL)
+    return MODULE_ERROR;
+  schema->dims = dims;
+  if(add_schema_key(ctx, dim, schema->order_key, schema->dim_count) !=
+    REDISMODULE_OK)
+    return MODULE_ERROR;
+  SCHEMA_DIM *schema_dim = &schema->dims[schema->dim_count++];
+  schema_dim->name = strdup(dim);
+  schema_dim->vals = NULL;
+  schema_dim->by_name = NULL;
+  schema_dim->val_count = 0;
+  schema_dim->val_parents = NULL;
+  schema_dim->groups = NULL;
+  schema_dim->group_parents = NULL;
+  schema_dim->group_count = 0;
+  schema->changes++;
+  return REDISMODULE_OK;
+}
+
 /* returned pointer must be freed
 */
 char* token_to_string(jsmntok_t *token, C_CHARS input) {
@@ -205,81 +800,347 @@ int SchemaLoad_handler(RedisModuleCtx *ctx, PARSER_STATE *parser) {
   char *val = token_to_string(parser->val, parser->input);
   int ret = REDISMODULE_ERR;
   if(parser->stage == PARSER_KEY)
-    ret = add_schema_key(ctx, key, SCHEMA_KEY_SET ,parser->key_ord);
+    ret = add_schema_key(ctx, key, parser->schema->order_key, parser->key_ord);
   else if (parser->stage == PARSER_VAL)
-      ret = add_schema_val(ctx, val, key, SCHEMA_KEY_PREFIX, parser->val_ord);
+      ret = add_schema_val(ctx, val, key, parser->schema->keys_prefix,
+        parser->val_ord);
   free(val);
   free(key);
   return ret;
 }
 
+/* {"location": {"usa": ["new-york", "boston"], "americas": "usa"}} is
+   kept as zset members "<child>:<parent>", checked once it is compiled
+*/
+int SchemaParents_handler(RedisModuleCtx *ctx, PARSER_STATE *parser) {
+  char *key = token_to_string(parser->key, parser->input);
+  char *parent = token_to_string(parser->pred, parser->input);
+  char *child = token_to_string(parser->val, parser->input);
+  int ret = MODULE_ERROR;
+  double score;
+  if(parser->stage == PARSER_KEY) {
+    RedisModuleString *key_str = RM_CreateString(ctx, parser->schema->order_key);
+    RedisModuleString *dim = RM_CreateString(ctx, key);
+    RedisModuleKey *redis_key = RedisModule_OpenKey(ctx, key_str,
+      REDISMODULE_READ);
+    if(RedisModule_ZsetScore(redis_key, dim, &score) == REDISMODULE_OK)
+      ret = REDISMODULE_OK;
+    RedisModule_CloseKey(redis_key);
+    RedisModule_FreeString(ctx, dim);
+    RedisModule_FreeString(ctx, key_str);
+  }
+  else if(parser->stage == PARSER_VAL && parent != NULL && parent[0] != '\0' &&
+    strstr(parent, REDIS_HIERARCHY_DELIM) == NULL) {
+    char *pair = malloc(strlen(child) + strlen(parent) + 2);
+    sprintf(pair, "%s" REDIS_HIERARCHY_DELIM "%s", child, parent);
+    ret = (add_schema_val(ctx, pair, key, parser->schema->parents_prefix, 0)
+      < 0)? MODULE_ERROR : REDISMODULE_OK;
+    free(pair);
+  }
+  if(ret != REDISMODULE_OK)
+    parser->err_msg = ERR_MSG_INVALID_PARENTS;
+  free(child);
+  free(parent);
+  free(key);
+  return ret;
+}
+
 int check_key_update_parser(RedisModuleCtx *ctx, PARSER_STATE* parser) {
   char *key = token_to_string(parser->key, parser->input);
-  int rank = zset_get_rank(ctx, SCHEMA_KEY_SET, key), ret = MODULE_ERROR;
+  int rank = schema_dim_rank(parser->schema, key), ret = MODULE_ERROR;
   if(rank == MODULE_ERROR) {
     parser->err_msg = ERR_MSG_MEMBER_NOT_FOUND;
     ret = MODULE_ERROR;
   }
   else {
     parser->schema_key_ord = rank;
+    //a dimension named twice is filtered by the last one
+    free(parser->query.masks[rank]);
+    free(parser->query.groups[rank]);
+    parser->query.masks[rank] = NULL;
+    parser->query.groups[rank] = NULL;
     ret = REDISMODULE_OK;
   }
   free(key);
   return ret;
 }
 
+/* parse a cell value as an exact integer, falling back to a double
+*/
+CELL_STATUS parse_cell_value(C_CHARS str, size_t len, CELL_VALUE *val) {
+  char buf[CELL_VALUE_MAX_LEN], *end;
+  if(len == 0 || len >= sizeof(buf))
+    return CELL_NAN;
+  memcpy(buf, str, len);
+  buf[len] = '\0';
+  errno = 0;
+  val->ival = strtoll(buf, &end, 10);
+  if(errno == 0 && *end == '\0') {
+    val->is_int = true;
+    val->dval = val->ival;
+    return CELL_OK;
+  }
+  errno = 0;
+  val->dval = strtod(buf, &end);
+  if(errno != 0 || *end != '\0' || isnan(val->dval))
+    return CELL_NAN;
+  val->is_int = false;
+  return CELL_OK;
+}
+
+/* the mask a filter on dim builds, created with every value passing or
+   none, NULL on no memory
+*/
+unsigned char *query_mask(Query *query, int dim, bool pass) {
+  unsigned char **mask = &query->masks[dim];
+  if(*mask == NULL) {
+    size_t len = query->schema->dims[dim].val_count + 1;
+    *mask = calloc(len, 1);
+    if(*mask != NULL && pass)
+      memset(*mask + 1, 1, len - 1);
+  }
+  return *mask;
+}
+
+/* orders val against bound, by rank when bound is a value of the dimension
+   and by number otherwise, for dimensions of numeric buckets. MODULE_ERROR
+   leaves val out
+*/
+int compare_to_bound(SCHEMA *schema, int dim, int rank, C_CHARS bound,
+  int *cmp) {
+  int bound_rank = schema_val_rank(schema, dim, bound);
+  if(bound_rank != MODULE_ERROR) {
+    *cmp = (rank > bound_rank) - (rank < bound_rank);
+    return REDISMODULE_OK;
+  }
+  CELL_VALUE num, bound_num;
+  C_CHARS val = schema->dims[dim].vals[rank];
+  if(parse_cell_value(val, strlen(val), &num) != CELL_OK ||
+    parse_cell_value(bound, strlen(bound), &bound_num) != CELL_OK)
+    return MODULE_ERROR;
+  *cmp = (num.dval > bound_num.dval) - (num.dval < bound_num.dval);
+  return REDISMODULE_OK;
+}
+
+/* {"gte": "medium"} and the like keep the values on one side of the bound
+*/
+int apply_range_predicate(PARSER_STATE *parser, C_CHARS op, C_CHARS bound) {
+  int dim = parser->schema_key_ord;
+  bool gt = (strcmp(op, PRED_GT) == 0 || strcmp(op, PRED_GTE) == 0);
+  bool eq = (strcmp(op, PRED_GTE) == 0 || strcmp(op, PRED_LTE) == 0);
+  unsigned char *mask = query_mask(&parser->query, dim, true);
+  CELL_VALUE bound_num;
+  if(schema_val_rank(parser->schema, dim, bound) == MODULE_ERROR &&
+    parse_cell_value(bound, strlen(bound), &bound_num) != CELL_OK)
+    parser->err_msg = ERR_MSG_MEMBER_NOT_FOUND;
+  else if(mask == NULL)
+    parser->err_msg = ERR_MSG_NO_MEM;
+  for(size_t r=0; parser->err_msg == NULL &&
+    r < parser->schema->dims[dim].val_count; ++r) {
+    int cmp;
+    bool pass = compare_to_bound(parser->schema, dim, r, bound, &cmp) ==
+      REDISMODULE_OK && ((gt? cmp > 0 : cmp < 0) || (eq && cmp == 0));
+    if(!pass)
+      mask[r + 1] = 0;
+  }
+  return (parser->err_msg == NULL)? REDISMODULE_OK : MODULE_ERROR;
+}
+
+/* naming a parent selects every value below it. the parents named are
+   kept too, a SUM over them can read their sums, see rollup_query
+*/
+int apply_group(PARSER_STATE *parser, int g, bool pass) {
+  int dim = parser->schema_key_ord;
+  SCHEMA_DIM *schema_dim = &parser->schema->dims[dim];
+  unsigned char *mask = query_mask(&parser->query, dim, !pass);
+  unsigned char **groups = &parser->query.groups[dim];
+  if(pass && *groups == NULL)
+    *groups = calloc(schema_dim->group_count, 1);
+  if(mask == NULL || (pass && *groups == NULL)) {
+    parser->err_msg = ERR_MSG_NO_MEM;
+    return MODULE_ERROR;
+  }
+  for(size_t r=0; r < schema_dim->val_count; ++r) {
+    if(under_group(schema_dim, r, g))
+      mask[r + 1] = pass;
+  }
+  if(pass)
+    (*groups)[g] = 1;
+  return REDISMODULE_OK;
+}
+
+int apply_predicate(PARSER_STATE *parser, C_CHARS val) {
+  char *op = token_to_string(parser->pred, parser->input);
+  int dim = parser->schema_key_ord;
+  if(strcmp(op, PRED_NOT) == 0) {
+    int rank = schema_val_rank(parser->schema, dim, val);
+    int g = schema_group_index(&parser->schema->dims[dim], val);
+    unsigned char *mask = query_mask(&parser->query, dim, true);
+    if(rank == MODULE_ERROR && g != MODULE_ERROR)
+      apply_group(parser, g, false);
+    else if(rank == MODULE_ERROR)
+      parser->err_msg = ERR_MSG_MEMBER_NOT_FOUND;
+    else if(mask == NULL)
+      parser->err_msg = ERR_MSG_NO_MEM;
+    else
+      mask[rank + 1] = 0;
+  }
+  else if((strcmp(op, PRED_GT) == 0 || strcmp(op, PRED_GTE) == 0 ||
+    strcmp(op, PRED_LT) == 0 || strcmp(op, PRED_LTE) == 0) &&
+    parser->single_value)
+    apply_range_predicate(parser, op, val);
+  else
+    parser->err_msg = ERR_MSG_INVALID_PREDICATE;
+  free(op);
+  return (parser->err_msg == NULL)? REDISMODULE_OK : MODULE_ERROR;
+}
+
+/* listed values and predicates both end up as a mask of the ordinals that
+   pass, cells are matched by looking their segments up once
+*/
 int check_val_update_parser(RedisModuleCtx *ctx, PARSER_STATE* parser) {
-  char *schema_key = token_to_string(parser->key, parser->input);
-  char* full_key = concat_prefix(SCHEMA_KEY_PREFIX, schema_key);
   char* val = token_to_string(parser->val, parser->input);
-  int rank = zset_get_rank(ctx, full_key, val);
-  if(rank == MODULE_ERROR)
+  int rank = schema_val_rank(parser->schema, parser->schema_key_ord, val);
+  int g = (rank != MODULE_ERROR)? MODULE_ERROR :
+    schema_group_index(&parser->schema->dims[parser->schema_key_ord], val);
+  if(parser->pred != NULL)
+    apply_predicate(parser, val);
+  else if(g != MODULE_ERROR)
+    apply_group(parser, g, true);
+  else if(rank == MODULE_ERROR)
     parser->err_msg = ERR_MSG_MEMBER_NOT_FOUND;
-  else if (parser->val_ord >= parser->query.val_sizes[parser->schema_key_ord])
-    parser->err_msg = ERR_MSG_TOO_MANY_KEYS;
+  else if(query_mask(&parser->query, parser->schema_key_ord, false) == NULL)
+    parser->err_msg = ERR_MSG_NO_MEM;
   else
-    parser->query.key_set[parser->schema_key_ord][parser->val_ord] = val;
-  //val is not freed - will be freed when parser is freed
-  free(schema_key);
-  free(full_key);
+    parser->query.masks[parser->schema_key_ord][rank + 1] = 1;
+  free(val);
   return (parser->err_msg == NULL)? REDISMODULE_OK : MODULE_ERROR;
 }
 
+/* "{nike}" -> "nike", the token is modified in place
+*/
+char *strip_hashtag(char *token) {
+  size_t len = strlen(token);
+  if(len < 2 || token[0] != HASHTAG_OPEN || token[len - 1] != HASHTAG_CLOSE)
+    return token;
+  token[len - 1] = '\0';
+  return token + 1;
+}
+
+/* rank of the dimension HASHTAG wraps in {}, MODULE_ERROR when the cells
+   are not sharded by one
+*/
+int tagged_dim(int hashtag) {
+  return (hashtag > HASHTAG_NONE)? hashtag - 1 : MODULE_ERROR;
+}
+
+/* returned pointer must be freed, NULL when the key has no such segment
+*/
+char *get_key_segment(C_CHARS key, int ord, int hashtag) {
+  char *key_dup = strdup(key), *ret = NULL, *save = NULL;
+  char *token = strtok_r(key_dup, REDIS_HIERARCHY_DELIM, &save);
+  for(int k_ord = 0; token != NULL && k_ord < ord; ++k_ord)
+    token = strtok_r(NULL, REDIS_HIERARCHY_DELIM, &save);
+  if(token != NULL)
+    ret = strdup((ord == tagged_dim(hashtag))? strip_hashtag(token) : token);
+  free(key_dup);
+  return ret;
+}
+
+/* where segment ord of a key of len bytes starts, NULL when it has no
+   such segment. seg_len gets its length
+*/
+C_CHARS find_key_segment(C_CHARS key, size_t len, int ord, size_t *seg_len) {
+  C_CHARS seg = key, end = key + len;
+  for(int k_ord = 0; k_ord < ord && seg != NULL; ++k_ord) {
+    seg = memchr(seg, REDIS_HIERARCHY_DELIM[0], end - seg);
+    if(seg != NULL)
+      seg++;
+  }
+  if(seg == NULL)
+    return NULL;
+  C_CHARS delim = memchr(seg, REDIS_HIERARCHY_DELIM[0], end - seg);
+  *seg_len = (delim == NULL)? (size_t)(end - seg) : (size_t)(delim - seg);
+  return seg;
+}
+
+/* returned pointer must be freed.
+   "nike:new-york:small" -> "nike:{new-york}:small" for ord 1, a segment
+   already tagged is kept as it is
+*/
+char *tag_cell_key(C_CHARS key, int ord) {
+  size_t len;
+  C_CHARS seg = find_key_segment(key, strlen(key), ord, &len);
+  if(seg == NULL || seg[0] == HASHTAG_OPEN)
+    return strdup(key);
+  char *ret = malloc(strlen(key) + 3);
+  sprintf(ret, "%.*s%c%.*s%c%s", (int)(seg - key), key, HASHTAG_OPEN,
+    (int)len, seg, HASHTAG_CLOSE, seg + len);
+  return ret;
+}
+
+/* returned pointer must be freed, the key a SchemaSet/SchemaADD entry
+   is stored under
+*/
+char *cell_key_of(PARSER_STATE *parser) {
+  char *key = token_to_string(parser->key, parser->input);
+  int dim = tagged_dim(parser->options.hashtag);
+  char *tagged = (dim >= 0)? tag_cell_key(key, dim) : strdup(key);
+  char *full_key = concat_prefix(parser->schema->prefix, tagged);
+  free(tagged);
+  free(key);
+  return full_key;
+}
+
 bool match_key_to_query(C_CHARS key, Query *query) {
-  char *key_dup = strdup(key);
-  int k_ord = 0;
-  char *token = strtok(key_dup,REDIS_HIERARCHY_DELIM);
-  while (token != NULL && k_ord < query->key_set_size) {
-    bool val_match = false;
-    if(query->key_set[k_ord][0] == NULL) {
-      val_match = true;
-      goto advance_while; //No match required for this k_ord
-    }
-    for(int v_ord=0; v_ord < query->val_sizes[k_ord]; v_ord++) {
-      if(query->key_set[k_ord][v_ord] == NULL)
-        break;
-      if(strcmp(query->key_set[k_ord][v_ord], token) == 0) {
-        val_match = true;
-        break;
-      }
-    }
-    advance_while:
-    token = strtok(NULL, REDIS_HIERARCHY_DELIM);
-    k_ord++;
-    if(val_match)
-      continue;
-    free(key_dup);
-    return false;
+  char *key_dup = strdup(key), *save = NULL;
+  size_t k_ord = 0;
+  bool match = true;
+  for(char *token = strtok_r(key_dup, REDIS_HIERARCHY_DELIM, &save);
+    token != NULL && k_ord < query->key_set_size && match;
+    token = strtok_r(NULL, REDIS_HIERARCHY_DELIM, &save), ++k_ord) {
+    if(query->masks[k_ord] == NULL)
+      continue; //No match required for this k_ord
+    if((int)k_ord == tagged_dim(query->hashtag))
+      token = strip_hashtag(token);
+    match = query->masks[k_ord][schema_val_rank(query->schema, k_ord, token) + 1];
   }
   free(key_dup);
-  return true;
+  //a cell written before a dimension was added has no segment for it
+  for(; match && !query->partial_keys && k_ord < query->key_set_size; ++k_ord) {
+    if(query->masks[k_ord] != NULL)
+      return false;
+  }
+  return match;
+}
+
+/* with HASHTAG <dimension> all cells written by one command must live in
+   the slot it was routed to, so they must share their value of it
+*/
+int check_cell_tag(PARSER_STATE *parser, C_CHARS key) {
+  int dim = tagged_dim(parser->options.hashtag);
+  char *tag = get_key_segment(key, dim, parser->options.hashtag);
+  if(tag == NULL)
+    return MODULE_ERROR; //it would hash by all of its key
+  if(parser->tag == NULL) {
+    parser->tag = tag;
+    return REDISMODULE_OK;
+  }
+  int ret = (strcmp(parser->tag, tag) == 0)? REDISMODULE_OK : MODULE_ERROR;
+  free(tag);
+  return ret;
 }
 
 int validate_key(PARSER_STATE *parser) {
   char *key = token_to_string(parser->key, parser->input);
   bool match = match_key_to_query(key, &parser->query);
+  if(!match)
+    parser->err_msg = ERR_MSG_MEMBER_NOT_FOUND;
+  else if(tagged_dim(parser->options.hashtag) >= 0 &&
+    check_cell_tag(parser, key) != REDISMODULE_OK)
+    parser->err_msg = ERR_MSG_CROSS_TAG;
   free(key);
-  return (match)? REDISMODULE_OK : REDISMODULE_ERR;
+  return (parser->err_msg == NULL)? REDISMODULE_OK : MODULE_ERROR;
 }
 
 int SchemaOperations_handler(RedisModuleCtx *ctx, PARSER_STATE *parser) {
@@ -294,16 +1155,358 @@ int SchemaOperations_handler(RedisModuleCtx *ctx, PARSER_STATE *parser) {
   }
 }
 
-int schema_set_val(RedisModuleCtx *ctx, PARSER_STATE *parser) {
-  char *key = token_to_string(parser->key, parser->input);
-  char *val = token_to_string(parser->val, parser->input);
-  RedisModuleString *key_str = RM_CreateString(ctx, key);
-  RedisModuleString *val_str = RM_CreateString(ctx, val);
-  RedisModuleKey *redis_key= RedisModule_OpenKey(ctx,key_str,REDISMODULE_WRITE);
-  int rsp = RedisModule_StringSet(redis_key, val_str);
+/* returns the packed cells held by an open key, creating them when the key
+   is empty, NULL if the key holds anything else
+*/
+CELL_STORE *cell_store_at(RedisModuleKey *redis_key) {
+  int type = RedisModule_KeyType(redis_key);
+  if(type == REDISMODULE_KEYTYPE_EMPTY) {
+    CELL_STORE *store = cell_store_new();
+    if(store != NULL)
+      RedisModule_ModuleTypeSetValue(redis_key, CellStoreType, store);
+    return store;
+  }
+  if(type == REDISMODULE_KEYTYPE_MODULE &&
+    RedisModule_ModuleTypeGetType(redis_key) == CellStoreType)
+    return RedisModule_ModuleTypeGetValue(redis_key);
+  return NULL;
+}
+
+/* widens the packed coordinates after values or dimensions were added
+*/
+int fit_cell_store(CELL_STORE *store, SCHEMA *schema) {
+  size_t cards[CELL_STORE_MAX_DIMS];
+  if(schema->dim_count > CELL_STORE_MAX_DIMS)
+    return MODULE_ERROR;
+  for(size_t d=0; d < schema->dim_count; ++d)
+    cards[d] = schema->dims[d].val_count;
+  return (cell_store_fit(store, schema->dim_count, cards) == 0)?
+    REDISMODULE_OK : MODULE_ERROR;
+}
+
+/* "nike:new-york" -> the ordinals of its segments, each rank + 1
+*/
+int cell_key_ords(SCHEMA *schema, C_CHARS key, uint32_t *ords) {
+  char *key_dup = strdup(key), *save = NULL;
+  int ret = REDISMODULE_OK;
+  size_t d = 0;
+  for(char *token = strtok_r(key_dup, REDIS_HIERARCHY_DELIM, &save);
+    token != NULL && ret == REDISMODULE_OK;
+    token = strtok_r(NULL, REDIS_HIERARCHY_DELIM, &save), ++d) {
+    int rank = (d < schema->dim_count)? schema_val_rank(schema, d, token) :
+      MODULE_ERROR;
+    if(rank == MODULE_ERROR || d >= CELL_STORE_MAX_DIMS)
+      ret = MODULE_ERROR;
+    else
+      ords[d] = rank + 1;
+  }
+  free(key_dup);
+  return ret;
+}
+
+/* the ordinal of each segment of a cell key, 0 for missing or unknown ones
+*/
+void key_ords(SCHEMA *schema, C_CHARS key, int hashtag, uint32_t *ords) {
+  char *key_dup = strdup(key), *save = NULL;
+  size_t d = 0;
+  for(char *token = strtok_r(key_dup, REDIS_HIERARCHY_DELIM, &save);
+    token != NULL && d < schema->dim_count;
+    token = strtok_r(NULL, REDIS_HIERARCHY_DELIM, &save), ++d) {
+    if((int)d == tagged_dim(hashtag))
+      token = strip_hashtag(token);
+    ords[d] = schema_val_rank(schema, d, token) + 1;
+  }
+  for(; d < schema->dim_count; ++d)
+    ords[d] = 0;
+  free(key_dup);
+}
+
+/* returned pointer must be freed, the key a packed cell would have
+*/
+char *cell_store_key(SCHEMA *schema, CELL_STORE *store, uint64_t coord) {
+  size_t len = strlen(schema->prefix) + 1;
+  for(size_t d=0; d < schema->dim_count; ++d) {
+    uint32_t ord = cell_store_ord(store, coord, d);
+    if(ord > 0 && ord <= schema->dims[d].val_count)
+      len += strlen(schema->dims[d].vals[ord - 1]) + 1;
+  }
+  char *key = malloc(len), *pos = key;
+  pos += sprintf(pos, "%s", schema->prefix);
+  for(size_t d=0; d < schema->dim_count; ++d) {
+    uint32_t ord = cell_store_ord(store, coord, d);
+    if(ord == 0 || ord > schema->dims[d].val_count)
+      break;
+    pos += sprintf(pos, (d == 0)? "%s" : REDIS_HIERARCHY_DELIM "%s",
+      schema->dims[d].vals[ord - 1]);
+  }
+  return key;
+}
+
+/* read a cell straight from the keyspace, without going through GET.
+   a time bucketed cell reads as the sum of its buckets inside the window,
+   a sketch reads as its distinct (HLL) or total (CMS) count
+*/
+CELL_STATUS read_open_cell_value(RedisModuleKey *redis_key, CELL_VALUE *val,
+  long long window) {
+  CELL_STATUS status = CELL_MISSING;
+  int type = RedisModule_KeyType(redis_key);
+  if(type == REDISMODULE_KEYTYPE_STRING) {
+    size_t len = 0;
+    C_CHARS ptr = RedisModule_StringDMA(redis_key, &len, REDISMODULE_READ);
+    status = parse_cell_value(ptr, len, val);
+  }
+  else if(type == REDISMODULE_KEYTYPE_MODULE &&
+    RedisModule_ModuleTypeGetType(redis_key) == CellRingType) {
+    CELL_RING *ring = RedisModule_ModuleTypeGetValue(redis_key);
+    val->is_int = true;
+    val->ival = cell_ring_sum(ring, RedisModule_Milliseconds(), window);
+    val->dval = val->ival;
+    status = CELL_OK;
+  }
+  else if(type == REDISMODULE_KEYTYPE_MODULE &&
+    RedisModule_ModuleTypeGetType(redis_key) == SketchType) {
+    val->is_int = true;
+    val->ival = sketch_count(RedisModule_ModuleTypeGetValue(redis_key));
+    val->dval = val->ival;
+    status = CELL_OK;
+  }
+  return status;
+}
+
+CELL_STATUS read_store_value(CELL_STORE *store, size_t i, CELL_VALUE *val) {
+  val->is_int = (store->flags[i] == CELL_STORE_INT);
+  val->ival = store->vals[i];
+  val->dval = cell_store_double(store, i);
+  return CELL_OK;
+}
+
+/* plain numbers are also summed at the parent levels of a hierarchy,
+   rings and sketches are only ever read from their cells
+*/
+bool has_rollups(SCHEMA *schema) {
+  if(schema->options.bucket_count > 0 || schema->options.sketch != SKETCH_NONE)
+    return false;
+  for(size_t d=0; d < schema->dim_count; ++d) {
+    if(schema->dims[d].group_count > 0)
+      return true;
+  }
+  return false;
+}
+
+/* in the sums a dimension's parents take the ordinals 1 to group_count and
+   its values follow, so values added later do not move the parents
+*/
+uint32_t rollup_ord(SCHEMA_DIM *dim, uint32_t ord) {
+  return (ord == 0)? 0 : dim->group_count + ord;
+}
+
+/* 0 once ord is at the top of its dimension
+*/
+uint32_t rollup_parent(SCHEMA_DIM *dim, uint32_t ord) {
+  if(ord == 0)
+    return 0;
+  if(ord <= dim->group_count)
+    return dim->group_parents[ord - 1] + 1;
+  return dim->val_parents[ord - dim->group_count - 1] + 1;
+}
+
+/* the sums carry the kind of sum as a leading dimension
+*/
+int fit_rollup_store(CELL_STORE *store, SCHEMA *schema) {
+  size_t cards[CELL_STORE_MAX_DIMS];
+  if(schema->dim_count >= CELL_STORE_MAX_DIMS)
+    return MODULE_ERROR;
+  cards[0] = ROLLUP_KINDS;
+  for(size_t d=0; d < schema->dim_count; ++d)
+    cards[d + 1] = schema->dims[d].group_count + schema->dims[d].val_count;
+  return (cell_store_fit(store, schema->dim_count + 1, cards) == 0)?
+    REDISMODULE_OK : MODULE_ERROR;
+}
+
+/* steps at to the next combination of levels like an odometer, each digit
+   climbing from the cell's value to the top parent. false once it wrapped
+   back to the cell itself
+*/
+bool next_rollup(SCHEMA *schema, const uint32_t *leaf, uint32_t *at) {
+  for(size_t d = schema->dim_count; d-- > 0;) {
+    uint32_t up = rollup_parent(&schema->dims[d], at[d]);
+    if(up != 0) {
+      at[d] = up;
+      return true;
+    }
+    at[d] = leaf[d];
+  }
+  return false;
+}
+
+void value_delta(CELL_VALUE *from, CELL_VALUE *to, CELL_VALUE *delta) {
+  delta->is_int = from->is_int && to->is_int &&
+    !__builtin_ssubll_overflow(to->ival, from->ival, &delta->ival);
+  delta->dval = to->dval - from->dval;
+}
+
+/* what a cell going from one value to another does to each kind of sum,
+   NULL stands for a missing cell. integers and doubles are summed apart
+   so that SUM stays an exact integer while no double is below
+*/
+void rollup_deltas(CELL_VALUE *from, CELL_VALUE *to, CELL_VALUE *deltas) {
+  CELL_VALUE zero = {.is_int = true};
+  bool from_double = (from != NULL && !from->is_int);
+  bool to_double = (to != NULL && !to->is_int);
+  value_delta((from == NULL || from_double)? &zero : from,
+    (to == NULL || to_double)? &zero : to, &deltas[ROLLUP_INTS - 1]);
+  deltas[ROLLUP_DOUBLES - 1].is_int = false;
+  deltas[ROLLUP_DOUBLES - 1].dval = (to_double? to->dval : 0) -
+    (from_double? from->dval : 0);
+  deltas[ROLLUP_DOUBLE_COUNT - 1].is_int = true;
+  deltas[ROLLUP_DOUBLE_COUNT - 1].ival = (long long)to_double - from_double;
+  deltas[ROLLUP_DOUBLE_COUNT - 1].dval = deltas[ROLLUP_DOUBLE_COUNT - 1].ival;
+}
+
+int add_to_store_cell(CELL_STORE *store, size_t i, CELL_VALUE *delta) {
+  long long sum;
+  if(store->flags[i] == CELL_STORE_INT && delta->is_int &&
+    !__builtin_saddll_overflow(store->vals[i], delta->ival, &sum))
+    return cell_store_set_int(store, i, sum);
+  return cell_store_set_double(store, i, cell_store_double(store, i) +
+    delta->dval);
+}
+
+/* the sums are read and kept up only while they hold the ROLLUP_COMPLETE
+   cell, which rebuild_rollups alone puts in. sums that were dropped,
+   evicted or deleted are not started over from an empty store
+*/
+CELL_STORE *complete_rollups(RedisModuleKey *redis_key) {
+  if(RedisModule_KeyType(redis_key) != REDISMODULE_KEYTYPE_MODULE ||
+    RedisModule_ModuleTypeGetType(redis_key) != CellStoreType)
+    return NULL;
+  CELL_STORE *store = RedisModule_ModuleTypeGetValue(redis_key);
+  return (cell_store_find(store, ROLLUP_COMPLETE) >= 0)? store : NULL;
+}
+
+/* adds the change of a cell to the sums of every combination of parent
+   levels above it. sums that can not be kept up are marked incomplete as
+   a whole, SUM then goes back to reading the cells
+*/
+void rollup_cell(RedisModuleCtx *ctx, SCHEMA *schema, const uint32_t *ords,
+  CELL_VALUE *from, CELL_VALUE *to) {
+  uint32_t leaf[CELL_STORE_MAX_DIMS], at[CELL_STORE_MAX_DIMS];
+  CELL_VALUE deltas[ROLLUP_KINDS];
+  if(!has_rollups(schema) || schema->dim_count >= CELL_STORE_MAX_DIMS)
+    return;
+  rollup_deltas(from, to, deltas);
+  for(size_t d=0; d < schema->dim_count; ++d)
+    at[d + 1] = leaf[d] = rollup_ord(&schema->dims[d], ords[d]);
+  RedisModuleString *key_str = RM_CreateString(ctx, schema->rollup_key);
+  RedisModuleKey *redis_key=RedisModule_OpenKey(ctx,key_str,REDISMODULE_WRITE);
+  CELL_STORE *store = complete_rollups(redis_key);
+  bool ok = (store != NULL && fit_rollup_store(store, schema) == REDISMODULE_OK);
+  while(ok && next_rollup(schema, leaf, at + 1)) {
+    for(uint32_t kind = 1; ok && kind <= ROLLUP_KINDS; ++kind) {
+      CELL_VALUE *delta = &deltas[kind - 1];
+      if(delta->is_int? delta->ival == 0 : delta->dval == 0)
+        continue;
+      at[0] = kind;
+      long i = cell_store_insert(store, cell_store_pack(store, at));
+      ok = (i >= 0 && add_to_store_cell(store, i, delta) == 0);
+    }
+  }
+  if(!ok && store != NULL &&
+    cell_store_delete(store, cell_store_find(store, ROLLUP_COMPLETE)) != 0)
+    RedisModule_DeleteKey(redis_key);
+  RedisModule_CloseKey(redis_key);
+  RedisModule_FreeString(ctx, key_str);
+}
+
+void rollup_key_cell(RedisModuleCtx *ctx, SCHEMA *schema, C_CHARS key,
+  CELL_VALUE *from, CELL_VALUE *to) {
+  uint32_t ords[CELL_STORE_MAX_DIMS];
+  if(!has_rollups(schema) || schema->dim_count >= CELL_STORE_MAX_DIMS)
+    return;
+  key_ords(schema, key + strlen(schema->prefix), schema->options.hashtag,
+    ords);
+  rollup_cell(ctx, schema, ords, from, to);
+}
+
+int schema_set_store_val(RedisModuleCtx *ctx, PARSER_STATE *parser,
+  C_CHARS val) {
+  CELL_VALUE cell, old;
+  uint32_t ords[CELL_STORE_MAX_DIMS] = {0};
+  char *key = token_to_string(parser->key, parser->input);
+  if(parse_cell_value(val, strlen(val), &cell) != CELL_OK)
+    parser->err_msg = ERR_MSG_NOT_A_NUMBER;
+  else if(cell_key_ords(parser->schema, key, ords) != REDISMODULE_OK)
+    parser->err_msg = ERR_MSG_MEMBER_NOT_FOUND;
+  free(key);
+  if(parser->err_msg != NULL)
+    return MODULE_ERROR;
+  RedisModuleString *key_str = RM_CreateString(ctx, parser->schema->store_key);
+  RedisModuleKey *redis_key=RedisModule_OpenKey(ctx,key_str,REDISMODULE_WRITE);
+  CELL_STORE *store = cell_store_at(redis_key);
+  long i = -1;
+  if(store == NULL)
+    parser->err_msg = ERR_MSG_WRONG_CELL_TYPE;
+  else if(fit_cell_store(store, parser->schema) != REDISMODULE_OK)
+    parser->err_msg = ERR_MSG_STORE_FULL;
+  else if((i = cell_store_insert(store, cell_store_pack(store, ords))) < 0)
+    parser->err_msg = ERR_MSG_NO_MEM;
+  if(i >= 0) {
+    read_store_value(store, i, &old); //a new cell reads as 0
+    if(cell.is_int)
+      cell_store_set_int(store, i, cell.ival);
+    else
+      cell_store_set_double(store, i, cell.dval);
+    rollup_cell(ctx, parser->schema, ords, &old, &cell);
+  }
+  RedisModule_CloseKey(redis_key);
+  RedisModule_FreeString(ctx, key_str);
+  return (parser->err_msg == NULL)? REDISMODULE_OK : MODULE_ERROR;
+}
+
+/* a time bucketed cell is set by replacing the count of its current bucket
+*/
+int schema_set_ring_val(RedisModuleCtx *ctx, PARSER_STATE *parser,
+  C_CHARS key, RedisModuleString *val_str) {
+  long long val;
+  if(RedisModule_StringToLongLong(val_str, &val) != REDISMODULE_OK) {
+    parser->err_msg = ERR_MSG_NOT_A_NUMBER;
+    return MODULE_ERROR;
+  }
+  RedisModuleString *key_str = RM_CreateString(ctx, key);
+  RedisModuleKey *redis_key= RedisModule_OpenKey(ctx,key_str,REDISMODULE_WRITE);
+  if(RedisModule_KeyType(redis_key) != REDISMODULE_KEYTYPE_EMPTY &&
+    RedisModule_ModuleTypeGetType(redis_key) != CellRingType)
+    RedisModule_DeleteKey(redis_key); //a plain cell becomes a bucketed one
   RedisModule_CloseKey(redis_key);
-  RedisModule_FreeString(ctx, val_str);
   RedisModule_FreeString(ctx, key_str);
+  return update_cell_ring(ctx, key, &parser->options, val, false);
+}
+
+int schema_set_val(RedisModuleCtx *ctx, PARSER_STATE *parser) {
+  char *key = cell_key_of(parser);
+  char *val = token_to_string(parser->val, parser->input);
+  RedisModuleString *val_str = RM_CreateString(ctx, val);
+  int rsp;
+  if(parser->options.sparse)
+    rsp = schema_set_store_val(ctx, parser, val);
+  else if(parser->options.bucket_count > 0)
+    rsp = schema_set_ring_val(ctx, parser, key, val_str);
+  else {
+    RedisModuleString *key_str = RM_CreateString(ctx, key);
+    RedisModuleKey *redis_key=RedisModule_OpenKey(ctx,key_str,REDISMODULE_WRITE);
+    CELL_VALUE old, cell;
+    bool summed = has_rollups(parser->schema);
+    //what is not a number is not in the sums
+    bool had = summed && read_open_cell_value(redis_key, &old, 0) == CELL_OK;
+    bool has = summed && parse_cell_value(val, strlen(val), &cell) == CELL_OK;
+    rsp = RedisModule_StringSet(redis_key, val_str);
+    RedisModule_CloseKey(redis_key);
+    RedisModule_FreeString(ctx, key_str);
+    if(summed && rsp == REDISMODULE_OK)
+      rollup_key_cell(ctx, parser->schema, key, had? &old : NULL,
+        has? &cell : NULL);
+  }
+  RedisModule_FreeString(ctx, val_str);
   free(val);
   free(key);
   return rsp;
@@ -323,276 +1526,4230 @@ int SchemaSet_handler(RedisModuleCtx *ctx, PARSER_STATE *parser) {
   }
 }
 
-int parse_input(RedisModuleCtx *ctx, PARSER_STATE *parser) {
-  jsmn_parser p; int r; jsmntok_t *tok;
-	size_t tokcount = strlen(parser->input)/2;
+/* returns the sketch held by an open key, creating one of the schema's
+   kind when the key is empty, NULL if the key holds anything else
+*/
+SKETCH *sketch_at(RedisModuleKey *redis_key, SKETCH_TYPE type) {
+  int key_type = RedisModule_KeyType(redis_key);
+  if(key_type == REDISMODULE_KEYTYPE_EMPTY) {
+    SKETCH *sketch = sketch_new(type);
+    if(sketch != NULL)
+      RedisModule_ModuleTypeSetValue(redis_key, SketchType, sketch);
+    return sketch;
+  }
+  if(key_type == REDISMODULE_KEYTYPE_MODULE &&
+    RedisModule_ModuleTypeGetType(redis_key) == SketchType) {
+    SKETCH *sketch = RedisModule_ModuleTypeGetValue(redis_key);
+    return (sketch->type == type)? sketch : NULL;
+  }
+  return NULL;
+}
+
+int schema_add_item(RedisModuleCtx *ctx, PARSER_STATE *parser) {
+  char *key = cell_key_of(parser);
+  RedisModuleString *key_str = RM_CreateString(ctx, key);
+  RedisModuleKey *redis_key=RedisModule_OpenKey(ctx,key_str,REDISMODULE_WRITE);
+  SKETCH *sketch = sketch_at(redis_key, parser->options.sketch);
+  if(sketch != NULL)
+    sketch_add(sketch, parser->input + parser->val->start,
+      parser->val->end - parser->val->start);
+  else
+    parser->err_msg = ERR_MSG_WRONG_CELL_TYPE;
+  RedisModule_CloseKey(redis_key);
+  RedisModule_FreeString(ctx, key_str);
+  free(key);
+  return (parser->err_msg == NULL)? REDISMODULE_OK : MODULE_ERROR;
+}
+
+int SchemaAdd_handler(RedisModuleCtx *ctx, PARSER_STATE *parser) {
+  switch(parser->stage) {
+    case PARSER_KEY:
+      if(parser->options.sketch == SKETCH_NONE) {
+        parser->err_msg = ERR_MSG_NO_SKETCH;
+        return MODULE_ERROR;
+      }
+      return validate_key(parser);
+    case PARSER_VAL:
+      return schema_add_item(ctx, parser);
+    default:
+      parser->err_msg = ERR_MSG_GENERAL_ERROR;
+      return MODULE_ERROR;
+  }
+}
+
+int parse_input(RedisModuleCtx *ctx, PARSER_STATE *parser) {
+  jsmn_parser p; int r; jsmntok_t *tok;
+	size_t tokcount = strlen(parser->input)/2;
+
+	jsmn_init(&p);
+	tok = malloc(sizeof(*tok) * tokcount);
+	if (tok == NULL) {
+		parser->err_msg = ERR_MSG_NOMEM;
+		return MODULE_ERROR;
+	}
+  r = jsmn_parse(&p, parser->input, strlen(parser->input), tok, tokcount);
+  if(r<0) {
+    parser->err_msg = (r == JSMN_ERROR_NOMEM)?
+    ERR_MSG_NOMEM: ERR_MSG_INVALID_INPUT;
+    free(tok);
+    return MODULE_ERROR;
+  }
+  r = json_walk(ctx, tok, parser);
+  free(tok);
+  return r;
+}
+
+/* INCRBY done on the open key, a missing cell counts from 0 and like INCR
+   anything but an integer below the maximum is left as it is. the cell
+   stops at the maximum, from and to get what it held before and after
+*/
+int increment_key_by(RedisModuleCtx *ctx, C_CHARS key, long long delta,
+  CELL_VALUE *from, CELL_VALUE *to) {
+  RedisModuleString *key_str = RM_CreateString(ctx, key);
+  RedisModuleKey *redis_key=RedisModule_OpenKey(ctx,key_str,REDISMODULE_WRITE);
+  CELL_VALUE val = {.is_int = true, .ival = 0};
+  int type = RedisModule_KeyType(redis_key);
+  int rsp = MODULE_ERROR;
+  if(type == REDISMODULE_KEYTYPE_STRING) {
+    size_t len;
+    C_CHARS str = RedisModule_StringDMA(redis_key, &len, REDISMODULE_READ);
+    if(parse_cell_value(str, len, &val) != CELL_OK)
+      val.is_int = false;
+  }
+  if((type == REDISMODULE_KEYTYPE_EMPTY || type == REDISMODULE_KEYTYPE_STRING)
+    && val.is_int && val.ival < INT64_MAX) {
+    *from = val;
+    to->is_int = true;
+    if(__builtin_saddll_overflow(val.ival, delta, &to->ival))
+      to->ival = INT64_MAX;
+    to->dval = to->ival;
+    RedisModuleString *incr = RedisModule_CreateStringFromLongLong(ctx,
+      to->ival);
+    rsp = RedisModule_StringSet(redis_key, incr);
+    RedisModule_FreeString(ctx, incr);
+  }
+  RedisModule_CloseKey(redis_key);
+  RedisModule_FreeString(ctx, key_str);
+  return rsp;
+}
+
+/* a sweep that runs in slices can not replicate as the command, cells
+   written between its slices would end up different on replicas. each
+   cell goes out as what it now holds instead
+*/
+void replicate_cell(RedisModuleCtx *ctx, C_CHARS key) {
+  RedisModuleString *key_str = RM_CreateString(ctx, key);
+  RedisModuleKey *redis_key = RedisModule_OpenKey(ctx,key_str,REDISMODULE_READ);
+  int type = RedisModule_KeyType(redis_key);
+  if(type == REDISMODULE_KEYTYPE_EMPTY)
+    RedisModule_Replicate(ctx, "DEL", "c", key);
+  else if(type == REDISMODULE_KEYTYPE_STRING) {
+    size_t len;
+    C_CHARS val = RedisModule_StringDMA(redis_key, &len, REDISMODULE_READ);
+    RedisModule_Replicate(ctx, "SET", "cb", key, val, len);
+  }
+  else if(type == REDISMODULE_KEYTYPE_MODULE &&
+    RedisModule_ModuleTypeGetType(redis_key) == CellRingType) {
+    CELL_RING *ring = RedisModule_ModuleTypeGetValue(redis_key);
+    char *buckets = join_ring_buckets(ring);
+    RedisModule_Replicate(ctx, CELL_RING_RESTORE_CMD, REPLICATE_RING_FMT, key,
+      ring->resolution, (long long)ring->size, ring->head, buckets);
+    free(buckets);
+  }
+  RedisModule_CloseKey(redis_key);
+  RedisModule_FreeString(ctx, key_str);
+}
+
+/* returned pointer must be freed. keys live per db, so do their increments
+*/
+char *pending_key(int db, C_CHARS key) {
+  char *pending = malloc(strlen(key) + CELL_VALUE_MAX_LEN);
+  if(pending != NULL)
+    sprintf(pending, "%d" REDIS_HIERARCHY_DELIM "%s", db, key);
+  return pending;
+}
+
+/* writes the increments pending under prefix, all of them when prefix is
+   NULL. the SchemaINC that buffered them did not replicate, each written
+   cell goes out as what it now holds, as do the sums of its parents
+*/
+void flush_deltas(RedisModuleCtx *ctx, C_CHARS prefix) {
+  size_t len = 0;
+  DELTA_ENTRY *entries = (PendingDeltas == NULL)? NULL :
+    delta_buf_take(PendingDeltas, prefix, &len);
+  int db = RedisModule_GetSelectedDb(ctx);
+  for(size_t i=0; i < len; ++i) {
+    char *key;
+    CELL_VALUE from, to;
+    int key_db = strtol(entries[i].key, &key, 10);
+    if(RedisModule_GetSelectedDb(ctx) != key_db)
+      RedisModule_SelectDb(ctx, key_db);
+    key++; //past the delimiter
+    char *name = strndup(key, strcspn(key, REDIS_HIERARCHY_DELIM));
+    SCHEMA *schema = get_schema(ctx, strip_hashtag(name));
+    if(increment_key_by(ctx, key, entries[i].delta, &from, &to) ==
+      REDISMODULE_OK) {
+      replicate_cell(ctx, key);
+      if(schema != NULL)
+        rollup_key_cell(ctx, schema, key, &from, &to);
+    }
+    free(name);
+    free(entries[i].key);
+  }
+  free(entries);
+  if(RedisModule_GetSelectedDb(ctx) != db)
+    RedisModule_SelectDb(ctx, db);
+}
+
+char *schema_pending_key(RedisModuleCtx *ctx, C_CHARS name) {
+  SCHEMA *schema = get_schema(ctx, name);
+  return (schema == NULL)? NULL :
+    pending_key(RedisModule_GetSelectedDb(ctx), schema->prefix);
+}
+
+/* whether cells of a schema have increments that are not written yet
+*/
+bool schema_deltas_pending(RedisModuleCtx *ctx, C_CHARS name) {
+  if(PendingDeltas == NULL || PendingDeltas->len == 0)
+    return false;
+  char *prefix = schema_pending_key(ctx, name);
+  bool pending = (prefix != NULL && delta_buf_pending(PendingDeltas, prefix));
+  free(prefix);
+  return pending;
+}
+
+/* anything reading or writing the cells of a schema flushes them first
+*/
+void flush_schema_deltas(RedisModuleCtx *ctx, C_CHARS name) {
+  if(PendingDeltas == NULL || PendingDeltas->len == 0)
+    return;
+  char *prefix = schema_pending_key(ctx, name);
+  if(prefix != NULL)
+    flush_deltas(ctx, prefix);
+  free(prefix);
+}
+
+/* a timer's context belongs to no client, the cells are written and
+   replicated through a thread safe one, which sends them out when freed
+*/
+void FlushTimer(RedisModuleCtx *ctx, void *data) {
+  FlushScheduled = false;
+  RedisModuleCtx *flush_ctx = RedisModule_GetThreadSafeContext(NULL);
+  flush_deltas(flush_ctx, NULL);
+  RedisModule_FreeThreadSafeContext(flush_ctx);
+}
+
+/* the increment waits in PendingDeltas, added up with those that follow
+   it until a read of the schema or the timer, at most CoalesceMs away,
+   writes them. false when it has to be written right away.
+   a plain GET of the cell lags meanwhile, commands writing it are
+   handled by CellNotified
+*/
+bool buffer_increment(RedisModuleCtx *ctx, C_CHARS key) {
+  if(PendingDeltas == NULL)
+    PendingDeltas = delta_buf_new();
+  if(PendingDeltas == NULL || PendingDeltas->len >= COALESCE_CELLS_MAX)
+    return false;
+  char *pending = pending_key(RedisModule_GetSelectedDb(ctx), key);
+  bool ok = (pending != NULL && delta_buf_add(PendingDeltas, pending, 1) == 0);
+  free(pending);
+  if(ok && !FlushScheduled) {
+    RedisModule_CreateTimer(ctx, CoalesceMs, FlushTimer, NULL);
+    FlushScheduled = true;
+  }
+  return ok;
+}
+
+/* keyspace events after which the increments pending on the key are
+   moot, they came before its value was replaced or removed
+*/
+static C_CHARS ReplacingEvents[] = {"del", "set", "expired", "evicted",
+  "rename_from", "rename_to", "restore"};
+
+/* a plain command on a cell with increments pending. one replacing or
+   removing it drops them, written first they would have been lost. an
+   INCRBY adds up with them, as does anything else leaving the value a
+   counter. the key is looked up only while increments are pending
+*/
+int CellNotified(RedisModuleCtx *ctx, int type, C_CHARS event,
+  RedisModuleString *key) {
+  if(PendingDeltas == NULL || PendingDeltas->len == 0)
+    return REDISMODULE_OK;
+  size_t count = sizeof(ReplacingEvents) / sizeof(ReplacingEvents[0]);
+  for(size_t i=0; i < count; ++i) {
+    if(strcmp(event, ReplacingEvents[i]) != 0)
+      continue;
+    char *pending = pending_key(RedisModule_GetSelectedDb(ctx),
+      RedisModule_StringPtrLen(key, NULL));
+    if(pending != NULL)
+      delta_buf_drop(PendingDeltas, pending);
+    free(pending);
+    break;
+  }
+  return REDISMODULE_OK;
+}
+
+//TODO: fix reply
+int SchemaCleanCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc){
+  if(argc != SCHEMA_CLEAN_ARGS)
+    return RedisModule_WrongArity(ctx);
+  C_CHARS name = RedisModule_StringPtrLen(argv[SCHEMA_NAME_ARG], NULL);
+  if(!valid_schema_name(name))
+    return RedisModule_ReplyWithSimpleString(ctx, ERR_MSG_INVALID_SCHEMA_NAME);
+  flush_schema_deltas(ctx, name);
+  int resp = drop_schema(ctx, name);
+  RedisModule_ReplicateVerbatim(ctx);
+  RedisModule_ReplyWithSimpleString(ctx, OK_STR);
+  return resp;
+}
+
+/* TIMEBUCKETS <resolution> <retention>, both in seconds
+*/
+int parse_timebuckets_args(RedisModuleString **argv, SCHEMA_OPTIONS *options) {
+  long long resolution, retention;
+  if(RedisModule_StringToLongLong(argv[0], &resolution) != REDISMODULE_OK ||
+    RedisModule_StringToLongLong(argv[1], &retention) != REDISMODULE_OK ||
+    resolution <= 0 || retention < resolution)
+    return MODULE_ERROR;
+  options->bucket_resolution = resolution * MS_IN_SEC;
+  options->bucket_count = (retention + resolution - 1) / resolution;
+  return (options->bucket_count <= CELL_RING_MAX_BUCKETS)?
+    REDISMODULE_OK : MODULE_ERROR;
+}
+
+/* SKETCH HLL|CMS
+*/
+int parse_sketch_args(RedisModuleString **argv, SCHEMA_OPTIONS *options) {
+  C_CHARS type = RedisModule_StringPtrLen(argv[0], NULL);
+  if(strcasecmp(type, ARG_HLL) == 0)
+    options->sketch = SKETCH_HLL;
+  else if(strcasecmp(type, ARG_CMS) == 0)
+    options->sketch = SKETCH_CMS;
+  else
+    return MODULE_ERROR;
+  return REDISMODULE_OK;
+}
+
+/* HASHTAG takes NAME or a dimension, which is left in tag_dim to be
+   looked up once the dimensions are loaded.
+   with NAME the cells and the metadata share one slot. the cells of a
+   schema tagged by a dimension are spread over the cluster, so SchemaLoad,
+   SchemaADDVALUE, SchemaADDDIM and SchemaClean are sent to every master,
+   each keeping a copy of the metadata next to its cells
+*/
+int parse_schema_options(RedisModuleString **argv, int argc,
+  SCHEMA_OPTIONS *options, RedisModuleString **parents,
+  RedisModuleString **tag_dim) {
+  memset(options, 0, sizeof(*options));
+  *parents = NULL;
+  *tag_dim = NULL;
+  for(int i = SCHEMA_OPT_ARG; i < argc;) {
+    C_CHARS opt = RedisModule_StringPtrLen(argv[i], NULL);
+    if(strcasecmp(opt, ARG_TIMEBUCKETS) == 0 && i + 2 < argc &&
+      parse_timebuckets_args(argv + i + 1, options) == REDISMODULE_OK)
+      i += 3;
+    else if(strcasecmp(opt, ARG_SKETCH) == 0 && i + 1 < argc &&
+      parse_sketch_args(argv + i + 1, options) == REDISMODULE_OK)
+      i += 2;
+    else if(strcasecmp(opt, ARG_HASHTAG) == 0 && i + 1 < argc &&
+      options->hashtag == HASHTAG_NONE && *tag_dim == NULL) {
+      if(strcasecmp(RedisModule_StringPtrLen(argv[i + 1], NULL), ARG_NAME) == 0)
+        options->hashtag = HASHTAG_NAME;
+      else
+        *tag_dim = argv[i + 1];
+      i += 2;
+    }
+    else if(strcasecmp(opt, ARG_SPARSE) == 0) {
+      options->sparse = true;
+      i += 1;
+    }
+    else if(strcasecmp(opt, ARG_PARENTS) == 0 && i + 1 < argc) {
+      *parents = argv[i + 1];
+      i += 2;
+    }
+    else
+      return MODULE_ERROR;
+  }
+  //a cell is either a counter ring or a sketch, packed cells are plain
+  //numbers in a single key
+  if(options->sparse && (options->bucket_count > 0 ||
+    options->sketch != SKETCH_NONE || options->hashtag != HASHTAG_NONE ||
+    *tag_dim != NULL))
+    return MODULE_ERROR;
+  return (options->bucket_count > 0 && options->sketch != SKETCH_NONE)?
+    MODULE_ERROR : REDISMODULE_OK;
+}
+
+/* the schema named by a command, NULL if there is no such schema
+*/
+SCHEMA *schema_of_command(RedisModuleCtx *ctx, RedisModuleString **argv) {
+  C_CHARS name = RedisModule_StringPtrLen(argv[SCHEMA_NAME_ARG], NULL);
+  return valid_schema_name(name)? get_schema(ctx, name) : NULL;
+}
+
+long long append_schema_vals(RedisModuleCtx *ctx, SCHEMA *schema, int dim,
+  RedisModuleString **argv, int argc) {
+  long long added = 0;
+  for(int i = SCHEMA_EVOLVE_ARG_VALS; i < argc; ++i) {
+    C_CHARS val = RedisModule_StringPtrLen(argv[i], NULL);
+    if(append_schema_val(ctx, schema, dim, val) == REDISMODULE_OK)
+      added++;
+  }
+  return added;
+}
+
+/* the packed cells of a sparse schema are widened as soon as it grows, a
+   store too full for it is left to fail the next write
+*/
+void refit_sparse_store(RedisModuleCtx *ctx, SCHEMA *schema) {
+  if(!schema->options.sparse)
+    return;
+  RedisModuleString *key_str = RM_CreateString(ctx, schema->store_key);
+  RedisModuleKey *redis_key=RedisModule_OpenKey(ctx,key_str,REDISMODULE_WRITE);
+  CELL_STORE *store = (RedisModule_KeyType(redis_key) ==
+    REDISMODULE_KEYTYPE_EMPTY)? NULL : cell_store_at(redis_key);
+  if(store != NULL)
+    fit_cell_store(store, schema);
+  RedisModule_CloseKey(redis_key);
+  RedisModule_FreeString(ctx, key_str);
+}
+
+/* SchemaADDVALUE <name> <dimension> <value> [<value> ...]
+   replies with the number of values that were not in the schema yet
+*/
+int SchemaAddValueCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
+  int argc) {
+  if(argc < SCHEMA_ADDVALUE_ARGS_MIN)
+    return RedisModule_WrongArity(ctx);
+  SCHEMA *schema = schema_of_command(ctx, argv);
+  if(schema == NULL)
+    return RedisModule_ReplyWithSimpleString(ctx, ERR_MSG_NO_SCHEMA);
+  int dim = schema_dim_rank(schema,
+    RedisModule_StringPtrLen(argv[SCHEMA_EVOLVE_ARG_DIM], NULL));
+  if(dim == MODULE_ERROR)
+    return RedisModule_ReplyWithSimpleString(ctx, ERR_MSG_MEMBER_NOT_FOUND);
+  long long added = append_schema_vals(ctx, schema, dim, argv, argc);
+  refit_sparse_store(ctx, schema);
+  RedisModule_ReplicateVerbatim(ctx);
+  return RedisModule_ReplyWithLongLong(ctx, added);
+}
+
+/* SchemaADDDIM <name> <dimension> [<value> ...]
+   replies with the number of values the new dimension got
+*/
+int SchemaAddDimCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
+  int argc) {
+  if(argc < SCHEMA_ADDDIM_ARGS_MIN)
+    return RedisModule_WrongArity(ctx);
+  SCHEMA *schema = schema_of_command(ctx, argv);
+  if(schema == NULL)
+    return RedisModule_ReplyWithSimpleString(ctx, ERR_MSG_NO_SCHEMA);
+  if(append_schema_dim(ctx, schema,
+    RedisModule_StringPtrLen(argv[SCHEMA_EVOLVE_ARG_DIM], NULL)) !=
+    REDISMODULE_OK)
+    return RedisModule_ReplyWithSimpleString(ctx, ERR_MSG_DIM_EXISTS);
+  long long added = append_schema_vals(ctx, schema, schema->dim_count - 1,
+    argv, argc);
+  refit_sparse_store(ctx, schema);
+  RedisModule_ReplicateVerbatim(ctx);
+  return RedisModule_ReplyWithLongLong(ctx, added);
+}
+
+CELL_STATUS read_cell_value(RedisModuleCtx *ctx, C_CHARS key, CELL_VALUE *val,
+  long long window) {
+  RedisModuleString *key_str = RM_CreateString(ctx, key);
+  RedisModuleKey *redis_key = RedisModule_OpenKey(ctx, key_str, REDISMODULE_READ);
+  CELL_STATUS status = read_open_cell_value(redis_key, val, window);
+  RedisModule_CloseKey(redis_key);
+  RedisModule_FreeString(ctx, key_str);
+  return status;
+}
+
+/* the value of a matched cell, taken from wherever the filter found it
+*/
+CELL_STATUS read_matched_value(RedisModuleCtx *ctx, C_CHARS key,
+  OP_STATE *state, CELL_VALUE *val) {
+  if(state->store != NULL)
+    return read_store_value(state->store, state->cell, val);
+  if(state->scan_key != NULL)
+    return read_open_cell_value(state->scan_key, val, state->window);
+  return read_cell_value(ctx, key, val, state->window);
+}
+
+void increment_store_cell(CELL_STORE *store, size_t i) {
+  if(store->flags[i] == CELL_STORE_INT && store->vals[i] < INT64_MAX)
+    cell_store_set_int(store, i, store->vals[i] + 1);
+  else
+    cell_store_set_double(store, i, cell_store_double(store, i) + 1);
+}
+
+/* time bucketed cells count into their current bucket
+*/
+int increment_key(RedisModuleCtx *ctx, C_CHARS key, SCHEMA_OPTIONS *options) {
+  CELL_VALUE from, to;
+  if(options->bucket_count > 0 &&
+    update_cell_ring(ctx, key, options, 1, true) == REDISMODULE_OK)
+    return REDISMODULE_OK;
+  return increment_key_by(ctx, key, 1, &from, &to);
+}
+
+void aggregate_init(AGGREGATE *agg) {
+  memset(agg, 0, sizeof(*agg));
+  agg->is_int = true;
+}
+
+void sum_add_double(AGGREGATE *agg, double val) {
+  double t = agg->dsum + val;
+  if(fabs(agg->dsum) >= fabs(val))
+    agg->dcomp += (agg->dsum - t) + val;
+  else
+    agg->dcomp += (val - t) + agg->dsum;
+  agg->dsum = t;
+}
+
+/* integers are summed exactly until a double shows up or int64 overflows,
+   from then on the sum is carried as a compensated double
+*/
+void sum_add_value(AGGREGATE *agg, CELL_VALUE *val) {
+  if(agg->is_int && val->is_int &&
+    !__builtin_saddll_overflow(agg->isum, val->ival, &agg->isum))
+    return;
+  if(agg->is_int) {
+    agg->is_int = false;
+    agg->dsum = agg->isum;
+    agg->dcomp = 0;
+  }
+  sum_add_double(agg, val->dval);
+}
+
+double sum_get_double(AGGREGATE *agg) {
+  return (agg->is_int)? (double)agg->isum : agg->dsum + agg->dcomp;
+}
+
+int compare_cell_values(CELL_VALUE *a, CELL_VALUE *b) {
+  if(a->is_int && b->is_int)
+    return (a->ival > b->ival) - (a->ival < b->ival);
+  return (a->dval > b->dval) - (a->dval < b->dval);
+}
+
+void aggregate_add(AGGREGATE *agg, CELL_VALUE *val) {
+  sum_add_value(agg, val);
+  if(agg->count == 0 || compare_cell_values(val, &agg->min) < 0)
+    agg->min = *val;
+  if(agg->count == 0 || compare_cell_values(val, &agg->max) > 0)
+    agg->max = *val;
+  agg->count++;
+}
+
+int reply_with_cell_value(RedisModuleCtx *ctx, CELL_VALUE *val) {
+  if(val->is_int)
+    return RedisModule_ReplyWithLongLong(ctx, val->ival);
+  return RedisModule_ReplyWithDouble(ctx, val->dval);
+}
+
+int reply_with_sum(RedisModuleCtx *ctx, AGGREGATE *agg) {
+  if(agg->is_int)
+    return RedisModule_ReplyWithLongLong(ctx, agg->isum);
+  return RedisModule_ReplyWithDouble(ctx, sum_get_double(agg));
+}
+
+void init_op_state(OP_STATE *state, SCHEMA_OP op) {
+  memset(state, 0, sizeof(*state));
+  state->op = op;
+  state->stage = OP_INIT;
+  aggregate_init(&state->agg);
+}
+
+/* positive when a should be ranked ahead of b
+*/
+int topk_compare(OP_STATE *state, TOPK_ENTRY *a, TOPK_ENTRY *b) {
+  int cmp = compare_cell_values(&a->val, &b->val);
+  return (state->ascending)? -cmp : cmp;
+}
+
+void topk_sift_down(OP_STATE *state, size_t pos) {
+  TOPK_ENTRY *heap = state->topk;
+  for(;;) {
+    size_t child = 2 * pos + 1;
+    if(child >= state->topk_len)
+      break;
+    if(child + 1 < state->topk_len &&
+      topk_compare(state, &heap[child + 1], &heap[child]) < 0)
+      child++;
+    if(topk_compare(state, &heap[child], &heap[pos]) >= 0)
+      break;
+    TOPK_ENTRY tmp = heap[pos]; heap[pos] = heap[child]; heap[child] = tmp;
+    pos = child;
+  }
+}
+
+void topk_sift_up(OP_STATE *state, size_t pos) {
+  TOPK_ENTRY *heap = state->topk;
+  while(pos > 0) {
+    size_t parent = (pos - 1) / 2;
+    if(topk_compare(state, &heap[pos], &heap[parent]) >= 0)
+      break;
+    TOPK_ENTRY tmp = heap[pos]; heap[pos] = heap[parent]; heap[parent] = tmp;
+    pos = parent;
+  }
+}
+
+/* keep the cell if it ranks among the best k seen so far, the heap never
+   holds more than k entries
+*/
+int topk_offer(OP_STATE *state, C_CHARS key, CELL_VALUE *val) {
+  TOPK_ENTRY entry = { NULL, *val };
+  if(state->topk_len == state->k) {
+    if(topk_compare(state, &entry, &state->topk[0]) <= 0)
+      return REDISMODULE_OK;
+    free(state->topk[0].key);
+    state->topk[0].key = strdup(key);
+    state->topk[0].val = *val;
+    topk_sift_down(state, 0);
+    return REDISMODULE_OK;
+  }
+  if(state->topk_len == state->topk_cap) {
+    size_t cap = (state->topk_cap == 0)? TOPK_INITIAL_CAP : state->topk_cap*2;
+    if(cap > state->k)
+      cap = state->k;
+    TOPK_ENTRY *heap = realloc(state->topk, cap * sizeof(TOPK_ENTRY));
+    if(heap == NULL)
+      return MODULE_ERROR;
+    state->topk = heap;
+    state->topk_cap = cap;
+  }
+  entry.key = strdup(key);
+  state->topk[state->topk_len++] = entry;
+  topk_sift_up(state, state->topk_len - 1);
+  return REDISMODULE_OK;
+}
+
+/* pops the heap from the back so the entries end up best first
+*/
+int reply_with_topk(RedisModuleCtx *ctx, OP_STATE *state) {
+  size_t count = state->topk_len;
+  while(state->topk_len > 1) {
+    TOPK_ENTRY tmp = state->topk[0];
+    state->topk[0] = state->topk[--state->topk_len];
+    state->topk[state->topk_len] = tmp;
+    topk_sift_down(state, 0);
+  }
+  state->topk_len = count;
+  RedisModule_ReplyWithArray(ctx, count * 2);
+  for(size_t i=0; i < count; ++i) {
+    RedisModule_ReplyWithStringBuffer(ctx, state->topk[i].key,
+      strlen(state->topk[i].key));
+    reply_with_cell_value(ctx, &state->topk[i].val);
+  }
+  return REDISMODULE_OK;
+}
+
+/* values below min land in the first slot and values from max on in the
+   last one, the buckets in between split [min, max) evenly
+*/
+void hist_add(OP_STATE *state, double val) {
+  size_t slot;
+  if(val < state->hist_min)
+    slot = 0;
+  else if(val >= state->hist_max)
+    slot = state->hist_buckets + 1;
+  else {
+    slot = 1 + (size_t)((val - state->hist_min) /
+      (state->hist_max - state->hist_min) * state->hist_buckets);
+    if(slot > state->hist_buckets)
+      slot = state->hist_buckets;
+  }
+  state->hist[slot]++;
+}
+
+int reply_with_quantiles(RedisModuleCtx *ctx, OP_STATE *state) {
+  if(state->value_count == 0)
+    return RedisModule_ReplyWithSimpleString(ctx, NO_KEYS_MATCHED);
+  RedisModule_ReplyWithArray(ctx, state->quantile_count);
+  for(size_t i=0; i < state->quantile_count; ++i)
+    RedisModule_ReplyWithDouble(ctx,
+      tdigest_quantile(state->digest, state->quantiles[i]));
+  return REDISMODULE_OK;
+}
+
+int reply_with_hist(RedisModuleCtx *ctx, OP_STATE *state) {
+  RedisModule_ReplyWithArray(ctx, state->hist_buckets + 2);
+  for(long long i=0; i < state->hist_buckets + 2; ++i)
+    RedisModule_ReplyWithLongLong(ctx, state->hist[i]);
+  return REDISMODULE_OK;
+}
+
+/* group partials are looked up linearly, there are at most as many as the
+   grouped dimension has values
+*/
+int group_add(OP_STATE *state, C_CHARS key, CELL_VALUE *val) {
+  char *group = get_key_segment(key + strlen(state->schema->prefix),
+    state->group_ord, state->options.hashtag);
+  if(group == NULL)
+    return REDISMODULE_OK;
+  GROUP_ENTRY *entry = NULL;
+  for(size_t i=0; i < state->group_len && entry == NULL; ++i) {
+    if(strcmp(state->groups[i].group, group) == 0)
+      entry = &state->groups[i];
+  }
+  if(entry == NULL) {
+    if(state->group_len == state->group_cap) {
+      size_t cap = (state->group_cap == 0)? TOPK_INITIAL_CAP :
+        state->group_cap * 2;
+      GROUP_ENTRY *groups = realloc(state->groups, cap * sizeof(GROUP_ENTRY));
+      if(groups == NULL) {
+        free(group);
+        return MODULE_ERROR;
+      }
+      state->groups = groups;
+      state->group_cap = cap;
+    }
+    entry = &state->groups[state->group_len++];
+    entry->group = group;
+    aggregate_init(&entry->agg);
+  }
+  else
+    free(group);
+  aggregate_add(&entry->agg, val);
+  return REDISMODULE_OK;
+}
+
+/* [count, sum, min, max], min and max are null for an empty partial.
+   partials merge by adding counts and sums and taking min of mins and max
+   of maxes
+*/
+int reply_with_partial(RedisModuleCtx *ctx, AGGREGATE *agg) {
+  RedisModule_ReplyWithArray(ctx, 4);
+  RedisModule_ReplyWithLongLong(ctx, agg->count);
+  reply_with_sum(ctx, agg);
+  if(agg->count == 0) {
+    RedisModule_ReplyWithNull(ctx);
+    return RedisModule_ReplyWithNull(ctx);
+  }
+  reply_with_cell_value(ctx, &agg->min);
+  return reply_with_cell_value(ctx, &agg->max);
+}
+
+int reply_with_partials(RedisModuleCtx *ctx, OP_STATE *state) {
+  if(!state->grouped)
+    return reply_with_partial(ctx, &state->agg);
+  RedisModule_ReplyWithArray(ctx, state->group_len * 2);
+  for(size_t i=0; i < state->group_len; ++i) {
+    RedisModule_ReplyWithStringBuffer(ctx, state->groups[i].group,
+      strlen(state->groups[i].group));
+    reply_with_partial(ctx, &state->groups[i].agg);
+  }
+  return REDISMODULE_OK;
+}
+
+void free_op_state(OP_STATE *state) {
+  for(size_t i=0; i < state->group_len; ++i)
+    free(state->groups[i].group);
+  free(state->groups);
+  for(size_t i=0; i < state->topk_len; ++i)
+    free(state->topk[i].key);
+  free(state->topk);
+  sketch_free(state->sketch);
+  tdigest_free(state->digest);
+  free(state->quantiles);
+  free(state->hist);
+  for(size_t i=0; i < state->page_len; ++i)
+    free(state->page[i].key);
+  free(state->page);
+}
+
+/* fold a cell into the aggregate, cells that are not strings are skipped
+*/
+int aggregate_cell(RedisModuleCtx *ctx, char *key, OP_STATE* state) {
+  CELL_VALUE val;
+  CELL_STATUS status = read_matched_value(ctx, key, state, &val);
+  if(status == CELL_MISSING)
+    return REDISMODULE_OK;
+  if(status == CELL_NAN) {
+    state->err_msg = ERR_MSG_NOT_A_NUMBER;
+    state->stage = OP_ERR;
+    return MODULE_ERROR;
+  }
+  switch (state->op) {
+    case S_OP_AVG:
+    case S_OP_SUM:
+    case S_OP_MIN:
+    case S_OP_MAX:
+      aggregate_add(&state->agg, &val);
+      break;
+    case S_OP_PARTIAL:
+      aggregate_add(&state->agg, &val);
+      if(state->grouped)
+        group_add(state, key, &val);
+      break;
+    case S_OP_TOPK:
+      topk_offer(state, key, &val);
+      break;
+    case S_OP_QUANTILE:
+      tdigest_add(state->digest, val.dval, 1);
+      break;
+    case S_OP_HIST:
+      hist_add(state, val.dval);
+      break;
+    default:
+      break;
+  }
+  state->value_count++;
+  return REDISMODULE_OK;
+}
+
+SKETCH_TYPE sketch_type_of_op(SCHEMA_OP op) {
+  return (op == S_OP_DISTINCT)? SKETCH_HLL : SKETCH_CMS;
+}
+
+/* merge the cell's sketch into the running one, cells holding anything
+   else (or a sketch of the other kind) are skipped
+*/
+int merge_cell_sketch(RedisModuleCtx *ctx, char *key, OP_STATE* state) {
+  RedisModuleString *key_str = RM_CreateString(ctx, key);
+  RedisModuleKey *redis_key = RedisModule_OpenKey(ctx, key_str, REDISMODULE_READ);
+  if(RedisModule_KeyType(redis_key) == REDISMODULE_KEYTYPE_MODULE &&
+    RedisModule_ModuleTypeGetType(redis_key) == SketchType) {
+    SKETCH *cell = RedisModule_ModuleTypeGetValue(redis_key);
+    if(state->sketch == NULL)
+      state->sketch = sketch_new(sketch_type_of_op(state->op));
+    if(state->sketch != NULL && sketch_merge(state->sketch, cell) == 0)
+      state->value_count++;
+  }
+  RedisModule_CloseKey(redis_key);
+  RedisModule_FreeString(ctx, key_str);
+  return REDISMODULE_OK;
+}
+
+int reply_with_heavy_hitters(RedisModuleCtx *ctx, SKETCH *sketch) {
+  size_t top_len = (sketch == NULL)? 0 : sketch_top(sketch);
+  RedisModule_ReplyWithArray(ctx, top_len * 2);
+  for(size_t i=0; i < top_len; ++i) {
+    RedisModule_ReplyWithStringBuffer(ctx, sketch->top[i].item,
+      sketch->top[i].len);
+    RedisModule_ReplyWithLongLong(ctx, sketch->top[i].count);
+  }
+  return REDISMODULE_OK;
+}
+
+bool match_ords(Query *query, uint32_t *ords) {
+  for(size_t d=0; d < query->key_set_size; ++d) {
+    if(query->masks[d] != NULL && !query->masks[d][ords[d]])
+      return false;
+  }
+  return true;
+}
+
+/* the ordinal of each segment of the matched cell, 0 for missing ones
+*/
+void matched_cell_ords(OP_STATE *state, C_CHARS key, uint32_t *ords) {
+  SCHEMA *schema = state->schema;
+  if(state->store != NULL) {
+    for(size_t d=0; d < schema->dim_count; ++d) {
+      uint32_t ord = cell_store_ord(state->store,
+        state->store->coords[state->cell], d);
+      ords[d] = (ord <= schema->dims[d].val_count)? ord : 0;
+    }
+  }
+  else
+    key_ords(schema, key + strlen(schema->prefix), state->options.hashtag,
+      ords);
+}
+
+/* folds a cell into every term whose filter it passes, reading it once
+*/
+int eval_cell(RedisModuleCtx *ctx, char *key, OP_STATE *state) {
+  EVAL_STATE *eval = state->eval;
+  CELL_VALUE val;
+  CELL_STATUS status = read_matched_value(ctx, key, state, &val);
+  if(status == CELL_MISSING)
+    return REDISMODULE_OK;
+  if(status == CELL_NAN) {
+    state->err_msg = ERR_MSG_NOT_A_NUMBER;
+    state->stage = OP_ERR;
+    return MODULE_ERROR;
+  }
+  matched_cell_ords(state, key, eval->ords);
+  size_t group = state->grouped? eval->ords[state->group_ord] : 0;
+  if(state->grouped && group == 0)
+    return REDISMODULE_OK;
+  AGGREGATE *aggs = &eval->aggs[group * eval->term_count];
+  for(size_t t=0; t < eval->term_count; ++t) {
+    if(match_ords(&eval->terms[t].query, eval->ords))
+      aggregate_add(&aggs[t], &val);
+  }
+  return REDISMODULE_OK;
+}
+
+/* NaN for the average, min or max of no cells
+*/
+double eval_term_value(EVAL_TERM *term, AGGREGATE *agg) {
+  switch(term->agg) {
+    case EVAL_SUM:
+      return sum_get_double(agg);
+    case EVAL_COUNT:
+      return agg->count;
+    case EVAL_AVG:
+      return (agg->count == 0)? NAN : sum_get_double(agg) / agg->count;
+    case EVAL_MIN:
+      return (agg->count == 0)? NAN : agg->min.dval;
+    case EVAL_MAX:
+      return (agg->count == 0)? NAN : agg->max.dval;
+  }
+  return NAN;
+}
+
+/* nil when the expression has no value, it divided by zero or used the
+   average of no cells
+*/
+int reply_with_eval_value(RedisModuleCtx *ctx, EVAL_STATE *eval,
+  AGGREGATE *aggs) {
+  double *vals = malloc(eval->term_count * sizeof(double));
+  if(vals == NULL)
+    return RedisModule_ReplyWithNull(ctx);
+  for(size_t t=0; t < eval->term_count; ++t)
+    vals[t] = eval_term_value(&eval->terms[t], &aggs[t]);
+  double ret = expr_eval(eval->expr, vals);
+  free(vals);
+  if(!isfinite(ret))
+    return RedisModule_ReplyWithNull(ctx);
+  return RedisModule_ReplyWithDouble(ctx, ret);
+}
+
+/* grouped, a group value and its result for every group some term saw
+*/
+int reply_with_eval(RedisModuleCtx *ctx, OP_STATE *state) {
+  EVAL_STATE *eval = state->eval;
+  if(!state->grouped)
+    return reply_with_eval_value(ctx, eval, eval->aggs);
+  SCHEMA_DIM *dim = &state->schema->dims[state->group_ord];
+  size_t len = 0;
+  RedisModule_ReplyWithArray(ctx, REDISMODULE_POSTPONED_ARRAY_LEN);
+  for(size_t g=1; g < eval->group_count; ++g) {
+    AGGREGATE *aggs = &eval->aggs[g * eval->term_count];
+    bool seen = false;
+    for(size_t t=0; t < eval->term_count && !seen; ++t)
+      seen = (aggs[t].count > 0);
+    if(!seen)
+      continue;
+    RedisModule_ReplyWithStringBuffer(ctx, dim->vals[g - 1],
+      strlen(dim->vals[g - 1]));
+    reply_with_eval_value(ctx, eval, aggs);
+    len += 2;
+  }
+  RedisModule_ReplySetArrayLength(ctx, len);
+  return REDISMODULE_OK;
+}
+
+int append_key(char ***keys, size_t *len, size_t *cap, C_CHARS key) {
+  if(*len == *cap) {
+    size_t new_cap = (*cap == 0)? TOPK_INITIAL_CAP : *cap * 2;
+    char **grown = realloc(*keys, new_cap * sizeof(char*));
+    if(grown == NULL)
+      return MODULE_ERROR;
+    *keys = grown;
+    *cap = new_cap;
+  }
+  (*keys)[(*len)++] = strdup(key);
+  return REDISMODULE_OK;
+}
+
+int append_get_entry(OP_STATE *state, GET_ENTRY *entry) {
+  if(state->page_len == state->page_cap) {
+    size_t cap = (state->page_cap == 0)? TOPK_INITIAL_CAP :
+      state->page_cap * 2;
+    GET_ENTRY *page = realloc(state->page, cap * sizeof(GET_ENTRY));
+    if(page == NULL)
+      return MODULE_ERROR;
+    state->page = page;
+    state->page_cap = cap;
+  }
+  GET_ENTRY *at = &state->page[state->page_len++];
+  *at = *entry;
+  at->key = strdup(entry->key);
+  return REDISMODULE_OK;
+}
+
+bool page_full(OP_STATE *state) {
+  return state->paged && state->match_count >= (size_t)state->page_size;
+}
+
+/* reply elements per matched cell
+*/
+size_t get_entry_width(OP_STATE *state) {
+  return 1 + (state->with_values? 1 : 0) + (state->with_coords? 1 : 0);
+}
+
+/* the value of each dimension of a cell, nil where it has no segment
+*/
+int reply_with_coords(RedisModuleCtx *ctx, OP_STATE *state, C_CHARS key) {
+  C_CHARS cell = key + strlen(state->schema->prefix);
+  RedisModule_ReplyWithArray(ctx, state->schema->dim_count);
+  for(size_t d=0; d < state->schema->dim_count; ++d) {
+    char *segment = get_key_segment(cell, d, state->options.hashtag);
+    if(segment == NULL)
+      RedisModule_ReplyWithNull(ctx);
+    else
+      RedisModule_ReplyWithStringBuffer(ctx, segment, strlen(segment));
+    free(segment);
+  }
+  return REDISMODULE_OK;
+}
+
+int reply_with_get_entry(RedisModuleCtx *ctx, OP_STATE *state,
+  GET_ENTRY *entry) {
+  RedisModule_ReplyWithSimpleString(ctx, entry->key);
+  if(state->with_values && entry->status == CELL_OK)
+    reply_with_cell_value(ctx, &entry->val);
+  else if(state->with_values)
+    RedisModule_ReplyWithNull(ctx);
+  if(state->with_coords)
+    reply_with_coords(ctx, state, entry->key);
+  return REDISMODULE_OK;
+}
+
+/* replies with a matched cell, or keeps it for the page
+*/
+int get_matched_key(RedisModuleCtx *ctx, char *key, OP_STATE *state) {
+  GET_ENTRY entry = {.key = key, .status = CELL_MISSING};
+  if(state->with_values)
+    entry.status = read_matched_value(ctx, key, state, &entry.val);
+  if(state->paged)
+    return append_get_entry(state, &entry);
+  return reply_with_get_entry(ctx, state, &entry);
+}
+
+/* SchemaEXPORT keeps the numeric cells it matched, the rest do not fit a
+   file
+*/
+int export_matched_key(RedisModuleCtx *ctx, char *key, OP_STATE *state) {
+  GET_ENTRY entry = {.key = key};
+  entry.status = read_matched_value(ctx, key, state, &entry.val);
+  if(entry.status != CELL_OK)
+    return REDISMODULE_OK;
+  return append_get_entry(state, &entry);
+}
+
+int reply_with_page(RedisModuleCtx *ctx, OP_STATE *state) {
+  char cursor[GET_CURSOR_MAX_LEN];
+  int len = snprintf(cursor, sizeof(cursor), "%llu", state->cursor);
+  RedisModule_ReplyWithArray(ctx, 2);
+  RedisModule_ReplyWithStringBuffer(ctx, cursor, len);
+  RedisModule_ReplyWithArray(ctx, state->page_len * get_entry_width(state));
+  for(size_t i=0; i < state->page_len; ++i)
+    reply_with_get_entry(ctx, state, &state->page[i]);
+  return REDISMODULE_OK;
+}
+
+int schema_op_init(RedisModuleCtx *ctx, char *key, OP_STATE* state) {
+  switch (state->op) {
+    case S_OP_GET:
+      if(!state->paged)
+        RedisModule_ReplyWithArray(ctx,REDISMODULE_POSTPONED_ARRAY_LEN);
+      break;
+    default:
+      break;
+  }
+  state->stage = OP_MID;
+  return REDISMODULE_OK;
+}
+
+void rollup_matched_cell(RedisModuleCtx *ctx, C_CHARS key, OP_STATE *state,
+  CELL_VALUE *from, CELL_VALUE *to) {
+  uint32_t ords[CELL_STORE_MAX_DIMS];
+  if(!has_rollups(state->schema) ||
+    state->schema->dim_count >= CELL_STORE_MAX_DIMS)
+    return;
+  matched_cell_ords(state, key, ords);
+  rollup_cell(ctx, state->schema, ords, from, to);
+}
+
+/* INCR of a plain key only ever adds 1 to an integer, a packed cell may
+   turn into a double
+*/
+void increment_matched_cell(RedisModuleCtx *ctx, C_CHARS key,
+  OP_STATE *state) {
+  CELL_VALUE old = {.is_int = true}, val = {.is_int = true, .ival = 1,
+    .dval = 1};
+  if(state->store != NULL) {
+    read_store_value(state->store, state->cell, &old);
+    increment_store_cell(state->store, state->cell);
+    read_store_value(state->store, state->cell, &val);
+  }
+  else if(state->coalesce && buffer_increment(ctx, key))
+    return; //its parents are summed once it is written
+  else if(state->coalesce) {
+    if(increment_key_by(ctx, key, 1, &old, &val) != REDISMODULE_OK)
+      return;
+    replicate_cell(ctx, key); //the command does not replicate
+  }
+  else if(increment_key(ctx, key, &state->options) != REDISMODULE_OK)
+    return;
+  rollup_matched_cell(ctx, key, state, &old, &val);
+}
+
+/* the cell is read before it goes, its parents lose what it held
+*/
+void clear_matched_cell(RedisModuleCtx *ctx, C_CHARS key, OP_STATE *state) {
+  CELL_VALUE val;
+  if(has_rollups(state->schema) &&
+    read_matched_value(ctx, key, state, &val) == CELL_OK)
+    rollup_matched_cell(ctx, key, state, &val, NULL);
+  if(state->store != NULL)
+    cell_store_delete(state->store, state->cell);
+  else
+    delete_key(ctx, key);
+}
+
+/* SchemaLoad adds the cells that are already there to fresh sums
+*/
+void rollup_existing_cell(RedisModuleCtx *ctx, C_CHARS key, OP_STATE *state) {
+  CELL_VALUE val;
+  if(read_matched_value(ctx, key, state, &val) == CELL_OK)
+    rollup_matched_cell(ctx, key, state, NULL, &val);
+}
+
+int schema_op_mid(RedisModuleCtx *ctx, char *key, OP_STATE* state) {
+  switch (state->op) {
+    case S_OP_GET:
+      get_matched_key(ctx, key, state);
+      break;
+    case S_OP_INC:
+      increment_matched_cell(ctx, key, state);
+      break;
+    case S_OP_CLR:
+      clear_matched_cell(ctx, key, state);
+      break;
+    case S_OP_AVG:
+    case S_OP_SUM:
+    case S_OP_MIN:
+    case S_OP_MAX:
+    case S_OP_TOPK:
+    case S_OP_QUANTILE:
+    case S_OP_HIST:
+    case S_OP_PARTIAL:
+      aggregate_cell(ctx, key, state);
+      break;
+    case S_OP_EVAL:
+      eval_cell(ctx, key, state);
+      break;
+    case S_OP_ROLLUP:
+      rollup_existing_cell(ctx, key, state);
+      break;
+    case S_OP_EXPORT:
+      export_matched_key(ctx, key, state);
+      break;
+    case S_OP_DISTINCT:
+    case S_OP_FREQ:
+    case S_OP_HEAVY:
+      merge_cell_sketch(ctx, key, state);
+      break;
+    default:
+      break;
+  }
+  state->match_count++;
+  return REDISMODULE_OK;
+}
+
+//TODO: error handling + reply for all cases + reply during error
+int schema_op_done(RedisModuleCtx *ctx, OP_STATE* state) {
+  switch (state->op) {
+    case S_OP_GET:
+      if(state->paged)
+        reply_with_page(ctx, state);
+      else if(state->match_count == 0) //the postponed array was never opened
+        RedisModule_ReplyWithSimpleString(ctx, NO_KEYS_MATCHED);
+      else
+        RedisModule_ReplySetArrayLength(ctx,
+          state->match_count * get_entry_width(state));
+      break;
+    case S_OP_SUM:
+      reply_with_sum(ctx, &state->agg);
+      break;
+    case S_OP_MIN:
+    case S_OP_MAX:
+      if(state->agg.count == 0)
+        RedisModule_ReplyWithSimpleString(ctx, NO_KEYS_MATCHED);
+      else
+        reply_with_cell_value(ctx, (state->op == S_OP_MIN)?
+          &state->agg.min : &state->agg.max);
+      break;
+    case S_OP_AVG:
+      if(state->agg.count == 0)
+        RedisModule_ReplyWithSimpleString(ctx, NO_KEYS_MATCHED);
+      else
+        RedisModule_ReplyWithDouble(ctx,
+          sum_get_double(&state->agg) / state->agg.count);
+      break;
+    case S_OP_DISTINCT:
+      RedisModule_ReplyWithLongLong(ctx,
+        (state->sketch == NULL)? 0 : sketch_count(state->sketch));
+      break;
+    case S_OP_FREQ:
+      RedisModule_ReplyWithLongLong(ctx, (state->sketch == NULL)? 0 :
+        sketch_frequency(state->sketch, state->item, state->item_len));
+      break;
+    case S_OP_HEAVY:
+      reply_with_heavy_hitters(ctx, state->sketch);
+      break;
+    case S_OP_TOPK:
+      reply_with_topk(ctx, state);
+      break;
+    case S_OP_QUANTILE:
+      reply_with_quantiles(ctx, state);
+      break;
+    case S_OP_HIST:
+      reply_with_hist(ctx, state);
+      break;
+    case S_OP_PARTIAL:
+      reply_with_partials(ctx, state);
+      break;
+    case S_OP_EVAL:
+      reply_with_eval(ctx, state);
+      break;
+    default:
+      RedisModule_ReplyWithSimpleString(ctx, OK_STR);
+      break;
+  }
+  return REDISMODULE_OK;
+}
+
+int found_matched_key(RedisModuleCtx *ctx, char *key, OP_STATE* state) {
+  switch (state->stage) {
+    case OP_INIT:
+      schema_op_init(ctx, key, state);
+    case OP_MID:
+      schema_op_mid(ctx, key, state);
+      break;
+    case OP_DONE:
+      schema_op_done(ctx, state);
+      break;
+    default:
+      break;
+  }
+  return REDISMODULE_OK;
+}
+
+bool match_cell_ords(Query *query, CELL_STORE *store, uint64_t coord) {
+  for(size_t d=0; d < query->key_set_size; ++d) {
+    if(query->masks[d] == NULL)
+      continue;
+    uint32_t ord = cell_store_ord(store, coord, d);
+    if(ord > query->schema->dims[d].val_count || !query->masks[d][ord])
+      return false;
+  }
+  return true;
+}
+
+/* a sparse schema is scanned straight from its packed cells, filtering on
+   ordinals. only matching cells are turned into keys. a page of them ends
+   before a cell, whose coordinate is the cursor of the next page.
+   the store must be compacted. touches nothing but the store and the
+   state, so it may run off the main thread over a snapshot
+*/
+void filter_store_cells(RedisModuleCtx *ctx, Query *query, OP_STATE *state,
+  CELL_STORE *store) {
+  state->store = store;
+  size_t i = state->paged? cell_store_seek(store, state->cursor) : 0;
+  state->cursor = 0;
+  for(; i < store->len && state->stage != OP_ERR; ++i) {
+    if(page_full(state)) {
+      state->cursor = store->coords[i];
+      break;
+    }
+    if(store->flags[i] == CELL_STORE_DEAD ||
+      !match_cell_ords(query, store, store->coords[i]))
+      continue;
+    char *key = cell_store_key(state->schema, store, store->coords[i]);
+    state->cell = i;
+    found_matched_key(ctx, key, state);
+    free(key);
+  }
+  state->store = NULL;
+}
+
+int filter_store(RedisModuleCtx *ctx, Query *query, OP_STATE *state) {
+  SCHEMA *schema = state->schema;
+  int mode = (state->op == S_OP_INC || state->op == S_OP_CLR)?
+    REDISMODULE_READ | REDISMODULE_WRITE : REDISMODULE_READ;
+  RedisModuleString *key_str = RM_CreateString(ctx, schema->store_key);
+  RedisModuleKey *redis_key = RedisModule_OpenKey(ctx, key_str, mode);
+  if(RedisModule_KeyType(redis_key) == REDISMODULE_KEYTYPE_MODULE &&
+    RedisModule_ModuleTypeGetType(redis_key) == CellStoreType) {
+    CELL_STORE *store = RedisModule_ModuleTypeGetValue(redis_key);
+    cell_store_compact(store);
+    filter_store_cells(ctx, query, state, store);
+  }
+  RedisModule_CloseKey(redis_key);
+  RedisModule_FreeString(ctx, key_str);
+  return REDISMODULE_OK;
+}
+
+void free_key_cursor(KEY_CURSOR *cursor) {
+  RedisModule_ScanCursorDestroy(cursor->scan);
+  for(size_t i=0; i < cursor->pending_len; ++i)
+    free(cursor->pending[i]);
+  free(cursor->pending);
+  free(cursor->schema);
+  free(cursor);
+}
+
+/* pagings that are never finished must not pin their cursors, those idle
+   for too long and the least recently used over the limit are dropped
+*/
+void expire_key_cursors(long long now) {
+  size_t open = 0;
+  for(KEY_CURSOR **at = &KeyCursors; *at != NULL;) {
+    KEY_CURSOR *cursor = *at;
+    if(now - cursor->last_used > GET_CURSOR_IDLE_MS ||
+      ++open > GET_CURSORS_MAX) {
+      *at = cursor->next;
+      free_key_cursor(cursor);
+    }
+    else
+      at = &cursor->next;
+  }
+}
+
+/* the cursor a page resumes from, a new one for cursor 0. it is unlinked
+   while the page is built, save_key_cursor puts it back
+*/
+KEY_CURSOR *take_key_cursor(C_CHARS schema, unsigned long long id) {
+  if(id == 0) {
+    KEY_CURSOR *cursor = calloc(1, sizeof(KEY_CURSOR));
+    if(cursor == NULL)
+      return NULL;
+    cursor->schema = strdup(schema);
+    cursor->scan = RedisModule_ScanCursorCreate();
+    return cursor;
+  }
+  for(KEY_CURSOR **at = &KeyCursors; *at != NULL; at = &(*at)->next) {
+    KEY_CURSOR *cursor = *at;
+    if(cursor->id == id && strcmp(cursor->schema, schema) == 0) {
+      *at = cursor->next;
+      return cursor;
+    }
+  }
+  return NULL;
+}
+
+void save_key_cursor(KEY_CURSOR *cursor, long long now) {
+  if(cursor->id == 0)
+    cursor->id = NextCursorId++;
+  cursor->last_used = now;
+  cursor->next = KeyCursors;
+  KeyCursors = cursor;
+  expire_key_cursors(now);
+}
+
+void sweep_wrote(RedisModuleCtx *ctx, SWEEP *sweep, C_CHARS key) {
+  if(sweep->blocked)
+    replicate_cell(ctx, key);
+  else
+    append_key(&sweep->written, &sweep->written_len, &sweep->written_cap, key);
+}
+
+/* a sweep writes a cell once, a key it can not remember stops it
+*/
+bool first_sight(SWEEP *sweep, C_CHARS key) {
+  size_t seen = sweep->seen->len;
+  if(delta_buf_add(sweep->seen, key, 0) != 0) {
+    sweep->state.stage = OP_ERR;
+    sweep->state.err_msg = ERR_MSG_NO_MEM;
+    return false;
+  }
+  return sweep->seen->len > seen;
+}
+
+void filter_scanned_key(RedisModuleCtx *ctx, RedisModuleString *keyname,
+  RedisModuleKey *key, void *privdata) {
+  SCAN_STATE *scan = privdata;
+  size_t len;
+  C_CHARS name = RedisModule_StringPtrLen(keyname, &len);
+  if(scan->state->stage == OP_ERR || len < scan->prefix_len ||
+    strncmp(name, scan->prefix, scan->prefix_len) != 0)
+    return;
+  char *cell_key = strndup(name, len);
+  if(match_key_to_query(cell_key + scan->prefix_len, scan->query) &&
+    (scan->sweep == NULL || first_sight(scan->sweep, cell_key))) {
+    if(page_full(scan->state)) //a scan batch does not stop mid way
+      append_key(&scan->cursor->pending, &scan->cursor->pending_len,
+        &scan->cursor->pending_cap, cell_key);
+    else {
+      scan->state->scan_key = key;
+      found_matched_key(ctx, cell_key, scan->state);
+      scan->state->scan_key = NULL;
+      if(scan->sweep != NULL)
+        sweep_wrote(ctx, scan->sweep, cell_key);
+    }
+  }
+  free(cell_key);
+}
+
+/* matches the previous page found past its end come first
+*/
+void drain_key_cursor(RedisModuleCtx *ctx, SCAN_STATE *scan) {
+  KEY_CURSOR *cursor = scan->cursor;
+  size_t i = 0;
+  for(; i < cursor->pending_len && !page_full(scan->state); ++i) {
+    if(match_key_to_query(cursor->pending[i] + scan->prefix_len, scan->query))
+      found_matched_key(ctx, cursor->pending[i], scan->state);
+    free(cursor->pending[i]);
+  }
+  if(i == 0)
+    return;
+  memmove(cursor->pending, cursor->pending + i,
+    (cursor->pending_len - i) * sizeof(char*));
+  cursor->pending_len -= i;
+}
+
+/* with fill every value of every dimension passes, cells written by
+   SchemaSet/SchemaADD are checked against that
+*/
+void build_query(SCHEMA *schema, Query *query, bool fill) {
+  query->schema = schema;
+  query->hashtag = HASHTAG_NONE;
+  query->partial_keys = false;
+  query->key_set_size = schema->dim_count;
+  query->masks = calloc(query->key_set_size, sizeof(unsigned char*));
+  query->groups = calloc(query->key_set_size, sizeof(unsigned char*));
+  for(size_t i=0; fill && i < query->key_set_size; ++i)
+    query_mask(query, i, true);
+}
+
+void free_query(Query *query) {
+  for(size_t i=0; i < query->key_set_size; ++i) {
+    free(query->masks[i]);
+    free(query->groups[i]);
+  }
+  free(query->masks);
+  free(query->groups);
+}
+
+size_t mask_count(Query *query, size_t d) {
+  size_t count = 0;
+  for(size_t r=1; r <= query->schema->dims[d].val_count; ++r)
+    count += query->masks[d][r];
+  return count;
+}
+
+/* saturates past PINNED_KEYS_MAX, only the bound matters
+*/
+size_t pinned_count(Query *query, bool *pinned) {
+  size_t count = 1;
+  for(size_t d=0; d < query->key_set_size; ++d) {
+    if(pinned[d])
+      count *= mask_count(query, d);
+    if(count > PINNED_KEYS_MAX)
+      count = PINNED_KEYS_MAX + 1;
+  }
+  return count;
+}
+
+/* a filter fixing dimensions to one or a few values spells them out in
+   the keys it looks for: pinned[d] tells whether dimension d is. a filter
+   fixing all of them names its cells, exact is then set. otherwise the
+   widest dimensions become wildcards until a single glob is left, more
+   SCAN MATCH passes would walk the keyspace more than once. returns how
+   many keys or globs the combinations of pinned values make, MODULE_ERROR
+   when no dimension is left pinned
+*/
+long pin_query(Query *query, bool *pinned, bool *exact) {
+  *exact = true;
+  for(size_t d=0; d < query->key_set_size; ++d) {
+    pinned[d] = (query->masks[d] != NULL);
+    *exact = *exact && pinned[d];
+  }
+  size_t count = pinned_count(query, pinned);
+  while(count > (*exact? PINNED_KEYS_MAX : PINNED_GLOBS_MAX)) {
+    size_t widest = 0, widest_count = 0;
+    for(size_t d=0; d < query->key_set_size; ++d) {
+      if(pinned[d] && mask_count(query, d) > widest_count) {
+        widest = d;
+        widest_count = mask_count(query, d);
+      }
+    }
+    pinned[widest] = false;
+    *exact = false;
+    count = pinned_count(query, pinned);
+  }
+  for(size_t d=0; d < query->key_set_size; ++d) {
+    if(pinned[d])
+      return count;
+  }
+  return MODULE_ERROR;
+}
+
+size_t next_mask_rank(Query *query, size_t d, size_t from) {
+  size_t r = from;
+  while(r < query->schema->dims[d].val_count && !query->masks[d][r + 1])
+    ++r;
+  return r;
+}
+
+/* steps ranks to the next combination of pinned values like an odometer,
+   false once it wrapped back to the first
+*/
+bool next_pinned(Query *query, bool *pinned, size_t *ranks) {
+  for(size_t d = query->key_set_size; d-- > 0;) {
+    if(!pinned[d])
+      continue;
+    ranks[d] = next_mask_rank(query, d, ranks[d] + 1);
+    if(ranks[d] < query->schema->dims[d].val_count)
+      return true;
+    ranks[d] = next_mask_rank(query, d, 0);
+  }
+  return false;
+}
+
+char *append_glob(char *end, C_CHARS str, bool escape) {
+  for(; *str != '\0'; ++str) {
+    if(escape && strchr(GLOB_SPECIAL_CHARS, *str) != NULL)
+      *end++ = '\\';
+    *end++ = *str;
+  }
+  return end;
+}
+
+/* returned pointer must be freed, the key or the glob of a combination of
+   pinned values. a glob stops after its last pinned value, so it also
+   takes cells written before the dimensions after it were added
+*/
+char *pinned_pattern(Query *query, C_CHARS prefix, bool *pinned,
+  size_t *ranks, bool exact) {
+  SCHEMA *schema = query->schema;
+  size_t last = 0, len = strlen(prefix) + 2;
+  for(size_t d=0; d < query->key_set_size; ++d) {
+    if(pinned[d]) {
+      last = d;
+      len += strlen(schema->dims[d].vals[ranks[d]]);
+    }
+    len += 3; //a delimiter, a wildcard or the braces of a hashtag
+  }
+  char *pattern = malloc(len * 2), *end = pattern;
+  if(pattern == NULL)
+    return NULL;
+  end = append_glob(end, prefix, !exact);
+  for(size_t d=0; d <= last; ++d) {
+    bool tag = ((int)d == tagged_dim(query->hashtag));
+    if(d > 0)
+      *end++ = REDIS_HIERARCHY_DELIM[0];
+    if(!pinned[d]) {
+      *end++ = '*';
+      continue;
+    }
+    if(tag)
+      *end++ = HASHTAG_OPEN;
+    end = append_glob(end, schema->dims[d].vals[ranks[d]], !exact);
+    if(tag)
+      *end++ = HASHTAG_CLOSE;
+  }
+  if(!exact && last + 1 < query->key_set_size)
+    *end++ = '*';
+  *end = '\0';
+  return pattern;
+}
+
+/* the filter as its glob sees it. a wildcard may span delimiters, so a
+   key on the glob still has its values matched segment by segment
+*/
+int narrow_query(Query *query, bool *pinned, size_t *ranks, Query *narrow) {
+  build_query(query->schema, narrow, false);
+  narrow->hashtag = query->hashtag;
+  narrow->partial_keys = query->partial_keys;
+  for(size_t d=0; d < query->key_set_size; ++d) {
+    size_t len = query->schema->dims[d].val_count + 1;
+    if(query->masks[d] == NULL)
+      continue;
+    narrow->masks[d] = calloc(len, 1);
+    if(narrow->masks[d] == NULL)
+      return MODULE_ERROR;
+    if(pinned[d])
+      narrow->masks[d][ranks[d] + 1] = 1;
+    else
+      memcpy(narrow->masks[d], query->masks[d], len);
+  }
+  return REDISMODULE_OK;
+}
+
+/* SCAN MATCH drops the keys off the glob inside Redis, only the ones on
+   it come back to be matched segment by segment
+*/
+void scan_glob(RedisModuleCtx *ctx, C_CHARS glob, Query *narrow,
+  OP_STATE *state) {
+  size_t prefix_len = strlen(state->schema->prefix), len;
+  char cursor[GET_CURSOR_MAX_LEN] = SCAN_CURSOR_START;
+  do {
+    RedisModuleCallReply *reply = RedisModule_Call(ctx, SCAN_CMD, "ccccc",
+      cursor, ARG_MATCH, glob, ARG_COUNT, SCAN_MATCH_COUNT);
+    if(reply == NULL ||
+      RedisModule_CallReplyType(reply) != REDISMODULE_REPLY_ARRAY ||
+      RedisModule_CallReplyLength(reply) != 2) {
+      RedisModule_FreeCallReply(reply);
+      state->stage = OP_ERR;
+      state->err_msg = ERR_MSG_GENERAL_ERROR;
+      return;
+    }
+    RedisModuleCallReply *keys = RedisModule_CallReplyArrayElement(reply, 1);
+    C_CHARS next = RedisModule_CallReplyStringPtr(
+      RedisModule_CallReplyArrayElement(reply, 0), &len);
+    snprintf(cursor, sizeof(cursor), "%.*s", (int)len, next);
+    for(size_t i=0; i < RedisModule_CallReplyLength(keys) &&
+      state->stage != OP_ERR; ++i) {
+      C_CHARS name = RedisModule_CallReplyStringPtr(
+        RedisModule_CallReplyArrayElement(keys, i), &len);
+      char *key = strndup(name, len);
+      if(len >= prefix_len && match_key_to_query(key + prefix_len, narrow))
+        found_matched_key(ctx, key, state);
+      free(key);
+    }
+    RedisModule_FreeCallReply(reply);
+  } while(strcmp(cursor, SCAN_CURSOR_START) != 0 && state->stage != OP_ERR);
+}
+
+void lookup_key(RedisModuleCtx *ctx, char *key, OP_STATE *state) {
+  RedisModuleString *key_str = RM_CreateString(ctx, key);
+  RedisModuleKey *redis_key = RedisModule_OpenKey(ctx, key_str,
+    REDISMODULE_READ);
+  if(RedisModule_KeyType(redis_key) != REDISMODULE_KEYTYPE_EMPTY) {
+    state->scan_key = redis_key;
+    found_matched_key(ctx, key, state);
+    state->scan_key = NULL;
+  }
+  RedisModule_CloseKey(redis_key);
+  RedisModule_FreeString(ctx, key_str);
+}
+
+/* a filter fixing dimensions is read from the cells it names, or from a
+   single SCAN MATCH pass, instead of every key of the schema being matched.
+   MODULE_ERROR when it fixes none, the keyspace is walked then
+*/
+int filter_pinned_keys(RedisModuleCtx *ctx, Query *query, OP_STATE *state) {
+  bool *pinned = malloc(sizeof(bool) * query->key_set_size), exact;
+  size_t *ranks = malloc(sizeof(size_t) * query->key_set_size);
+  long count = (pinned == NULL || ranks == NULL)? MODULE_ERROR :
+    pin_query(query, pinned, &exact);
+  for(size_t d=0; count > 0 && d < query->key_set_size; ++d)
+    ranks[d] = pinned[d]? next_mask_rank(query, d, 0) : 0;
+  for(bool more = (count > 0); more && state->stage != OP_ERR;
+    more = next_pinned(query, pinned, ranks)) {
+    Query narrow;
+    char *pattern = pinned_pattern(query, state->schema->prefix, pinned,
+      ranks, exact);
+    if(pattern != NULL && exact)
+      lookup_key(ctx, pattern, state);
+    else if(pattern != NULL &&
+      narrow_query(query, pinned, ranks, &narrow) == REDISMODULE_OK)
+      scan_glob(ctx, pattern, &narrow, state);
+    else {
+      state->stage = OP_ERR;
+      state->err_msg = ERR_MSG_NO_MEM;
+    }
+    if(pattern != NULL && !exact)
+      free_query(&narrow);
+    free(pattern);
+  }
+  free(ranks);
+  free(pinned);
+  return (count == MODULE_ERROR)? MODULE_ERROR : REDISMODULE_OK;
+}
+
+/* bounded by PINNED_KEYS_MAX, so it never needs slicing
+*/
+bool names_cells(Query *query) {
+  bool *pinned = malloc(sizeof(bool) * query->key_set_size), exact = false;
+  if(pinned != NULL)
+    pin_query(query, pinned, &exact);
+  free(pinned);
+  return exact;
+}
+
+/* walks the keyspace with a cursor instead of KEYS, no reply holding every
+   key name is built and matched cells are handled as the cursor finds them.
+   a paged walk keeps its cursor between calls under a numeric id
+*/
+int filter_keys(RedisModuleCtx *ctx, Query *query, OP_STATE *state) {
+  SCAN_STATE scan = {.query = query, .state = state,
+    .prefix = state->schema->prefix,
+    .prefix_len = strlen(state->schema->prefix)};
+  if(!state->paged && filter_pinned_keys(ctx, query, state) == REDISMODULE_OK)
+    return REDISMODULE_OK;
+  if(!state->paged) {
+    RedisModuleScanCursor *cursor = RedisModule_ScanCursorCreate();
+    while(RedisModule_Scan(ctx, cursor, filter_scanned_key, &scan) &&
+      state->stage != OP_ERR);
+    RedisModule_ScanCursorDestroy(cursor);
+    return REDISMODULE_OK;
+  }
+  scan.cursor = take_key_cursor(state->schema->name, state->cursor);
+  if(scan.cursor == NULL) {
+    state->stage = OP_ERR;
+    state->err_msg = ERR_MSG_UNKNOWN_CURSOR;
+    return MODULE_ERROR;
+  }
+  drain_key_cursor(ctx, &scan);
+  bool more = true;
+  while(state->stage != OP_ERR && !page_full(state) &&
+    (more = RedisModule_Scan(ctx, scan.cursor->scan, filter_scanned_key,
+      &scan)));
+  if(!more && scan.cursor->pending_len == 0) {
+    free_key_cursor(scan.cursor);
+    state->cursor = 0;
+  }
+  else {
+    save_key_cursor(scan.cursor, state->options.now);
+    state->cursor = scan.cursor->id;
+  }
+  return REDISMODULE_OK;
+}
+
+int reply_with_results(RedisModuleCtx *ctx, OP_STATE *state) {
+  if(state->stage == OP_ERR)
+    return RedisModule_ReplyWithSimpleString(ctx, state->err_msg);
+  state->stage = OP_DONE;
+  found_matched_key(ctx, NULL, state);
+  return REDISMODULE_OK;
+}
+
+int filter_results_and_reply(RedisModuleCtx *ctx, Query *query,
+  OP_STATE *state) {
+  if(state->options.sparse)
+    filter_store(ctx, query, state);
+  else
+    filter_keys(ctx, query, state);
+  return reply_with_results(ctx, state);
+}
+
+/* a SUM can read the sums of the parents its filter names instead of the
+   cells below them when, in every dimension it names parents in, each
+   value it selects sits below exactly one of them
+*/
+bool rollup_query(Query *query) {
+  bool named = false;
+  for(size_t d=0; d < query->key_set_size; ++d) {
+    SCHEMA_DIM *dim = &query->schema->dims[d];
+    unsigned char *groups = query->groups[d], *mask = query->masks[d];
+    if(groups == NULL)
+      continue;
+    if(mask[0])
+      return false;
+    for(size_t r=0; r < dim->val_count; ++r) {
+      int covered = 0;
+      for(int up = dim->val_parents[r]; up != -1; up = dim->group_parents[up])
+        covered += groups[up];
+      if(covered != mask[r + 1])
+        return false;
+    }
+    named = true;
+  }
+  return named;
+}
+
+/* the sums at the levels the query reads, the named parents where it names
+   them and values (or no segment) everywhere else
+*/
+bool match_rollup_ords(Query *query, CELL_STORE *store, uint64_t coord) {
+  for(size_t d=0; d < query->key_set_size; ++d) {
+    SCHEMA_DIM *dim = &query->schema->dims[d];
+    uint32_t ord = cell_store_ord(store, coord, d + 1);
+    if(query->groups[d] != NULL) {
+      if(ord == 0 || ord > dim->group_count || !query->groups[d][ord - 1])
+        return false;
+      continue;
+    }
+    if(ord > 0 && ord <= dim->group_count)
+      return false;
+    uint32_t val_ord = (ord == 0)? 0 : ord - dim->group_count;
+    if(val_ord > dim->val_count ||
+      (query->masks[d] != NULL && !query->masks[d][val_ord]))
+      return false;
+  }
+  return true;
+}
+
+bool reads_rollup(OP_STATE *state, Query *query) {
+  return state->op == S_OP_SUM && state->window == 0 &&
+    has_rollups(state->schema) && rollup_query(query);
+}
+
+/* MODULE_ERROR when there are no complete sums to read, the cells are
+   read then
+*/
+int sum_rollup(RedisModuleCtx *ctx, Query *query, OP_STATE *state) {
+  RedisModuleString *key_str = RM_CreateString(ctx, state->schema->rollup_key);
+  RedisModuleKey *redis_key = RedisModule_OpenKey(ctx,key_str,REDISMODULE_READ);
+  int rsp = MODULE_ERROR;
+  CELL_STORE *store = complete_rollups(redis_key);
+  if(store != NULL) {
+    AGGREGATE doubles;
+    long long double_count = 0;
+    aggregate_init(&doubles);
+    doubles.is_int = false;
+    cell_store_compact(store);
+    for(size_t i=0; i < store->len; ++i) {
+      CELL_VALUE val;
+      uint32_t kind = cell_store_ord(store, store->coords[i], 0);
+      if(store->flags[i] == CELL_STORE_DEAD ||
+        !match_rollup_ords(query, store, store->coords[i]))
+        continue;
+      read_store_value(store, i, &val);
+      if(kind == ROLLUP_INTS)
+        sum_add_value(&state->agg, &val);
+      else if(kind == ROLLUP_DOUBLES)
+        sum_add_double(&doubles, val.dval);
+      else
+        double_count += val.ival;
+      state->match_count++;
+    }
+    CELL_VALUE part = {.is_int = false, .dval = sum_get_double(&doubles)};
+    if(double_count > 0)
+      sum_add_value(&state->agg, &part);
+    rsp = REDISMODULE_OK;
+  }
+  RedisModule_CloseKey(redis_key);
+  RedisModule_FreeString(ctx, key_str);
+  return rsp;
+}
+
+/* a new store marked complete, which any failure to sum a cell into it
+   takes back. NULL when there is no memory for it
+*/
+CELL_STORE *new_rollups(RedisModuleCtx *ctx, SCHEMA *schema) {
+  CELL_STORE *store = cell_store_new();
+  long i = -1;
+  if(store != NULL && fit_rollup_store(store, schema) == REDISMODULE_OK)
+    i = cell_store_insert(store, ROLLUP_COMPLETE);
+  if(i < 0 || cell_store_set_int(store, i, 1) != 0) {
+    cell_store_free(store);
+    return NULL;
+  }
+  RedisModuleString *key_str = RM_CreateString(ctx, schema->rollup_key);
+  RedisModuleKey *redis_key=RedisModule_OpenKey(ctx,key_str,REDISMODULE_WRITE);
+  RedisModule_ModuleTypeSetValue(redis_key, CellStoreType, store);
+  RedisModule_CloseKey(redis_key);
+  RedisModule_FreeString(ctx, key_str);
+  return store;
+}
+
+/* the sums of a newly loaded hierarchy start from the cells already there,
+   in one pass over them
+*/
+void rebuild_rollups(RedisModuleCtx *ctx, SCHEMA *schema) {
+  OP_STATE state;
+  Query query;
+  delete_key(ctx, schema->rollup_key);
+  if(!has_rollups(schema) || new_rollups(ctx, schema) == NULL)
+    return;
+  init_op_state(&state, S_OP_ROLLUP);
+  state.schema = schema;
+  state.options = schema->options;
+  build_query(schema, &query, false);
+  query.hashtag = schema->options.hashtag;
+  if(schema->options.sparse)
+    filter_store(ctx, &query, &state);
+  else
+    filter_keys(ctx, &query, &state);
+  free_query(&query);
+  free_op_state(&state);
+}
+
+/* PARENTS <json>, walked like a filter so each parent reads as a predicate
+   over its children. the hierarchy is compiled once to check it
+*/
+int load_schema_parents(RedisModuleCtx *ctx, PARSER_STATE *parser,
+  RedisModuleString *parents) {
+  SCHEMA *schema = parser->schema;
+  parser->input = RedisModule_StringPtrLen(parents, NULL);
+  parser->handler = SchemaParents_handler;
+  parser->predicates = true;
+  int resp = parse_input(ctx, parser);
+  if(resp < 0)
+    return resp;
+  SCHEMA *check = compile_schema(ctx, schema->name, schema->version);
+  resp = compile_parents(ctx, check);
+  release_schema(check);
+  if(resp < 0)
+    parser->err_msg = ERR_MSG_INVALID_PARENTS;
+  return resp;
+}
+
+/* HASHTAG <dimension> is kept as the rank of the dimension
+*/
+int save_tag_dim(RedisModuleCtx *ctx, PARSER_STATE *parser,
+  RedisModuleString *tag_dim) {
+  SCHEMA *schema = parser->schema;
+  C_CHARS name = RedisModule_StringPtrLen(tag_dim, NULL);
+  size_t count;
+  char **dims = zset_members(ctx, schema->order_key, &count);
+  for(size_t i=0; i < count; ++i) {
+    if(schema->options.hashtag == HASHTAG_NONE && strcmp(dims[i], name) == 0)
+      schema->options.hashtag = i + 1;
+    free(dims[i]);
+  }
+  free(dims);
+  if(schema->options.hashtag == HASHTAG_NONE) {
+    parser->err_msg = ERR_MSG_INVALID_OPTIONS;
+    return MODULE_ERROR;
+  }
+  return save_schema_options(ctx, schema);
+}
+
+int SchemaLoadCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc){
+    if(argc < SCHEMA_LOAD_ARGS_LIMIT) {
+        return RedisModule_WrongArity(ctx);
+    }
+    size_t len; int resp;
+    C_CHARS name = RedisModule_StringPtrLen(argv[SCHEMA_NAME_ARG], NULL);
+    if(!valid_schema_name(name))
+      return RedisModule_ReplyWithSimpleString(ctx, ERR_MSG_INVALID_SCHEMA_NAME);
+    flush_schema_deltas(ctx, name); //the sums are rebuilt off the cells
+    char *version_key = schema_meta_key(name, SCHEMA_VERSION_KEY);
+    long long version = read_schema_version(ctx, version_key);
+    free(version_key);
+    //the next version is built off to the side while the current one serves
+    SCHEMA *schema = new_schema(name, version + 1);
+    RedisModuleString *parents, *tag_dim;
+    if(parse_schema_options(argv, argc, &schema->options, &parents,
+      &tag_dim) != REDISMODULE_OK) {
+      release_schema(schema);
+      return RedisModule_ReplyWithSimpleString(ctx, ERR_MSG_INVALID_OPTIONS);
+    }
+    set_schema_prefix(schema);
+    drop_schema_version(ctx, name, schema->version); //leftovers of a failed load
+    save_schema_options(ctx, schema);
+    PARSER_STATE parser;
+    parser.err_msg = NULL;
+    parser.schema = schema;
+    parser.input = RedisModule_StringPtrLen(argv[SCHEMA_LOAD_ARG_LIST], &len);
+    parser.handler = SchemaLoad_handler;
+    parser.predicates = false;
+    resp = parse_input(ctx, &parser);
+    if(resp >= 0 && tag_dim != NULL)
+      resp = save_tag_dim(ctx, &parser, tag_dim);
+    if(resp >= 0 && parents != NULL)
+      resp = load_schema_parents(ctx, &parser, parents);
+    if(resp < 0) {
+      drop_schema_version(ctx, name, schema->version);
+      release_schema(schema);
+      return report_error(ctx, parser.err_msg, &parser); // ERR: change message
+    }
+    publish_schema_version(ctx, schema);
+    release_schema(schema);
+    schema = get_schema(ctx, name); //compile it up front, swapping the old one out
+    if(schema != NULL)
+      rebuild_rollups(ctx, schema);
+    drop_schema_version(ctx, name, version);
+    RedisModule_ReplicateVerbatim(ctx);
+    RedisModule_ReplyWithSimpleString(ctx, OK_STR);
+    return REDISMODULE_OK;
+}
+
+bool can_block(RedisModuleCtx *ctx) {
+  return (RedisModule_GetContextFlags(ctx) & (REDISMODULE_CTX_FLAGS_MULTI |
+    REDISMODULE_CTX_FLAGS_LUA | REDISMODULE_CTX_FLAGS_REPLICATED |
+    REDISMODULE_CTX_FLAGS_LOADING)) == 0;
+}
+
+/* a SchemaINC or SchemaCLR over plain keys runs in slices of at most
+   SliceKeys cells or SliceMicros, unless its client can not block:
+   inside MULTI or a script, applying the master's stream or loading.
+   a sparse schema's sweep is a loop over one packed value and runs in one go
+*/
+bool sweeps_in_slices(RedisModuleCtx *ctx, OP_STATE *state, Query *query) {
+  //cells replicate one by one then, the sums of their parents would not,
+  //nor would sketches
+  return (state->op == S_OP_INC || state->op == S_OP_CLR) &&
+    !state->options.sparse && !has_rollups(state->schema) &&
+    state->options.sketch == SKETCH_NONE &&
+    !names_cells(query) &&
+    (SliceKeys > 0 || SliceMicros > 0) && can_block(ctx);
+}
+
+long long monotonic_micros(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+bool slice_spent(SWEEP *sweep, size_t first_match, long long start) {
+  return (SliceKeys > 0 &&
+    sweep->state.match_count - first_match >= (size_t)SliceKeys) ||
+    (SliceMicros > 0 && monotonic_micros() - start >= SliceMicros);
+}
+
+/* true while keys are left to scan. a scan batch does not stop mid way,
+   so a slice may go a batch past its budget
+*/
+bool sweep_slice(RedisModuleCtx *ctx, SWEEP *sweep) {
+  long long start = monotonic_micros();
+  size_t first_match = sweep->state.match_count;
+  bool more;
+  while((more = RedisModule_Scan(ctx, sweep->cursor, filter_scanned_key,
+    &sweep->scan)) && sweep->state.stage != OP_ERR &&
+    !slice_spent(sweep, first_match, start));
+  return more && sweep->state.stage != OP_ERR;
+}
+
+void free_sweep(SWEEP *sweep) {
+  for(size_t i=0; i < sweep->written_len; ++i)
+    free(sweep->written[i]);
+  free(sweep->written);
+  delta_buf_free(sweep->seen);
+  RedisModule_ScanCursorDestroy(sweep->cursor);
+  if(sweep->blocked) { //the sweep took the command's state over
+    free_query(&sweep->query);
+    free_op_state(&sweep->state);
+    release_schema(sweep->state.schema);
+  }
+  free(sweep);
+}
+
+/* the next slice, in a context of the blocked client so it runs against
+   the client's db and replicates right away
+*/
+void SweepTimer(RedisModuleCtx *ctx, void *data) {
+  SWEEP *sweep = data;
+  RedisModuleCtx *slice_ctx = RedisModule_GetThreadSafeContext(sweep->bc);
+  bool more = sweep_slice(slice_ctx, sweep);
+  RedisModule_FreeThreadSafeContext(slice_ctx);
+  if(more)
+    RedisModule_CreateTimer(ctx, SLICE_PERIOD_MS, SweepTimer, sweep);
+  else
+    RedisModule_UnblockClient(sweep->bc, sweep);
+}
+
+int SweepReply(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+  return reply_with_results(ctx, &((SWEEP*)
+    RedisModule_GetBlockedClientPrivateData(ctx))->state);
+}
+
+void SweepFree(RedisModuleCtx *ctx, void *privdata) {
+  free_sweep(privdata);
+}
+
+/* runs the first slice within the command. a sweep that does not finish
+   in it blocks the client, takes query and state over and goes on from a
+   timer, returns true when it did
+*/
+bool sweep_keys(RedisModuleCtx *ctx, Query *query, OP_STATE *state) {
+  SWEEP *sweep = calloc(1, sizeof(SWEEP));
+  if(sweep != NULL && (sweep->seen = delta_buf_new()) == NULL) {
+    free(sweep);
+    sweep = NULL;
+  }
+  if(sweep == NULL) {
+    filter_results_and_reply(ctx, query, state);
+    return false;
+  }
+  sweep->query = *query;
+  sweep->state = *state;
+  sweep->scan = (SCAN_STATE){.query = &sweep->query, .state = &sweep->state,
+    .prefix = state->schema->prefix, .prefix_len = strlen(state->schema->prefix),
+    .sweep = sweep};
+  sweep->cursor = RedisModule_ScanCursorCreate();
+  if(!sweep_slice(ctx, sweep)) {
+    reply_with_results(ctx, &sweep->state);
+    free_sweep(sweep);
+    return false;
+  }
+  //SchemaADDVALUE may grow the schema between slices, the query's masks
+  //are sized to it as it is now
+  sweep->state.schema = sweep->query.schema = copy_schema(state->schema);
+  sweep->scan.prefix = sweep->state.schema->prefix;
+  release_schema(state->schema);
+  sweep->bc = RedisModule_BlockClient(ctx, SweepReply, NULL, SweepFree, 0);
+  for(size_t i=0; i < sweep->written_len; ++i) {
+    replicate_cell(ctx, sweep->written[i]);
+    free(sweep->written[i]);
+  }
+  sweep->written_len = 0;
+  sweep->blocked = true;
+  RedisModule_CreateTimer(ctx, SLICE_PERIOD_MS, SweepTimer, sweep);
+  return true;
+}
+
+bool is_aggregate_op(SCHEMA_OP op) {
+  return op == S_OP_SUM || op == S_OP_AVG || op == S_OP_MIN || op == S_OP_MAX;
+}
+
+bool is_snapshot_op(SCHEMA_OP op) {
+  return is_aggregate_op(op) || op == S_OP_PARTIAL || op == S_OP_TOPK ||
+    op == S_OP_QUANTILE || op == S_OP_HIST;
+}
+
+/* aggregates over a sparse schema of at least BackgroundCells cells run
+   in a thread, on a snapshot writers do not wait for. at most
+   BackgroundReads at once, each holds a copy of the store
+*/
+bool reads_in_background(RedisModuleCtx *ctx, OP_STATE *state) {
+  return is_snapshot_op(state->op) && state->options.sparse &&
+    BackgroundCells > 0 && ActiveReads < BackgroundReads && can_block(ctx);
+}
+
+void *read_snapshot(void *arg) {
+  SNAPSHOT_READ *read = arg;
+  filter_store_cells(NULL, &read->query, &read->state, read->store);
+  RedisModule_UnblockClient(read->bc, read);
+  return NULL;
+}
+
+int SnapshotReply(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+  return reply_with_results(ctx, &((SNAPSHOT_READ*)
+    RedisModule_GetBlockedClientPrivateData(ctx))->state);
+}
+
+void SnapshotFree(RedisModuleCtx *ctx, void *privdata) {
+  SNAPSHOT_READ *read = privdata;
+  cell_store_free(read->store);
+  free_query(&read->query);
+  free_op_state(&read->state);
+  release_schema(read->state.schema);
+  free(read);
+  ActiveReads--;
+}
+
+/* returns true when the read went to a thread, which then owns query and
+   state. a smaller store is read in place, that costs less than a thread
+*/
+bool read_in_background(RedisModuleCtx *ctx, Query *query, OP_STATE *state) {
+  RedisModuleString *key_str = RM_CreateString(ctx, state->schema->store_key);
+  RedisModuleKey *redis_key = RedisModule_OpenKey(ctx,key_str,REDISMODULE_READ);
+  CELL_STORE *snapshot = NULL;
+  if(RedisModule_KeyType(redis_key) == REDISMODULE_KEYTYPE_MODULE &&
+    RedisModule_ModuleTypeGetType(redis_key) == CellStoreType) {
+    CELL_STORE *store = RedisModule_ModuleTypeGetValue(redis_key);
+    if(store->len - store->dead >= (size_t)BackgroundCells)
+      snapshot = cell_store_snapshot(store);
+  }
+  RedisModule_CloseKey(redis_key);
+  RedisModule_FreeString(ctx, key_str);
+  SNAPSHOT_READ *read = (snapshot == NULL)? NULL :
+    calloc(1, sizeof(SNAPSHOT_READ));
+  if(read == NULL) {
+    cell_store_free(snapshot);
+    filter_results_and_reply(ctx, query, state);
+    return false;
+  }
+  read->store = snapshot;
+  read->query = *query;
+  read->state = *state;
+  read->state.schema = read->query.schema = copy_schema(state->schema);
+  release_schema(state->schema);
+  ActiveReads++;
+  read->bc = RedisModule_BlockClient(ctx, SnapshotReply, NULL, SnapshotFree, 0);
+  pthread_t tid;
+  if(pthread_create(&tid, NULL, read_snapshot, read) != 0)
+    read_snapshot(read);
+  else
+    pthread_detach(tid);
+  return true;
+}
+
+bool is_approx_arg(RedisModuleString **argv) {
+  return strcasecmp(RedisModule_StringPtrLen(argv[SCHEMA_OPT_ARG], NULL),
+    ARG_APPROX) == 0;
+}
+
+/* APPROX <fraction>|<count>, a fraction of the cells when below 1
+*/
+int parse_approx_args(RedisModuleString **argv, double *approx) {
+  if(RedisModule_StringToDouble(argv[SCHEMA_OP_ARG_APPROX], approx) !=
+    REDISMODULE_OK || !(*approx > 0) ||
+    (*approx >= 1 && *approx != floor(*approx)))
+    return MODULE_ERROR;
+  return REDISMODULE_OK;
+}
+
+/* WINDOW <seconds> limits time bucketed cells to their latest buckets
+*/
+int parse_window_args(RedisModuleString **argv, long long *window) {
+  long long seconds;
+  if(strcasecmp(RedisModule_StringPtrLen(argv[SCHEMA_OPT_ARG], NULL),
+      ARG_WINDOW) != 0 ||
+    RedisModule_StringToLongLong(argv[SCHEMA_OP_ARG_WINDOW],
+      &seconds) != REDISMODULE_OK || seconds <= 0)
+    return MODULE_ERROR;
+  *window = seconds * MS_IN_SEC;
+  return REDISMODULE_OK;
+}
+
+/* operations that address full cell keys instead of filtering
+*/
+bool is_cell_write_op(SCHEMA_OP op) {
+  return op == S_OP_SET || op == S_OP_ADD;
+}
+
+/* <k> [ASC|DESC], largest cells first by default
+*/
+int parse_topk_args(RedisModuleString **argv, int argc, OP_STATE *state) {
+  if(RedisModule_StringToLongLong(argv[SCHEMA_OPT_ARG], &state->k) !=
+    REDISMODULE_OK || state->k <= 0)
+    return MODULE_ERROR;
+  if(argc < SCHEMA_TOPK_ARGS_MAX)
+    return REDISMODULE_OK;
+  C_CHARS order = RedisModule_StringPtrLen(argv[SCHEMA_TOPK_ARG_ORDER], NULL);
+  if(strcasecmp(order, ARG_ASC) == 0)
+    state->ascending = true;
+  else if(strcasecmp(order, ARG_DESC) != 0)
+    return MODULE_ERROR;
+  return REDISMODULE_OK;
+}
+
+/* <q> [<q> ...]
+*/
+int parse_quantile_args(RedisModuleString **argv, int argc, OP_STATE *state) {
+  state->quantile_count = argc - SCHEMA_OPT_ARG;
+  state->quantiles = malloc(state->quantile_count * sizeof(double));
+  state->digest = tdigest_new(TDIGEST_COMPRESSION);
+  if(state->quantiles == NULL || state->digest == NULL)
+    return MODULE_ERROR;
+  for(size_t i=0; i < state->quantile_count; ++i) {
+    double *q = &state->quantiles[i];
+    if(RedisModule_StringToDouble(argv[SCHEMA_OPT_ARG + i], q) !=
+      REDISMODULE_OK || !(*q >= 0 && *q <= 1))
+      return MODULE_ERROR;
+  }
+  return REDISMODULE_OK;
+}
+
+/* <min> <max> <buckets>
+*/
+int parse_hist_args(RedisModuleString **argv, OP_STATE *state) {
+  if(RedisModule_StringToDouble(argv[SCHEMA_OPT_ARG], &state->hist_min) !=
+      REDISMODULE_OK ||
+    RedisModule_StringToDouble(argv[SCHEMA_HIST_ARG_MAX], &state->hist_max) !=
+      REDISMODULE_OK ||
+    RedisModule_StringToLongLong(argv[SCHEMA_HIST_ARG_BUCKETS],
+      &state->hist_buckets) != REDISMODULE_OK ||
+    !(state->hist_min < state->hist_max) || state->hist_buckets <= 0 ||
+    state->hist_buckets > HIST_MAX_BUCKETS)
+    return MODULE_ERROR;
+  state->hist = calloc(state->hist_buckets + 2, sizeof(long long));
+  return (state->hist == NULL)? MODULE_ERROR : REDISMODULE_OK;
+}
+
+/* GROUPBY <dimension>
+*/
+int parse_groupby_args(RedisModuleString **argv, OP_STATE *state) {
+  C_CHARS dim = RedisModule_StringPtrLen(argv[SCHEMA_GROUPBY_ARG_DIM], NULL);
+  if(strcasecmp(RedisModule_StringPtrLen(argv[SCHEMA_OPT_ARG], NULL),
+    ARG_GROUPBY) != 0)
+    return MODULE_ERROR;
+  state->group_ord = schema_dim_rank(state->schema, dim);
+  state->grouped = true;
+  return (state->group_ord == MODULE_ERROR)? MODULE_ERROR : REDISMODULE_OK;
+}
+
+int parse_cursor_arg(RedisModuleString *arg, unsigned long long *num) {
+  size_t len;
+  C_CHARS val = RedisModule_StringPtrLen(arg, &len);
+  char *end;
+  errno = 0;
+  *num = strtoull(val, &end, 10);
+  if(len == 0 || errno != 0 || *end != '\0' || val[0] == '-')
+    return MODULE_ERROR;
+  return REDISMODULE_OK;
+}
+
+/* [CURSOR <cursor>] [COUNT <count>] [WITHVALUES] [WITHCOORDS],
+   a cursor or a count pages the reply
+*/
+int parse_get_args(RedisModuleString **argv, int argc, OP_STATE *state) {
+  state->page_size = GET_PAGE_DEFAULT;
+  for(int i=SCHEMA_OPT_ARG; i < argc; ++i) {
+    C_CHARS arg = RedisModule_StringPtrLen(argv[i], NULL);
+    unsigned long long num;
+    if(strcasecmp(arg, ARG_WITHVALUES) == 0)
+      state->with_values = true;
+    else if(strcasecmp(arg, ARG_WITHCOORDS) == 0)
+      state->with_coords = true;
+    else if(++i == argc || parse_cursor_arg(argv[i], &num) != REDISMODULE_OK)
+      return MODULE_ERROR;
+    else if(strcasecmp(arg, ARG_CURSOR) == 0) {
+      state->cursor = num;
+      state->paged = true;
+    }
+    else if(strcasecmp(arg, ARG_COUNT) == 0 && num > 0 && num <= INT64_MAX) {
+      state->page_size = num;
+      state->paged = true;
+    }
+    else
+      return MODULE_ERROR;
+  }
+  return REDISMODULE_OK;
+}
+
+/* operations that change cells
+*/
+bool is_write_op(SCHEMA_OP op) {
+  return op == S_OP_SET || op == S_OP_ADD || op == S_OP_INC || op == S_OP_CLR;
+}
+
+/* writes into time buckets depend on the clock
+*/
+bool is_timed_write_op(SCHEMA_OP op) {
+  return op == S_OP_SET || op == S_OP_INC;
+}
+
+/* NOW <ms> writes time bucketed cells as of that time
+*/
+int parse_now_args(RedisModuleString **argv, long long *now) {
+  if(strcasecmp(RedisModule_StringPtrLen(argv[SCHEMA_OPT_ARG], NULL),
+      ARG_NOW) != 0 ||
+    RedisModule_StringToLongLong(argv[SCHEMA_OP_ARG_NOW], now) !=
+      REDISMODULE_OK || *now <= 0)
+    return MODULE_ERROR;
+  return REDISMODULE_OK;
+}
+
+/* a write replicates as the command itself, so a wildcard SchemaINC is a
+   single entry however many cells it touches. writes into time buckets
+   carry the clock they used so replicas fill the same buckets
+*/
+void replicate_write(RedisModuleCtx *ctx, RedisModuleString **argv, int argc,
+  OP_STATE *state) {
+  if((state->options.bucket_count == 0 || !is_timed_write_op(state->op) ||
+    argc == SCHEMA_OP_ARGS_NOW) && state->prepared) {
+    RedisModule_Replicate(ctx, RedisModule_StringPtrLen(argv[0], NULL), "v",
+      argv + 1, (size_t)argc - 1);
+    return;
+  }
+  if(state->options.bucket_count == 0 || !is_timed_write_op(state->op) ||
+    argc == SCHEMA_OP_ARGS_NOW) {
+    RedisModule_ReplicateVerbatim(ctx);
+    return;
+  }
+  RedisModule_Replicate(ctx, (state->op == S_OP_SET)? SCHEMA_SET_CMD :
+    SCHEMA_INC_CMD, REPLICATE_NOW_FMT, argv[SCHEMA_NAME_ARG],
+    argv[SCHEMA_LOAD_ARG_LIST], ARG_NOW, state->options.now);
+}
+
+bool check_op_arity(int argc, SCHEMA_OP op) {
+  if(op == S_OP_PARTIAL)
+    return argc == SCHEMA_LOAD_ARGS_LIMIT || argc == SCHEMA_GROUPBY_ARGS;
+  if(op == S_OP_GET)
+    return argc >= SCHEMA_LOAD_ARGS_LIMIT;
+  if(op == S_OP_QUANTILE)
+    return argc >= SCHEMA_QUANTILE_ARGS_MIN;
+  if(op == S_OP_HIST)
+    return argc == SCHEMA_HIST_ARGS;
+  if(op == S_OP_FREQ)
+    return argc == SCHEMA_OP_ARGS_ITEM;
+  if(op == S_OP_TOPK)
+    return argc >= SCHEMA_TOPK_ARGS_MIN && argc <= SCHEMA_TOPK_ARGS_MAX;
+  return argc == SCHEMA_LOAD_ARGS_LIMIT ||
+    (argc == SCHEMA_OP_ARGS_WINDOW && is_aggregate_op(op)) ||
+    (argc == SCHEMA_OP_ARGS_NOW && is_timed_write_op(op));
+}
+
+/* SchemaINC over plain counters adds up increments to hot cells before it
+   writes them, see buffer_increment. not when its client can not block, a
+   transaction, a script or the master's stream expects the cells written
+   when it returns
+*/
+bool coalesces(RedisModuleCtx *ctx, OP_STATE *state) {
+  return CoalesceMs > 0 && state->op == S_OP_INC && !state->options.sparse &&
+    state->options.bucket_count == 0 && state->options.sketch == SKETCH_NONE &&
+    can_block(ctx);
+}
+
+/* NULL once the state is set up for the command, or the error to reply
+   with. the schema is not retained yet
+*/
+C_CHARS start_op_state(RedisModuleCtx *ctx, RedisModuleString **argv,
+  int argc, SCHEMA_OP op, OP_STATE *state) {
+  init_op_state(state, op);
+  state->schema = schema_of_command(ctx, argv);
+  if(state->schema == NULL)
+    return ERR_MSG_NO_SCHEMA;
+  state->options = state->schema->options;
+  state->options.now = RedisModule_Milliseconds();
+  if(!coalesces(ctx, state))
+    flush_schema_deltas(ctx, state->schema->name);
+  if(argc == SCHEMA_OP_ARGS_NOW && is_timed_write_op(op) &&
+    parse_now_args(argv, &state->options.now) != REDISMODULE_OK)
+    return ERR_MSG_INVALID_NOW;
+  if(argc == SCHEMA_OP_ARGS_APPROX && is_approx_arg(argv)) {
+    if((op != S_OP_SUM && op != S_OP_AVG) ||
+      parse_approx_args(argv, &state->approx) != REDISMODULE_OK)
+      return ERR_MSG_INVALID_APPROX;
+  }
+  else if(argc == SCHEMA_OP_ARGS_WINDOW && is_aggregate_op(op) &&
+    parse_window_args(argv, &state->window) != REDISMODULE_OK)
+    return ERR_MSG_INVALID_WINDOW;
+  if(op == S_OP_FREQ)
+    state->item = RedisModule_StringPtrLen(argv[SCHEMA_OPT_ARG],
+      &state->item_len);
+  if(op == S_OP_TOPK && parse_topk_args(argv, argc, state) != REDISMODULE_OK)
+    return ERR_MSG_INVALID_TOPK;
+  if(op == S_OP_QUANTILE &&
+    parse_quantile_args(argv, argc, state) != REDISMODULE_OK)
+    return ERR_MSG_INVALID_QUANTILE;
+  if(op == S_OP_HIST && parse_hist_args(argv, state) != REDISMODULE_OK)
+    return ERR_MSG_INVALID_HIST;
+  if(op == S_OP_GET && parse_get_args(argv, argc, state) != REDISMODULE_OK)
+    return ERR_MSG_INVALID_GET;
+  if(op == S_OP_PARTIAL && argc == SCHEMA_GROUPBY_ARGS &&
+    parse_groupby_args(argv, state) != REDISMODULE_OK)
+    return ERR_MSG_INVALID_GROUPBY;
+  return NULL;
+}
+
+/* uniform over [0, n), n > 0
+*/
+uint64_t random_below(uint64_t n) {
+  uint64_t r = ((uint64_t)random() << 62) ^ ((uint64_t)random() << 31) ^
+    (uint64_t)random();
+  return r % n;
+}
+
+/* val is NULL for a cell the filter does not match
+*/
+void sample_value(APPROX_SAMPLE *sample, CELL_VALUE *val) {
+  double x = (val == NULL)? 0 : val->is_int? (double)val->ival : val->dval;
+  double delta = x - sample->mean;
+  sample->count++;
+  sample->mean += delta / sample->count;
+  sample->m2 += delta * (x - sample->mean);
+  if(val == NULL)
+    return;
+  delta = x - sample->matched_mean;
+  sample->matched++;
+  sample->matched_mean += delta / sample->matched;
+  sample->matched_m2 += delta * (x - sample->matched_mean);
+}
+
+/* a packed cell is picked by a random index into the store, deleted ones
+   count as not matched
+*/
+void sample_store(Query *query, OP_STATE *state, CELL_STORE *store,
+  size_t size, APPROX_SAMPLE *sample) {
+  for(size_t s=0; s < size; ++s) {
+    size_t i = random_below(store->len);
+    CELL_VALUE val;
+    bool matched = store->flags[i] != CELL_STORE_DEAD &&
+      match_cell_ords(query, store, store->coords[i]) &&
+      read_store_value(store, i, &val) == CELL_OK;
+    sample_value(sample, matched? &val : NULL);
+  }
+}
+
+/* plain cells share the keyspace with everything else, so the population
+   is the whole db. the keys one SCAN returns sit in neighbouring buckets,
+   sampling them all would not make them independent draws. each SCAN from
+   a random cursor gives only its first key instead
+*/
+void sample_keys(RedisModuleCtx *ctx, Query *query, OP_STATE *state,
+  size_t size, APPROX_SAMPLE *sample) {
+  size_t prefix_len = strlen(state->schema->prefix), len;
+  char cursor[GET_CURSOR_MAX_LEN];
+  for(size_t scans=0; sample->count < size &&
+    scans < size * APPROX_SCAN_TRIES; ++scans) {
+    snprintf(cursor, sizeof(cursor), "%llu",
+      (unsigned long long)random_below(UINT64_MAX));
+    RedisModuleCallReply *reply = RedisModule_Call(ctx, SCAN_CMD, "ccc",
+      cursor, ARG_COUNT, APPROX_SCAN_COUNT);
+    if(reply == NULL ||
+      RedisModule_CallReplyType(reply) != REDISMODULE_REPLY_ARRAY ||
+      RedisModule_CallReplyLength(reply) != 2) {
+      RedisModule_FreeCallReply(reply);
+      state->stage = OP_ERR;
+      state->err_msg = ERR_MSG_GENERAL_ERROR;
+      return;
+    }
+    RedisModuleCallReply *keys = RedisModule_CallReplyArrayElement(reply, 1);
+    if(RedisModule_CallReplyLength(keys) > 0) {
+      C_CHARS name = RedisModule_CallReplyStringPtr(
+        RedisModule_CallReplyArrayElement(keys, 0), &len);
+      char *key = strndup(name, len);
+      CELL_VALUE val;
+      bool matched = len >= prefix_len &&
+        strncmp(key, state->schema->prefix, prefix_len) == 0 &&
+        match_key_to_query(key + prefix_len, query) &&
+        read_matched_value(ctx, key, state, &val) == CELL_OK;
+      sample_value(sample, matched? &val : NULL);
+      free(key);
+    }
+    RedisModule_FreeCallReply(reply);
+  }
+}
+
+/* at most ApproxSampleMax cells, a count past it would read longer than
+   the exact aggregate
+*/
+size_t approx_sample_size(double approx, size_t population) {
+  size_t size = (approx < 1)? (size_t)ceil(approx * population) :
+    (size_t)approx;
+  return (ApproxSampleMax > 0 && size > (size_t)ApproxSampleMax)?
+    (size_t)ApproxSampleMax : size;
+}
+
+/* the estimate and the bounds of its confidence interval
+*/
+int reply_with_estimate(RedisModuleCtx *ctx, double estimate, double margin) {
+  RedisModule_ReplyWithArray(ctx, 3);
+  RedisModule_ReplyWithDouble(ctx, estimate);
+  RedisModule_ReplyWithDouble(ctx, estimate - margin);
+  return RedisModule_ReplyWithDouble(ctx, estimate + margin);
+}
+
+/* the sum is the population times the mean of the sample, the average the
+   mean of the sampled cells that matched. a single cell has no spread to
+   bound the estimate by, its interval is then unbounded
+*/
+int reply_with_sample(RedisModuleCtx *ctx, OP_STATE *state,
+  APPROX_SAMPLE *sample, size_t population) {
+  if(state->op == S_OP_SUM) {
+    double var = (sample->count > 1)? sample->m2 / (sample->count - 1) :
+      INFINITY;
+    return reply_with_estimate(ctx, population * sample->mean,
+      APPROX_Z * population * sqrt(var / sample->count));
+  }
+  double var = (sample->matched > 1)?
+    sample->matched_m2 / (sample->matched - 1) : INFINITY;
+  return reply_with_estimate(ctx, sample->matched_mean,
+    APPROX_Z * sqrt(var / sample->matched));
+}
+
+/* no sampled cell matched, the estimate is 0. by the rule of three fewer
+   than APPROX_NONE_BOUND in count of the cells match at 95%, the upper
+   bound is how many cells that makes
+*/
+int reply_with_none(RedisModuleCtx *ctx, APPROX_SAMPLE *sample,
+  size_t population) {
+  RedisModule_ReplyWithArray(ctx, 3);
+  RedisModule_ReplyWithDouble(ctx, 0);
+  RedisModule_ReplyWithDouble(ctx, 0);
+  return RedisModule_ReplyWithDouble(ctx,
+    APPROX_NONE_BOUND * population / sample->count);
+}
+
+/* a sample as large as the population, or a sum the parent sums answer, is
+   read exactly and replied with an empty interval
+*/
+int reply_with_exact(RedisModuleCtx *ctx, OP_STATE *state) {
+  if(state->stage == OP_ERR)
+    return RedisModule_ReplyWithSimpleString(ctx, state->err_msg);
+  if(state->op == S_OP_SUM)
+    return reply_with_estimate(ctx, sum_get_double(&state->agg), 0);
+  if(state->agg.count == 0)
+    return RedisModule_ReplyWithSimpleString(ctx, NO_KEYS_MATCHED);
+  return reply_with_estimate(ctx,
+    sum_get_double(&state->agg) / state->agg.count, 0);
+}
+
+/* SchemaSUM and SchemaAVG with APPROX read a sample of a fixed size
+   instead of every matching cell, so they cost the same however many
+   cells the filter selects
+*/
+void approximate(RedisModuleCtx *ctx, Query *query, OP_STATE *state) {
+  APPROX_SAMPLE sample;
+  memset(&sample, 0, sizeof(sample));
+  size_t population = 0, size = 0;
+  bool sampled = false;
+  if(reads_rollup(state, query) &&
+    sum_rollup(ctx, query, state) == REDISMODULE_OK) {
+    reply_with_exact(ctx, state);
+    return;
+  }
+  if(state->options.sparse) {
+    RedisModuleString *key_str = RM_CreateString(ctx,
+      state->schema->store_key);
+    RedisModuleKey *redis_key = RedisModule_OpenKey(ctx, key_str,
+      REDISMODULE_READ);
+    if(RedisModule_KeyType(redis_key) == REDISMODULE_KEYTYPE_MODULE &&
+      RedisModule_ModuleTypeGetType(redis_key) == CellStoreType) {
+      CELL_STORE *store = RedisModule_ModuleTypeGetValue(redis_key);
+      population = store->len;
+      size = approx_sample_size(state->approx, population);
+      if((sampled = (size < population)))
+        sample_store(query, state, store, size, &sample);
+    }
+    RedisModule_CloseKey(redis_key);
+    RedisModule_FreeString(ctx, key_str);
+  }
+  else {
+    population = RedisModule_DbSize(ctx);
+    size = approx_sample_size(state->approx, population);
+    if((sampled = (size < population)))
+      sample_keys(ctx, query, state, size, &sample);
+  }
+  if(sampled && state->stage == OP_ERR)
+    RedisModule_ReplyWithSimpleString(ctx, state->err_msg);
+  else if(sampled && sample.matched > 0)
+    reply_with_sample(ctx, state, &sample, population);
+  else if(sampled && sample.count > 0)
+    reply_with_none(ctx, &sample, population);
+  else {
+    if(state->options.sparse)
+      filter_store(ctx, query, state);
+    else
+      filter_keys(ctx, query, state);
+    reply_with_exact(ctx, state);
+  }
+}
+
+/* true when a sweep or a background read took query and state over, they
+   free them once done
+*/
+bool run_query(RedisModuleCtx *ctx, Query *query, OP_STATE *state) {
+  if(state->approx > 0)
+    approximate(ctx, query, state);
+  else if(reads_rollup(state, query) &&
+    sum_rollup(ctx, query, state) == REDISMODULE_OK)
+    reply_with_results(ctx, state);
+  else if(sweeps_in_slices(ctx, state, query)) {
+    flush_schema_deltas(ctx, state->schema->name); //it replicates cell values
+    return sweep_keys(ctx, query, state);
+  }
+  else if(reads_in_background(ctx, state))
+    return read_in_background(ctx, query, state);
+  else {
+    state->coalesce = coalesces(ctx, state);
+    filter_results_and_reply(ctx, query, state);
+  }
+  return false;
+}
+
+/* the position of the value of TAG <value>, which may end a SchemaSET or
+   a SchemaADD, 0 when there is none
+*/
+int tag_arg(RedisModuleString **argv, int argc) {
+  return (argc > SCHEMA_LOAD_ARGS_LIMIT + 1 &&
+    strcasecmp(RedisModule_StringPtrLen(argv[argc - 2], NULL), ARG_TAG) == 0)?
+    argc - 1 : 0;
+}
+
+/* cluster nodes route a SchemaSET or SchemaADD by the value TAG names, or
+   by the schema name, which HASHTAG NAME cells and the metadata of every
+   schema hash by
+*/
+int route_cell_write(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+  int at = tag_arg(argv, argc);
+  RedisModule_KeyAtPos(ctx, (at > 0)? at : SCHEMA_NAME_ARG);
+  return REDISMODULE_OK;
+}
+
+/* NULL when a SchemaSET or SchemaADD reached the slot its cells live in.
+   a schema tagged by a dimension is routed by TAG, a client of a cluster
+   must name it
+*/
+C_CHARS check_write_tag(RedisModuleCtx *ctx, OP_STATE *state,
+  RedisModuleString *tag) {
+  bool by_dim = (tagged_dim(state->options.hashtag) >= 0);
+  int flags = RedisModule_GetContextFlags(ctx);
+  if(tag != NULL && !by_dim)
+    return ERR_MSG_INVALID_TAG;
+  if(tag == NULL && by_dim && (flags & REDISMODULE_CTX_FLAGS_CLUSTER) &&
+    !(flags & (REDISMODULE_CTX_FLAGS_REPLICATED | REDISMODULE_CTX_FLAGS_LOADING)))
+    return ERR_MSG_INVALID_TAG;
+  return NULL;
+}
+
+int schemaOperationsCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
+  int argc, SCHEMA_OP op) {
+  if(is_cell_write_op(op) && RedisModule_IsKeysPositionRequest(ctx))
+    return route_cell_write(ctx, argv, argc);
+  RedisModuleString *tag = NULL;
+  if(is_cell_write_op(op) && tag_arg(argv, argc) > 0) {
+    tag = argv[argc - 1];
+    argc -= 2; //the options before it are read as if it were not there
+  }
+  if(!check_op_arity(argc, op)) {
+      return RedisModule_WrongArity(ctx);
+  }
+  size_t len; int resp = REDISMODULE_OK;
+  bool sliced = false;
+  OP_STATE state;
+  C_CHARS err = start_op_state(ctx, argv, argc, op, &state);
+  if(err == NULL && is_cell_write_op(op))
+    err = check_write_tag(ctx, &state, tag);
+  if(err != NULL) {
+    free_op_state(&state);
+    return RedisModule_ReplyWithSimpleString(ctx, err);
+  }
+  retain_schema(state.schema);
+  PARSER_STATE parser;
+  parser.err_msg = NULL;
+  parser.tag = (tag == NULL)? NULL :
+    strdup(RedisModule_StringPtrLen(tag, NULL));
+  parser.schema = state.schema;
+  parser.options = state.options;
+  parser.input = RedisModule_StringPtrLen(argv[SCHEMA_LOAD_ARG_LIST], &len);
+  bool fill = is_cell_write_op(op);
+  parser.handler = (op == S_OP_SET)? SchemaSet_handler :
+    (op == S_OP_ADD)? SchemaAdd_handler : SchemaOperations_handler;
+  parser.predicates = !fill;
+  build_query(state.schema, &parser.query, fill);
+  parser.query.partial_keys = fill;
+  parser.query.hashtag = state.options.hashtag;
+  resp = parse_input(ctx, &parser);
+  if(resp<0)
+    resp = report_error(ctx, parser.err_msg, &parser); // ERR: change message
+  else if(fill)
+    RedisModule_ReplyWithSimpleString(ctx,
+      (op == S_OP_SET)? SCHEMA_SET_OK_STR : SCHEMA_ADD_OK_STR);
+  else
+    sliced = run_query(ctx, &parser.query, &state);
+  //a failed write may have changed some cells
+  if(is_write_op(op) && !sliced && !state.coalesce)
+    replicate_write(ctx, argv, argc, &state);
+  free(parser.tag);
+  if(sliced) //the sweep or the background read frees them once done
+    return resp;
+  free_query(&parser.query);
+  free_op_state(&state);
+  release_schema(state.schema);
+  return resp;
+}
+
+int SchemaSetCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    return schemaOperationsCommand(ctx, argv, argc, S_OP_SET);
+}
+
+int SchemaGetCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    return schemaOperationsCommand(ctx, argv, argc, S_OP_GET);
+}
+
+int SchemaSumCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    return schemaOperationsCommand(ctx, argv, argc, S_OP_SUM);
+}
+
+int SchemaAvgCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    return schemaOperationsCommand(ctx, argv, argc, S_OP_AVG);
+}
+
+int SchemaMinCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    return schemaOperationsCommand(ctx, argv, argc, S_OP_MIN);
+}
+
+int SchemaMaxCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    return schemaOperationsCommand(ctx, argv, argc, S_OP_MAX);
+}
+
+int SchemaClrCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    return schemaOperationsCommand(ctx, argv, argc, S_OP_CLR);
+}
+
+int SchemaIncCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    return schemaOperationsCommand(ctx, argv, argc, S_OP_INC);
+}
+
+int SchemaAddCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    return schemaOperationsCommand(ctx, argv, argc, S_OP_ADD);
+}
+
+int SchemaDistinctCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
+  int argc) {
+    return schemaOperationsCommand(ctx, argv, argc, S_OP_DISTINCT);
+}
+
+int SchemaFreqCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    return schemaOperationsCommand(ctx, argv, argc, S_OP_FREQ);
+}
+
+int SchemaHeavyCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    return schemaOperationsCommand(ctx, argv, argc, S_OP_HEAVY);
+}
+
+int SchemaTopkCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    return schemaOperationsCommand(ctx, argv, argc, S_OP_TOPK);
+}
+
+int SchemaQuantileCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
+  int argc) {
+    return schemaOperationsCommand(ctx, argv, argc, S_OP_QUANTILE);
+}
+
+int SchemaHistCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+    return schemaOperationsCommand(ctx, argv, argc, S_OP_HIST);
+}
+
+/* shard-local partial aggregate for a cluster coordinator to merge
+*/
+int SchemaPartialCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
+  int argc) {
+    return schemaOperationsCommand(ctx, argv, argc, S_OP_PARTIAL);
+}
+
+/* the commands a filter can be prepared for, SchemaSet and SchemaADD
+   write what they parse
+*/
+static const OP_COMMAND PreparedCommands[] = {
+  {"SchemaGet", S_OP_GET}, {"SchemaSUM", S_OP_SUM}, {"SchemaAVG", S_OP_AVG},
+  {"SchemaMIN", S_OP_MIN}, {"SchemaMAX", S_OP_MAX}, {"SchemaCLR", S_OP_CLR},
+  {SCHEMA_INC_CMD, S_OP_INC}, {"SchemaDISTINCT", S_OP_DISTINCT},
+  {"SchemaFREQ", S_OP_FREQ}, {"SchemaHEAVY", S_OP_HEAVY},
+  {"SchemaTOPK", S_OP_TOPK}, {"SchemaQUANTILE", S_OP_QUANTILE},
+  {"SchemaHIST", S_OP_HIST}, {"SchemaPARTIAL", S_OP_PARTIAL}
+};
+
+int prepared_op(RedisModuleString *cmd, SCHEMA_OP *op) {
+  C_CHARS name = RedisModule_StringPtrLen(cmd, NULL);
+  for(size_t i=0; i < sizeof(PreparedCommands) / sizeof(OP_COMMAND); ++i) {
+    if(strcasecmp(name, PreparedCommands[i].name) == 0) {
+      *op = PreparedCommands[i].op;
+      return REDISMODULE_OK;
+    }
+  }
+  return MODULE_ERROR;
+}
+
+void free_prepared(PREPARED *prepared) {
+  for(int i=0; i < prepared->argc; ++i)
+    RedisModule_FreeString(NULL, prepared->argv[i]);
+  free(prepared->argv);
+  if(prepared->schema != NULL) {
+    free_query(&prepared->query);
+    release_schema(prepared->schema);
+  }
+  free(prepared);
+}
+
+PREPARED *new_prepared(RedisModuleString **argv, int argc, SCHEMA_OP op) {
+  PREPARED *prepared = calloc(1, sizeof(PREPARED));
+  if(prepared == NULL)
+    return NULL;
+  prepared->argv = malloc(sizeof(RedisModuleString*) * argc);
+  if(prepared->argv == NULL) {
+    free(prepared);
+    return NULL;
+  }
+  for(; prepared->argc < argc; ++prepared->argc)
+    prepared->argv[prepared->argc] =
+      RedisModule_CreateStringFromString(NULL, argv[prepared->argc]);
+  prepared->op = op;
+  return prepared;
+}
+
+/* the handle, unlinked until save_prepared puts it back. by id, or by the
+   command when id is 0
+*/
+PREPARED *take_prepared(unsigned long long id, RedisModuleString **argv,
+  int argc) {
+  for(PREPARED **at = &Prepared; *at != NULL; at = &(*at)->next) {
+    PREPARED *prepared = *at;
+    bool same = (id != 0)? prepared->id == id : prepared->argc == argc;
+    for(int i=0; id == 0 && same && i < argc; ++i)
+      same = RedisModule_StringCompare(prepared->argv[i], argv[i]) == 0;
+    if(same) {
+      *at = prepared->next;
+      return prepared;
+    }
+  }
+  return NULL;
+}
+
+void save_prepared(PREPARED *prepared) {
+  size_t kept = 0;
+  if(prepared->id == 0)
+    prepared->id = NextPreparedId++;
+  prepared->next = Prepared;
+  Prepared = prepared;
+  for(PREPARED **at = &Prepared; *at != NULL;) {
+    PREPARED *old = *at;
+    if(++kept > PREPARED_MAX) {
+      *at = old->next;
+      free_prepared(old);
+    }
+    else
+      at = &old->next;
+  }
+}
+
+/* NULL once the filter of the prepared command is parsed against the
+   schema as it is now, or the error it failed with
+*/
+C_CHARS parse_prepared(RedisModuleCtx *ctx, PREPARED *prepared,
+  SCHEMA *schema) {
+  PARSER_STATE parser;
+  memset(&parser, 0, sizeof(parser));
+  parser.schema = schema;
+  parser.options = schema->options;
+  parser.input = RedisModule_StringPtrLen(
+    prepared->argv[SCHEMA_LOAD_ARG_LIST], NULL);
+  parser.handler = SchemaOperations_handler;
+  parser.predicates = true;
+  build_query(schema, &parser.query, false);
+  parser.query.hashtag = schema->options.hashtag;
+  int resp = parse_input(ctx, &parser);
+  free(parser.tag);
+  if(resp < 0) {
+    free_query(&parser.query);
+    return parser.err_msg;
+  }
+  if(prepared->schema != NULL) {
+    free_query(&prepared->query);
+    release_schema(prepared->schema);
+  }
+  retain_schema(schema);
+  prepared->schema = schema;
+  prepared->changes = schema->changes;
+  prepared->query = parser.query;
+  return NULL;
+}
+
+int copy_query(Query *from, Query *to) {
+  build_query(from->schema, to, false);
+  to->hashtag = from->hashtag;
+  to->partial_keys = from->partial_keys;
+  for(size_t d=0; d < from->key_set_size; ++d) {
+    size_t len = from->schema->dims[d].val_count + 1;
+    size_t groups = from->schema->dims[d].group_count;
+    if(from->masks[d] != NULL && (to->masks[d] = malloc(len)) == NULL)
+      return MODULE_ERROR;
+    if(from->groups[d] != NULL && (to->groups[d] = malloc(groups)) == NULL)
+      return MODULE_ERROR;
+    if(from->masks[d] != NULL)
+      memcpy(to->masks[d], from->masks[d], len);
+    if(from->groups[d] != NULL)
+      memcpy(to->groups[d], from->groups[d], groups);
+  }
+  return REDISMODULE_OK;
+}
+
+/* SchemaPREPARE <command> <schema> <filter> [<args>], parses the filter
+   once and replies with the handle SchemaEXEC, or SchemaEXECWRITE for a
+   write, runs the command by.
+   preparing the same command again gives the same handle
+*/
+int SchemaPrepareCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
+  int argc) {
+  if(argc < SCHEMA_PREPARE_ARGS_MIN)
+    return RedisModule_WrongArity(ctx);
+  RedisModuleString **cmd = argv + SCHEMA_PREPARE_ARG_CMD;
+  int cmd_argc = argc - SCHEMA_PREPARE_ARG_CMD;
+  SCHEMA_OP op;
+  OP_STATE state;
+  if(prepared_op(cmd[0], &op) != REDISMODULE_OK ||
+    !check_op_arity(cmd_argc, op))
+    return RedisModule_ReplyWithSimpleString(ctx, ERR_MSG_INVALID_PREPARE);
+  C_CHARS err = start_op_state(ctx, cmd, cmd_argc, op, &state);
+  PREPARED *prepared = (err != NULL)? NULL : take_prepared(0, cmd, cmd_argc);
+  if(err == NULL && prepared == NULL) {
+    prepared = new_prepared(cmd, cmd_argc, op);
+    err = (prepared == NULL)? ERR_MSG_NO_MEM :
+      parse_prepared(ctx, prepared, state.schema);
+  }
+  free_op_state(&state);
+  if(err != NULL) {
+    if(prepared != NULL)
+      free_prepared(prepared);
+    return RedisModule_ReplyWithSimpleString(ctx, err);
+  }
+  save_prepared(prepared);
+  return RedisModule_ReplyWithLongLong(ctx, prepared->id);
+}
+
+/* runs a prepared command. a new version of the schema or values and
+   dimensions added since it was prepared parse the filter again, once.
+   writes only run when the command was registered as one
+*/
+int exec_prepared(RedisModuleCtx *ctx, RedisModuleString **argv, int argc,
+  bool writes) {
+  if(argc != SCHEMA_EXEC_ARGS)
+    return RedisModule_WrongArity(ctx);
+  unsigned long long id;
+  PREPARED *prepared = (parse_cursor_arg(argv[SCHEMA_EXEC_ARG_HANDLE], &id)
+    != REDISMODULE_OK || id == 0)? NULL : take_prepared(id, NULL, 0);
+  if(prepared == NULL)
+    return RedisModule_ReplyWithSimpleString(ctx, ERR_MSG_UNKNOWN_PREPARED);
+  OP_STATE state;
+  Query query;
+  C_CHARS err = start_op_state(ctx, prepared->argv, prepared->argc,
+    prepared->op, &state);
+  if(err == NULL && is_write_op(prepared->op) && !writes)
+    err = ERR_MSG_PREPARED_READONLY;
+  if(err == NULL && is_write_op(prepared->op) &&
+    (RedisModule_GetContextFlags(ctx) &
+      (REDISMODULE_CTX_FLAGS_SLAVE | REDISMODULE_CTX_FLAGS_OOM)))
+    err = ERR_MSG_PREPARED_WRITE;
+  if(err == NULL && (prepared->schema != state.schema ||
+    prepared->changes != state.schema->changes))
+    err = parse_prepared(ctx, prepared, state.schema);
+  if(err == NULL && copy_query(&prepared->query, &query) != REDISMODULE_OK) {
+    free_query(&query);
+    err = ERR_MSG_NO_MEM;
+  }
+  if(err != NULL) {
+    save_prepared(prepared);
+    free_op_state(&state);
+    return RedisModule_ReplyWithSimpleString(ctx, err);
+  }
+  retain_schema(state.schema);
+  state.prepared = true;
+  bool sliced = run_query(ctx, &query, &state);
+  if(is_write_op(state.op) && !sliced && !state.coalesce)
+    replicate_write(ctx, prepared->argv, prepared->argc, &state);
+  save_prepared(prepared);
+  if(sliced) //the sweep or the background read frees them once done
+    return REDISMODULE_OK;
+  free_query(&query);
+  free_op_state(&state);
+  release_schema(state.schema);
+  return REDISMODULE_OK;
+}
+
+/* SchemaEXEC <handle>, a prepared read
+*/
+int SchemaExecCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
+  int argc) {
+  return exec_prepared(ctx, argv, argc, false);
+}
+
+/* SchemaEXECWRITE <handle>, a prepared SchemaINC or SchemaCLR, or a read
+*/
+int SchemaExecWriteCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
+  int argc) {
+  return exec_prepared(ctx, argv, argc, true);
+}
+
+int parse_eval_agg(RedisModuleString *arg, EVAL_AGG *agg) {
+  C_CHARS name = RedisModule_StringPtrLen(arg, NULL);
+  if(strcasecmp(name, ARG_SUM) == 0)
+    *agg = EVAL_SUM;
+  else if(strcasecmp(name, ARG_AVG) == 0)
+    *agg = EVAL_AVG;
+  else if(strcasecmp(name, ARG_MIN) == 0)
+    *agg = EVAL_MIN;
+  else if(strcasecmp(name, ARG_MAX) == 0)
+    *agg = EVAL_MAX;
+  else if(strcasecmp(name, ARG_COUNT) == 0)
+    *agg = EVAL_COUNT;
+  else
+    return MODULE_ERROR;
+  return REDISMODULE_OK;
+}
+
+bool valid_eval_name(EVAL_STATE *eval, size_t t) {
+  C_CHARS name = eval->terms[t].name;
+  if(name[0] == '\0' || (name[0] >= '0' && name[0] <= '9') ||
+    strspn(name, EVAL_NAME_CHARS) != strlen(name))
+    return false;
+  for(size_t i=0; i < t; ++i) {
+    if(strcmp(eval->terms[i].name, name) == 0)
+      return false;
+  }
+  return true;
+}
+
+/* <name> <aggregate> <filter> per term, returns the error to reply with
+*/
+C_CHARS parse_eval_terms(RedisModuleCtx *ctx, RedisModuleString **argv,
+  int end, OP_STATE *state) {
+  EVAL_STATE *eval = state->eval;
+  eval->term_count = (end - SCHEMA_EVAL_ARG_TERMS) / SCHEMA_EVAL_TERM_ARGS;
+  eval->terms = calloc(eval->term_count, sizeof(EVAL_TERM));
+  if(eval->terms == NULL)
+    return ERR_MSG_NO_MEM;
+  for(size_t t=0; t < eval->term_count; ++t) {
+    RedisModuleString **arg = &argv[SCHEMA_EVAL_ARG_TERMS +
+      t * SCHEMA_EVAL_TERM_ARGS];
+    EVAL_TERM *term = &eval->terms[t];
+    term->name = strdup(RedisModule_StringPtrLen(arg[0], NULL));
+    if(!valid_eval_name(eval, t) ||
+      parse_eval_agg(arg[1], &term->agg) != REDISMODULE_OK)
+      return ERR_MSG_INVALID_EVAL;
+    PARSER_STATE parser;
+    memset(&parser, 0, sizeof(parser));
+    parser.schema = state->schema;
+    parser.options = state->options;
+    parser.input = RedisModule_StringPtrLen(arg[2], NULL);
+    parser.handler = SchemaOperations_handler;
+    parser.predicates = true;
+    build_query(state->schema, &parser.query, false);
+    parser.query.hashtag = state->options.hashtag;
+    int resp = parse_input(ctx, &parser);
+    term->query = parser.query;
+    if(resp < 0)
+      return parser.err_msg;
+  }
+  return NULL;
+}
+
+/* the cells any term may fold, so the pass visits each candidate once
+*/
+void build_eval_query(EVAL_STATE *eval, SCHEMA *schema, Query *query) {
+  build_query(schema, query, false);
+  query->hashtag = schema->options.hashtag;
+  for(size_t d=0; d < schema->dim_count; ++d) {
+    bool any = false;
+    for(size_t t=0; t < eval->term_count && !any; ++t)
+      any = (eval->terms[t].query.masks[d] == NULL);
+    unsigned char *mask = any? NULL : query_mask(query, d, false);
+    for(size_t t=0; mask != NULL && t < eval->term_count; ++t) {
+      for(size_t o=0; o <= schema->dims[d].val_count; ++o)
+        mask[o] |= eval->terms[t].query.masks[d][o];
+    }
+  }
+}
+
+C_CHARS build_eval(RedisModuleCtx *ctx, RedisModuleString **argv, int end,
+  OP_STATE *state) {
+  EVAL_STATE *eval = state->eval;
+  C_CHARS err = parse_eval_terms(ctx, argv, end, state);
+  if(err != NULL)
+    return err;
+  const char **names = malloc(eval->term_count * sizeof(char*));
+  if(names == NULL)
+    return ERR_MSG_NO_MEM;
+  for(size_t t=0; t < eval->term_count; ++t)
+    names[t] = eval->terms[t].name;
+  eval->expr = expr_compile(
+    RedisModule_StringPtrLen(argv[SCHEMA_EVAL_ARG_EXPR], NULL), names,
+    eval->term_count);
+  free(names);
+  if(eval->expr == NULL)
+    return ERR_MSG_INVALID_EXPR;
+  eval->group_count = state->grouped?
+    state->schema->dims[state->group_ord].val_count + 1 : 1;
+  eval->aggs = malloc(eval->group_count * eval->term_count * sizeof(AGGREGATE));
+  eval->ords = calloc(state->schema->dim_count + 1, sizeof(uint32_t));
+  if(eval->aggs == NULL || eval->ords == NULL)
+    return ERR_MSG_NO_MEM;
+  for(size_t i=0; i < eval->group_count * eval->term_count; ++i)
+    aggregate_init(&eval->aggs[i]);
+  return NULL;
+}
+
+void free_eval_state(EVAL_STATE *eval) {
+  for(size_t t=0; eval->terms != NULL && t < eval->term_count; ++t) {
+    free(eval->terms[t].name);
+    free_query(&eval->terms[t].query);
+  }
+  free(eval->terms);
+  expr_free(eval->expr);
+  free(eval->ords);
+  free(eval->aggs);
+}
+
+/* SchemaEVAL <schema> <expression> <name> <aggregate> <filter> [...]
+   [GROUPBY <dimension>]
+   e.g. SchemaEVAL sales "big / small" big SUM '{"size": "large"}'
+   small SUM '{"size": "small"}' GROUPBY company
+*/
+int SchemaEvalCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+  int end = argc;
+  if(argc > SCHEMA_EVAL_ARGS_MIN && strcasecmp(
+    RedisModule_StringPtrLen(argv[argc - 2], NULL), ARG_GROUPBY) == 0)
+    end -= 2;
+  if(end < SCHEMA_EVAL_ARGS_MIN ||
+    (end - SCHEMA_EVAL_ARG_TERMS) % SCHEMA_EVAL_TERM_ARGS != 0)
+    return RedisModule_WrongArity(ctx);
+  OP_STATE state;
+  init_op_state(&state, S_OP_EVAL);
+  state.schema = schema_of_command(ctx, argv);
+  if(state.schema == NULL)
+    return RedisModule_ReplyWithSimpleString(ctx, ERR_MSG_NO_SCHEMA);
+  flush_schema_deltas(ctx, state.schema->name);
+  state.options = state.schema->options;
+  state.options.now = RedisModule_Milliseconds();
+  if(end < argc) {
+    state.group_ord = schema_dim_rank(state.schema,
+      RedisModule_StringPtrLen(argv[argc - 1], NULL));
+    if(state.group_ord == MODULE_ERROR)
+      return RedisModule_ReplyWithSimpleString(ctx, ERR_MSG_INVALID_GROUPBY);
+    state.grouped = true;
+  }
+  retain_schema(state.schema);
+  EVAL_STATE eval;
+  memset(&eval, 0, sizeof(eval));
+  state.eval = &eval;
+  C_CHARS err = build_eval(ctx, argv, end, &state);
+  if(err != NULL)
+    RedisModule_ReplyWithSimpleString(ctx, err);
+  else {
+    Query query;
+    build_eval_query(&eval, state.schema, &query);
+    filter_results_and_reply(ctx, &query, &state);
+    free_query(&query);
+  }
+  free_eval_state(&eval);
+  free_op_state(&state);
+  release_schema(state.schema);
+  return REDISMODULE_OK;
+}
+
+size_t key_mem_usage(C_CHARS key) {
+  return MEM_KEY_OVERHEAD + strlen(key);
+}
+
+/* integers live in the value object itself
+*/
+size_t string_mem_usage(C_CHARS str, size_t len) {
+  CELL_VALUE val;
+  if(parse_cell_value(str, len, &val) == CELL_OK && val.is_int)
+    return 0;
+  return len + MEM_SDS_OVERHEAD;
+}
+
+size_t zset_mem_usage(C_CHARS key, size_t count, size_t member_bytes) {
+  return key_mem_usage(key) + MEM_LISTPACK_OVERHEAD + member_bytes +
+    count * MEM_ZSET_ENTRY_OVERHEAD;
+}
+
+/* bytes a cell key holds past its own name
+*/
+size_t value_mem_usage(RedisModuleKey *redis_key) {
+  int type = RedisModule_KeyType(redis_key);
+  if(type == REDISMODULE_KEYTYPE_STRING) {
+    size_t len = 0;
+    C_CHARS ptr = RedisModule_StringDMA(redis_key, &len, REDISMODULE_READ);
+    return string_mem_usage(ptr, len);
+  }
+  if(type != REDISMODULE_KEYTYPE_MODULE)
+    return 0;
+  RedisModuleType *mt = RedisModule_ModuleTypeGetType(redis_key);
+  void *value = RedisModule_ModuleTypeGetValue(redis_key);
+  if(mt == CellRingType)
+    return cell_ring_mem_usage(value);
+  if(mt == SketchType)
+    return sketch_mem_usage(value);
+  if(mt == CellStoreType)
+    return cell_store_mem_usage(value);
+  return 0;
+}
+
+size_t schema_meta_mem_usage(RedisModuleCtx *ctx, SCHEMA *schema) {
+  size_t bytes = key_mem_usage(schema->version_key), names = 0;
+  for(size_t d=0; d < schema->dim_count; ++d) {
+    SCHEMA_DIM *dim = &schema->dims[d];
+    size_t vals = 0;
+    for(size_t j=0; j < dim->val_count; ++j)
+      vals += strlen(dim->vals[j]);
+    char *full_key = concat_prefix(schema->keys_prefix, dim->name);
+    bytes += zset_mem_usage(full_key, dim->val_count, vals);
+    free(full_key);
+    names += strlen(dim->name);
+    size_t pairs = 0, pair_bytes = 0;
+    for(size_t j=0; j < dim->val_count; ++j) {
+      if(dim->val_parents[j] != -1) {
+        pairs++;
+        pair_bytes += strlen(dim->vals[j]) + 1 +
+          strlen(dim->groups[dim->val_parents[j]]);
+      }
+    }
+    for(size_t g=0; g < dim->group_count; ++g) {
+      if(dim->group_parents[g] != -1) {
+        pairs++;
+        pair_bytes += strlen(dim->groups[g]) + 1 +
+          strlen(dim->groups[dim->group_parents[g]]);
+      }
+    }
+    full_key = concat_prefix(schema->parents_prefix, dim->name);
+    bytes += (pairs == 0)? 0 : zset_mem_usage(full_key, pairs, pair_bytes);
+    free(full_key);
+  }
+  bytes += zset_mem_usage(schema->order_key, schema->dim_count, names);
+  RedisModuleString *key_str = RM_CreateString(ctx, schema->options_key);
+  RedisModuleKey *redis_key = RedisModule_OpenKey(ctx,key_str,REDISMODULE_READ);
+  if(RedisModule_KeyType(redis_key) == REDISMODULE_KEYTYPE_HASH)
+    bytes += key_mem_usage(schema->options_key) + MEM_LISTPACK_OVERHEAD +
+      RedisModule_ValueLength(redis_key) * MEM_HASH_FIELD_BYTES;
+  RedisModule_CloseKey(redis_key);
+  RedisModule_FreeString(ctx, key_str);
+  key_str = RM_CreateString(ctx, schema->rollup_key);
+  redis_key = RedisModule_OpenKey(ctx, key_str, REDISMODULE_READ);
+  if(RedisModule_KeyType(redis_key) == REDISMODULE_KEYTYPE_MODULE &&
+    RedisModule_ModuleTypeGetType(redis_key) == CellStoreType)
+    bytes += key_mem_usage(schema->rollup_key) +
+      cell_store_mem_usage(RedisModule_ModuleTypeGetValue(redis_key));
+  RedisModule_CloseKey(redis_key);
+  RedisModule_FreeString(ctx, key_str);
+  return bytes;
+}
+
+size_t compiled_schema_mem_usage(SCHEMA *schema, size_t *indexes) {
+  C_CHARS strs[] = {schema->name, schema->prefix, schema->version_key,
+    schema->order_key, schema->keys_prefix, schema->options_key,
+    schema->store_key, schema->parents_prefix, schema->rollup_key};
+  size_t bytes = sizeof(SCHEMA) + schema->dim_count * sizeof(SCHEMA_DIM);
+  for(size_t i=0; i < sizeof(strs) / sizeof(strs[0]); ++i)
+    bytes += strlen(strs[i]) + 1;
+  *indexes = 0;
+  for(size_t d=0; d < schema->dim_count; ++d) {
+    SCHEMA_DIM *dim = &schema->dims[d];
+    bytes += strlen(dim->name) + 1 + dim->val_count * sizeof(char*);
+    for(size_t j=0; j < dim->val_count; ++j)
+      bytes += strlen(dim->vals[j]) + 1;
+    bytes += dim->group_count * sizeof(char*);
+    for(size_t g=0; g < dim->group_count; ++g)
+      bytes += strlen(dim->groups[g]) + 1;
+    *indexes += dim->val_count * (sizeof(size_t) + sizeof(int)) +
+      dim->group_count * sizeof(int);
+  }
+  return bytes;
+}
+
+size_t key_cursors_mem_usage(C_CHARS schema) {
+  size_t bytes = 0;
+  for(KEY_CURSOR *cursor = KeyCursors; cursor != NULL; cursor = cursor->next) {
+    if(strcmp(cursor->schema, schema) != 0)
+      continue;
+    bytes += sizeof(KEY_CURSOR) + strlen(cursor->schema) + 1 +
+      cursor->pending_cap * sizeof(char*);
+    for(size_t i=0; i < cursor->pending_len; ++i)
+      bytes += strlen(cursor->pending[i]) + 1;
+  }
+  return bytes;
+}
+
+size_t prepared_mem_usage(C_CHARS schema) {
+  size_t bytes = 0;
+  for(PREPARED *prepared = Prepared; prepared != NULL;
+    prepared = prepared->next) {
+    C_CHARS name = RedisModule_StringPtrLen(
+      prepared->argv[SCHEMA_NAME_ARG], NULL);
+    if(strcmp(name, schema) != 0)
+      continue;
+    bytes += sizeof(PREPARED) + prepared->argc * sizeof(RedisModuleString*) +
+      prepared->query.key_set_size * 2 * sizeof(unsigned char*);
+    for(int i=0; i < prepared->argc; ++i) {
+      size_t len;
+      RedisModule_StringPtrLen(prepared->argv[i], &len);
+      bytes += MEM_SDS_OVERHEAD + len;
+    }
+    for(size_t d=0; d < prepared->query.key_set_size; ++d) {
+      SCHEMA_DIM *dim = &prepared->schema->dims[d];
+      if(prepared->query.masks[d] != NULL)
+        bytes += dim->val_count + 1;
+      if(prepared->query.groups[d] != NULL)
+        bytes += dim->group_count;
+    }
+  }
+  return bytes;
+}
+
+void measure_scanned_key(RedisModuleCtx *ctx, RedisModuleString *keyname,
+  RedisModuleKey *key, void *privdata) {
+  MEM_STATE *mem = privdata;
+  size_t len;
+  C_CHARS name = RedisModule_StringPtrLen(keyname, &len);
+  if(len < mem->prefix_len || strncmp(name, mem->prefix, mem->prefix_len) != 0)
+    return;
+  mem->cell_count++;
+  mem->cells += MEM_KEY_OVERHEAD + len;
+  if(key != NULL) {
+    mem->cells += value_mem_usage(key);
+    return;
+  }
+  RedisModuleKey *redis_key = RedisModule_OpenKey(ctx,keyname,REDISMODULE_READ);
+  mem->cells += value_mem_usage(redis_key);
+  RedisModule_CloseKey(redis_key);
+}
+
+/* walks the keyspace like a plain SchemaGET does. the cells would fit a
+   CELL_STORE if they are plain counters whose ordinals pack into 64 bits
+*/
+void measure_plain_cells(RedisModuleCtx *ctx, SCHEMA *schema, MEM_STATE *mem) {
+  RedisModuleScanCursor *cursor = RedisModule_ScanCursorCreate();
+  while(RedisModule_Scan(ctx, cursor, measure_scanned_key, mem));
+  RedisModule_ScanCursorDestroy(cursor);
+  CELL_STORE *store = cell_store_new();
+  bool fits = store != NULL && fit_cell_store(store, schema) == REDISMODULE_OK;
+  cell_store_free(store);
+  mem->alt_cells = -1;
+  if(fits && schema->options.bucket_resolution == 0 &&
+    schema->options.sketch == SKETCH_NONE)
+    mem->alt_cells = key_mem_usage(schema->store_key) + sizeof(CELL_STORE) +
+      mem->cell_count * CELL_STORE_CELL_BYTES;
+}
+
+/* the other way round every live packed cell would become a key of its own
+*/
+void measure_store_cells(RedisModuleCtx *ctx, SCHEMA *schema, MEM_STATE *mem) {
+  RedisModuleString *key_str = RM_CreateString(ctx, schema->store_key);
+  RedisModuleKey *redis_key = RedisModule_OpenKey(ctx,key_str,REDISMODULE_READ);
+  mem->alt_cells = 0;
+  if(RedisModule_KeyType(redis_key) == REDISMODULE_KEYTYPE_MODULE &&
+    RedisModule_ModuleTypeGetType(redis_key) == CellStoreType) {
+    CELL_STORE *store = RedisModule_ModuleTypeGetValue(redis_key);
+    mem->cells = key_mem_usage(schema->store_key) +
+      cell_store_mem_usage(store);
+    for(size_t i=0; i < store->len; ++i) {
+      if(store->flags[i] == CELL_STORE_DEAD)
+        continue;
+      char *key = cell_store_key(schema, store, store->coords[i]);
+      mem->alt_cells += key_mem_usage(key);
+      if(store->flags[i] == CELL_STORE_DOUBLE)
+        mem->alt_cells += MEM_SDS_OVERHEAD + snprintf(NULL, 0, "%.17g",
+          cell_store_double(store, i));
+      mem->cell_count++;
+      free(key);
+    }
+  }
+  RedisModule_CloseKey(redis_key);
+  RedisModule_FreeString(ctx, key_str);
+}
+
+int reply_with_mem_state(RedisModuleCtx *ctx, SCHEMA *schema,
+  MEM_STATE *mem) {
+  bool sparse = schema->options.sparse;
+  RedisModule_ReplyWithArray(ctx, MEM_REPLY_FIELDS * 2);
+  RedisModule_ReplyWithSimpleString(ctx, "layout");
+  RedisModule_ReplyWithSimpleString(ctx, sparse? OPT_SPARSE : "plain");
+  RedisModule_ReplyWithSimpleString(ctx, "cell_count");
+  RedisModule_ReplyWithLongLong(ctx, mem->cell_count);
+  RedisModule_ReplyWithSimpleString(ctx, "cells");
+  RedisModule_ReplyWithLongLong(ctx, mem->cells);
+  RedisModule_ReplyWithSimpleString(ctx, "metadata");
+  RedisModule_ReplyWithLongLong(ctx, mem->metadata);
+  RedisModule_ReplyWithSimpleString(ctx, "compiled");
+  RedisModule_ReplyWithLongLong(ctx, mem->compiled);
+  RedisModule_ReplyWithSimpleString(ctx, "indexes");
+  RedisModule_ReplyWithLongLong(ctx, mem->indexes);
+  RedisModule_ReplyWithSimpleString(ctx, "cursors");
+  RedisModule_ReplyWithLongLong(ctx, mem->cursors);
+  RedisModule_ReplyWithSimpleString(ctx, "prepared");
+  RedisModule_ReplyWithLongLong(ctx, mem->prepared);
+  RedisModule_ReplyWithSimpleString(ctx, "total");
+  RedisModule_ReplyWithLongLong(ctx, mem->cells + mem->metadata +
+    mem->compiled + mem->indexes + mem->cursors + mem->prepared);
+  RedisModule_ReplyWithSimpleString(ctx, "alternative");
+  RedisModule_ReplyWithSimpleString(ctx, sparse? "plain" : OPT_SPARSE);
+  RedisModule_ReplyWithSimpleString(ctx, "alternative_cells");
+  if(mem->alt_cells < 0)
+    RedisModule_ReplyWithNull(ctx);
+  else
+    RedisModule_ReplyWithLongLong(ctx, mem->alt_cells);
+  RedisModule_ReplyWithSimpleString(ctx, "savings");
+  if(mem->alt_cells < 0)
+    return RedisModule_ReplyWithNull(ctx);
+  return RedisModule_ReplyWithLongLong(ctx,
+    (long long)mem->cells - mem->alt_cells);
+}
+
+/* SchemaMEMORY <schema>
+   bytes used by the cells, the metadata keys, the compiled schema and its
+   indexes and open cursors, and what the cells would take in the other
+   layout (plain keys or SPARSE), savings are positive when that is
+   smaller. walks every cell, so it costs what a full SchemaGET does
+*/
+int SchemaMemoryCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
+  int argc) {
+  if(argc != SCHEMA_MEMORY_ARGS)
+    return RedisModule_WrongArity(ctx);
+  SCHEMA *schema = schema_of_command(ctx, argv);
+  if(schema == NULL)
+    return RedisModule_ReplyWithSimpleString(ctx, ERR_MSG_NO_SCHEMA);
+  flush_schema_deltas(ctx, schema->name);
+  retain_schema(schema);
+  MEM_STATE mem;
+  memset(&mem, 0, sizeof(mem));
+  mem.prefix = schema->prefix;
+  mem.prefix_len = strlen(schema->prefix);
+  if(schema->options.sparse)
+    measure_store_cells(ctx, schema, &mem);
+  else
+    measure_plain_cells(ctx, schema, &mem);
+  mem.metadata = schema_meta_mem_usage(ctx, schema);
+  mem.compiled = compiled_schema_mem_usage(schema, &mem.indexes);
+  mem.cursors = key_cursors_mem_usage(schema->name);
+  mem.prepared = prepared_mem_usage(schema->name);
+  reply_with_mem_state(ctx, schema, &mem);
+  release_schema(schema);
+  return REDISMODULE_OK;
+}
+
+/* files are named within FileDir, with no directory of their own, so
+   only its last component could be a link and opening them refuses that
+*/
+bool valid_file_name(C_CHARS name) {
+  return name[0] != '\0' && strchr(name, '/') == NULL &&
+    strcmp(name, FILE_NAME_SELF) != 0 && strcmp(name, FILE_NAME_PARENT) != 0;
+}
+
+/* <file> [CSV|BINARY], CSV by default. path must be freed
+*/
+int parse_file_args(RedisModuleString **argv, int argc, int path_arg,
+  int format_arg, char **path, int *format) {
+  C_CHARS name = RedisModule_StringPtrLen(argv[path_arg], NULL);
+  *path = NULL;
+  *format = CELL_FILE_CSV;
+  if(argc > format_arg) {
+    C_CHARS arg = RedisModule_StringPtrLen(argv[format_arg], NULL);
+    if(strcasecmp(arg, ARG_BINARY) == 0)
+      *format = CELL_FILE_BINARY;
+    else if(strcasecmp(arg, ARG_CSV) != 0)
+      return MODULE_ERROR;
+  }
+  if(FileDir == NULL || !valid_file_name(name))
+    return MODULE_ERROR;
+  *path = malloc(strlen(FileDir) + strlen(name) + 2);
+  if(*path == NULL)
+    return MODULE_ERROR;
+  sprintf(*path, "%s/%s", FileDir, name);
+  return REDISMODULE_OK;
+}
+
+void free_import_batch(IMPORT_BATCH *batch) {
+  free(batch->cells);
+  free(batch);
+}
 
-	jsmn_init(&p);
-	tok = malloc(sizeof(*tok) * tokcount);
-	if (tok == NULL) {
-		parser->err_msg = ERR_MSG_NOMEM;
-		return MODULE_ERROR;
-	}
-  r = jsmn_parse(&p, parser->input, strlen(parser->input), tok, tokcount);
-  if(r<0) {
-    parser->err_msg = (r == JSMN_ERROR_NOMEM)?
-    ERR_MSG_NOMEM: ERR_MSG_INVALID_INPUT;
+/* a cell goes in as "<key>": <value>. the parser does not unescape keys,
+   so one holding a quote or a backslash can not be imported
+*/
+int append_import_cell(IMPORT_BATCH *batch, CELL_RECORD *record) {
+  if(memchr(record->key, '"', record->key_len) != NULL ||
+    memchr(record->key, '\\', record->key_len) != NULL)
     return MODULE_ERROR;
+  size_t need = batch->len + record->key_len + CELL_VALUE_MAX_LEN;
+  if(need > batch->cap) {
+    size_t cap = (need > batch->cap * 2)? need : batch->cap * 2;
+    char *cells = realloc(batch->cells, cap);
+    if(cells == NULL)
+      return MODULE_ERROR;
+    batch->cells = cells;
+    batch->cap = cap;
   }
-  return json_walk(ctx, tok, parser);
+  char *pos = batch->cells + batch->len;
+  pos += sprintf(pos, "%c\"%.*s\": ", (batch->count == 0)? '{' : ',',
+    (int)record->key_len, record->key);
+  pos += record->is_int? sprintf(pos, "%lld", (long long)record->ival) :
+    sprintf(pos, "%.17g", record->dval);
+  batch->len = pos - batch->cells;
+  strcpy(pos, "}");
+  batch->count++;
+  return REDISMODULE_OK;
 }
 
-//TODO: fix reply
-int SchemaCleanCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc){
-  int resp = cleanup_schema(ctx, SCHEMA_KEY_SET, SCHEMA_KEY_PREFIX);
-  RedisModule_ReplyWithSimpleString(ctx, OK_STR);
-  return resp;
+bool same_tag_value(CELL_RECORD *a, CELL_RECORD *b, int dim) {
+  size_t a_len = 0, b_len = 0;
+  C_CHARS a_tag = find_key_segment(a->key, a->key_len, dim, &a_len);
+  C_CHARS b_tag = find_key_segment(b->key, b->key_len, dim, &b_len);
+  return a_len == b_len && (a_len == 0 || memcmp(a_tag, b_tag, a_len) == 0);
 }
 
-int SchemaLoadCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc){
-    if(argc != SCHEMA_LOAD_ARGS_LIMIT) {
-        return RedisModule_WrongArity(ctx);
+/* 1 with the next batch, 0 once the file is read and -1 when it turns
+   out malformed. with HASHTAG <dimension> a batch ends where the value
+   of the dimension does, the cell read past it is held for the next one
+*/
+int next_import_batch(IMPORT *import, IMPORT_BATCH **next) {
+  IMPORT_BATCH *batch = calloc(1, sizeof(IMPORT_BATCH));
+  CELL_RECORD record, first;
+  int rsp = 1;
+  *next = NULL;
+  if(batch == NULL)
+    return -1;
+  while(batch->count < IMPORT_BATCH_CELLS) {
+    if(import->has_held) {
+      record = import->held;
+      import->has_held = false;
     }
-    size_t len; int resp;
-    cleanup_schema(ctx, SCHEMA_KEY_SET, SCHEMA_KEY_PREFIX);
-    PARSER_STATE parser;
-    parser.err_msg = NULL;
-    parser.input = RedisModule_StringPtrLen(argv[SCHEMA_LOAD_ARG_LIST], &len);
-    parser.handler = SchemaLoad_handler;
-    resp = parse_input(ctx, &parser);
-    if(resp < 0)
-      return report_error(ctx, parser.err_msg, &parser); // ERR: change message
-    RedisModule_ReplyWithSimpleString(ctx, OK_STR);
-    return REDISMODULE_OK;
+    else if((rsp = cell_file_next(import->file, &record)) != 1)
+      break;
+    if(batch->count == 0)
+      first = record;
+    else if(import->tag_dim >= 0 &&
+      !same_tag_value(&first, &record, import->tag_dim)) {
+      import->held = record;
+      import->has_held = true;
+      break;
+    }
+    if(append_import_cell(batch, &record) != REDISMODULE_OK) {
+      rsp = -1;
+      break;
+    }
+  }
+  if(rsp < 0 || batch->count == 0) {
+    free_import_batch(batch);
+    return (rsp < 0)? -1 : 0;
+  }
+  *next = batch;
+  return 1;
 }
 
-float get_numeric_key(RedisModuleCtx *ctx, char const *key, OP_STATE* state) {
-  RedisModuleCallReply *reply = RedisModule_Call(ctx,GET_CMD,GET_FMT,key);
-  if(reply == NULL) {
-    state->stage = OP_ERR;
-    return REDISMODULE_ERR;
+void *read_import(void *arg) {
+  IMPORT *import = arg;
+  IMPORT_BATCH *batch;
+  int rsp;
+  while((rsp = next_import_batch(import, &batch)) == 1) {
+    pthread_mutex_lock(&import->lock);
+    while(import->queued >= IMPORT_QUEUE_MAX && !import->stop)
+      pthread_cond_wait(&import->drained, &import->lock);
+    bool stop = import->stop;
+    if(!stop) {
+      if(import->tail == NULL)
+        import->head = batch;
+      else
+        import->tail->next = batch;
+      import->tail = batch;
+      import->queued++;
+    }
+    pthread_mutex_unlock(&import->lock);
+    if(stop) {
+      free_import_batch(batch);
+      break;
+    }
   }
-  //TODO: go over negative infinite and change
-  float ret = atof(get_string_from_reply(reply));
-  RedisModule_FreeCallReply(reply);
-  return ret;
+  cell_file_close(import->file);
+  import->file = NULL;
+  pthread_mutex_lock(&import->lock);
+  if(rsp < 0 && import->err_msg == NULL)
+    import->err_msg = ERR_MSG_FILE_READ;
+  import->read = true;
+  pthread_mutex_unlock(&import->lock);
+  return NULL;
 }
 
-int schema_op_init(RedisModuleCtx *ctx, char *key, OP_STATE* state) {
-  switch (state->op) {
-    case S_OP_GET:
-      RedisModule_ReplyWithArray(ctx,REDISMODULE_POSTPONED_ARRAY_LEN);
-      break;
-    case S_OP_AVG:
-    case S_OP_SUM:
-      state->aggregate = 0;
-      break;
-    case S_OP_MIN:
-    case S_OP_MAX:
-      state->aggregate = get_numeric_key(ctx, key, state);
-      break;
-    default:
-      break;
+/* NULL when the queue is empty, read tells whether it stays so
+*/
+IMPORT_BATCH *dequeue_import_batch(IMPORT *import, bool *read) {
+  pthread_mutex_lock(&import->lock);
+  IMPORT_BATCH *batch = import->head;
+  if(batch != NULL) {
+    import->head = batch->next;
+    if(import->head == NULL)
+      import->tail = NULL;
+    import->queued--;
+    pthread_cond_signal(&import->drained);
   }
-  state->stage = OP_MID;
-  return REDISMODULE_OK;
+  *read = import->read;
+  pthread_mutex_unlock(&import->lock);
+  return batch;
 }
 
-int schema_op_mid(RedisModuleCtx *ctx, char *key, OP_STATE* state) {
-  long result=0;
-  switch (state->op) {
-    case S_OP_GET:
-      RedisModule_ReplyWithSimpleString(ctx, key);
-      break;
-    case S_OP_INC:
-      increment_key(ctx, key);
-      break;
-    case S_OP_CLR:
-      delete_key(ctx,key);
-      break;
-    case S_OP_AVG:
-    case S_OP_SUM:
-      result = get_numeric_key(ctx, key, state);
-      state->aggregate += result;
-      break;
-    case S_OP_MIN:
-      result = get_numeric_key(ctx, key, state);
-      if(result < state->aggregate)
-        state->aggregate = result;
-      break;
-    case S_OP_MAX:
-      result = get_numeric_key(ctx, key, state);
-      if(result > state->aggregate)
-        state->aggregate = result;
-      break;
-    default:
-      break;
+/* the batch is set like SchemaSET would set it, and replicates as one
+*/
+C_CHARS import_batch(RedisModuleCtx *ctx, C_CHARS name, IMPORT_BATCH *batch) {
+  SCHEMA *schema = get_schema(ctx, name);
+  if(schema == NULL)
+    return ERR_MSG_NO_SCHEMA;
+  flush_schema_deltas(ctx, name);
+  retain_schema(schema);
+  PARSER_STATE parser;
+  memset(&parser, 0, sizeof(parser));
+  parser.schema = schema;
+  parser.options = schema->options;
+  parser.options.now = RedisModule_Milliseconds();
+  parser.input = batch->cells;
+  parser.handler = SchemaSet_handler;
+  build_query(schema, &parser.query, true);
+  parser.query.partial_keys = true;
+  parser.query.hashtag = schema->options.hashtag;
+  int resp = parse_input(ctx, &parser);
+  //a failed batch may have set some cells
+  if(schema->options.bucket_count > 0)
+    RedisModule_Replicate(ctx, SCHEMA_SET_CMD, REPLICATE_BATCH_NOW_FMT, name,
+      batch->cells, ARG_NOW, parser.options.now);
+  else
+    RedisModule_Replicate(ctx, SCHEMA_SET_CMD, REPLICATE_BATCH_FMT, name,
+      batch->cells);
+  free(parser.tag);
+  free_query(&parser.query);
+  release_schema(schema);
+  return (resp < 0)? parser.err_msg : NULL;
+}
+
+/* the first batch that fails stops the import, the reader drops the rest
+*/
+void apply_import_batch(RedisModuleCtx *ctx, IMPORT *import,
+  IMPORT_BATCH *batch) {
+  if(import->stop)
+    return;
+  C_CHARS err = import_batch(ctx, import->name, batch);
+  if(err == NULL) {
+    import->imported += batch->count;
+    return;
   }
-  state->match_count++;
-  return REDISMODULE_OK;
+  pthread_mutex_lock(&import->lock);
+  import->err_msg = err;
+  import->stop = true;
+  pthread_cond_signal(&import->drained);
+  pthread_mutex_unlock(&import->lock);
 }
 
-//TODO: error handling + reply for all cases + reply during error
-int schema_op_done(RedisModuleCtx *ctx, OP_STATE* state) {
-  switch (state->op) {
-    case S_OP_GET:
-      RedisModule_ReplySetArrayLength(ctx,state->match_count);
-      if(state->match_count == 0)
-        RedisModule_ReplyWithSimpleString(ctx, NO_KEYS_MATCHED);
-      break;
-    case S_OP_SUM:
-    case S_OP_MIN:
-    case S_OP_MAX:
-      RedisModule_ReplyWithLongLong(ctx, state->aggregate);
-      break;
-    case S_OP_AVG:
-      RedisModule_ReplyWithLongLong(ctx, state->aggregate/state->match_count);
-      break;
-    default:
-      RedisModule_ReplyWithSimpleString(ctx, OK_STR);
-      break;
+void free_import(IMPORT *import) {
+  while(import->head != NULL) {
+    IMPORT_BATCH *batch = import->head;
+    import->head = batch->next;
+    free_import_batch(batch);
   }
-  return REDISMODULE_OK;
+  cell_file_close(import->file);
+  pthread_mutex_destroy(&import->lock);
+  pthread_cond_destroy(&import->drained);
+  free(import->name);
+  free(import);
 }
 
-int found_matched_key(RedisModuleCtx *ctx, char *key, OP_STATE* state) {
-  switch (state->stage) {
-    case OP_INIT:
-      schema_op_init(ctx, key, state);
-    case OP_MID:
-      schema_op_mid(ctx, key, state);
-      break;
-    case OP_DONE:
-      schema_op_done(ctx, state);
-      break;
-    default:
+IMPORT *new_import(SCHEMA *schema, C_CHARS path, int format) {
+  IMPORT *import = calloc(1, sizeof(IMPORT));
+  if(import == NULL)
+    return NULL;
+  pthread_mutex_init(&import->lock, NULL);
+  pthread_cond_init(&import->drained, NULL);
+  import->name = strdup(schema->name);
+  import->tag_dim = tagged_dim(schema->options.hashtag);
+  import->file = cell_file_open(path, format);
+  if(import->name == NULL || import->file == NULL) {
+    free_import(import);
+    return NULL;
+  }
+  return import;
+}
+
+int reply_with_import(RedisModuleCtx *ctx, IMPORT *import) {
+  if(import->err_msg != NULL)
+    return RedisModule_ReplyWithSimpleString(ctx, import->err_msg);
+  return RedisModule_ReplyWithLongLong(ctx, import->imported);
+}
+
+/* applies the batches the reader queued until the slice is spent, then
+   waits for more or unblocks the client once the reader is done
+*/
+void ImportTimer(RedisModuleCtx *ctx, void *data) {
+  IMPORT *import = data;
+  RedisModuleCtx *slice_ctx = RedisModule_GetThreadSafeContext(import->bc);
+  long long start = monotonic_micros(), first = import->imported;
+  IMPORT_BATCH *batch;
+  bool read;
+  while((batch = dequeue_import_batch(import, &read)) != NULL) {
+    apply_import_batch(slice_ctx, import, batch);
+    free_import_batch(batch);
+    if((SliceKeys > 0 && import->imported - first >= SliceKeys) ||
+      (SliceMicros > 0 && monotonic_micros() - start >= SliceMicros))
       break;
   }
-  return REDISMODULE_OK;
+  RedisModule_FreeThreadSafeContext(slice_ctx);
+  if(batch == NULL && read)
+    RedisModule_UnblockClient(import->bc, import);
+  else
+    RedisModule_CreateTimer(ctx, (batch == NULL)? IMPORT_POLL_MS :
+      SLICE_PERIOD_MS, ImportTimer, import);
 }
 
-int filter_results_and_reply(RedisModuleCtx *ctx, Query *query, SCHEMA_OP op) {
-  RedisModuleCallReply *reply=RedisModule_Call(ctx,KEYS_CMD,KEYS_FMT,ALL_KEYS);
-  size_t keys_length = RedisModule_CallReplyLength(reply);
-  OP_STATE state;
-  state.op = op;
-  state.stage = OP_INIT;
-  state.match_count = 0;
-  for(int i=0; i < keys_length; ++i) {
-    char* key = get_reply_element_at(reply,i);
-    if(match_key_to_query(key, query)) {
-      found_matched_key(ctx, key, &state);
-    }
-    free(key);
+int ImportReply(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+  return reply_with_import(ctx, RedisModule_GetBlockedClientPrivateData(ctx));
+}
+
+void ImportFree(RedisModuleCtx *ctx, void *privdata) {
+  free_import(privdata);
+}
+
+/* inside MULTI or a script the client can not wait, the file is read
+   and set within the command
+*/
+int import_in_place(RedisModuleCtx *ctx, IMPORT *import) {
+  IMPORT_BATCH *batch;
+  int rsp = 0;
+  while(!import->stop && (rsp = next_import_batch(import, &batch)) == 1) {
+    apply_import_batch(ctx, import, batch);
+    free_import_batch(batch);
   }
-  RedisModule_FreeCallReply(reply);
-  state.stage = OP_DONE;
-  found_matched_key(ctx, NULL, &state);
+  if(rsp < 0 && import->err_msg == NULL)
+    import->err_msg = ERR_MSG_FILE_READ;
+  reply_with_import(ctx, import);
+  free_import(import);
   return REDISMODULE_OK;
 }
 
-void build_query(RedisModuleCtx *ctx, Query *query, bool fill) {
-  query->key_set_size = get_zset_size(ctx, SCHEMA_KEY_SET);
-  query->key_set = malloc(sizeof(schema_elem_t*) * query->key_set_size);
-  query->val_sizes = malloc(sizeof(size_t) * query->key_set_size);
-  for(int i=0; i<query->key_set_size; ++i) {
-    schema_elem_t key = zset_get_element_by_index(ctx, SCHEMA_KEY_SET, i);
-    schema_elem_t full_key = concat_prefix(SCHEMA_KEY_PREFIX, key);
-    query->val_sizes[i] = get_zset_size(ctx, full_key);
-    query->key_set[i] = malloc(sizeof(char*) * query->val_sizes[i]);
-    for (int j=0; j<query->val_sizes[i]; ++j)
-      query->key_set[i][j]=fill?zset_get_element_by_index(ctx,full_key,j):NULL;
-    free(full_key);
-    free(key);
-  }
+/* SchemaIMPORT <schema> <file> [CSV|BINARY]
+   sets the cells a file in FileDir holds (see cellfile.h), keys without the schema
+   name, and replies with how many. a thread reads the file while the
+   cells are set in slices of the event loop, each batch replicating as
+   the SchemaSET it amounts to. a malformed cell or a failed batch stops
+   the import, cells set before it stay. a cluster node sets every cell
+   locally, a file holds the cells of the slots it serves
+*/
+int SchemaImportCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
+  int argc) {
+  if(argc < SCHEMA_IMPORT_ARGS_MIN || argc > SCHEMA_IMPORT_ARGS_MAX)
+    return RedisModule_WrongArity(ctx);
+  char *path;
+  int format;
+  SCHEMA *schema = schema_of_command(ctx, argv);
+  if(schema == NULL)
+    return RedisModule_ReplyWithSimpleString(ctx, ERR_MSG_NO_SCHEMA);
+  if(parse_file_args(argv, argc, SCHEMA_IMPORT_ARG_PATH,
+    SCHEMA_IMPORT_ARG_FORMAT, &path, &format) != REDISMODULE_OK)
+    return RedisModule_ReplyWithSimpleString(ctx, ERR_MSG_INVALID_FILE);
+  IMPORT *import = new_import(schema, path, format);
+  free(path);
+  if(import == NULL)
+    return RedisModule_ReplyWithSimpleString(ctx, ERR_MSG_FILE_READ);
+  pthread_t tid;
+  if(!can_block(ctx) || pthread_create(&tid, NULL, read_import, import) != 0)
+    return import_in_place(ctx, import);
+  pthread_detach(tid);
+  import->bc = RedisModule_BlockClient(ctx, ImportReply, NULL, ImportFree, 0);
+  RedisModule_CreateTimer(ctx, SLICE_PERIOD_MS, ImportTimer, import);
+  return REDISMODULE_OK;
 }
 
-void free_query(Query *query) {
-  for(int i=0; i< query->key_set_size; ++i) {
-    for(int j=0; j<query->val_sizes[i]; ++j) {
-      if(query->key_set[i][j] != NULL)
-        free(query->key_set[i][j]);
+/* returned pointer must be freed. the cell key SchemaIMPORT takes back,
+   without the schema name and the braces of HASHTAG
+*/
+char *export_key(OP_STATE *state, C_CHARS key) {
+  C_CHARS cell = key + strlen(state->schema->prefix);
+  int dim = tagged_dim(state->options.hashtag);
+  size_t len = 0;
+  C_CHARS tag = (dim < 0)? NULL :
+    find_key_segment(cell, strlen(cell), dim, &len);
+  if(tag == NULL || len < 2 || tag[0] != HASHTAG_OPEN ||
+    tag[len - 1] != HASHTAG_CLOSE)
+    return strdup(cell);
+  char *ret = malloc(strlen(cell) - 1);
+  if(ret != NULL)
+    sprintf(ret, "%.*s%.*s%s", (int)(tag - cell), cell, (int)len - 2, tag + 1,
+      tag + len);
+  return ret;
+}
+
+void free_export(EXPORT *export) {
+  for(size_t i=0; i < export->len; ++i)
+    free((char*)export->records[i].key);
+  free(export->records);
+  free(export->path);
+  free(export);
+}
+
+EXPORT *new_export(OP_STATE *state, C_CHARS path, int format) {
+  EXPORT *export = calloc(1, sizeof(EXPORT));
+  if(export == NULL)
+    return NULL;
+  export->format = format;
+  export->path = strdup(path);
+  export->records = calloc(state->page_len + 1, sizeof(CELL_RECORD));
+  if(export->path == NULL || export->records == NULL) {
+    free_export(export);
+    return NULL;
+  }
+  for(; export->len < state->page_len; export->len++) {
+    GET_ENTRY *entry = &state->page[export->len];
+    CELL_RECORD *record = &export->records[export->len];
+    char *key = export_key(state, entry->key);
+    if(key == NULL) {
+      free_export(export);
+      return NULL;
     }
-    free(query->key_set[i]);
+    record->key = key;
+    record->key_len = strlen(key);
+    record->is_int = entry->val.is_int;
+    record->ival = entry->val.ival;
+    record->dval = entry->val.dval;
   }
-  free(query->val_sizes);
-  free(query->key_set);
+  return export;
 }
 
-int schemaOperationsCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
-  int argc, SCHEMA_OP op) {
-  if(argc != SCHEMA_LOAD_ARGS_LIMIT) {
-      return RedisModule_WrongArity(ctx);
+void write_export(EXPORT *export) {
+  export->rsp = cell_file_write(export->path, export->format,
+    export->records, export->len);
+}
+
+int reply_with_export(RedisModuleCtx *ctx, EXPORT *export) {
+  if(export->rsp != 0)
+    return RedisModule_ReplyWithSimpleString(ctx, ERR_MSG_FILE_WRITE);
+  return RedisModule_ReplyWithLongLong(ctx, export->len);
+}
+
+void *write_export_thread(void *arg) {
+  EXPORT *export = arg;
+  write_export(export);
+  RedisModule_UnblockClient(export->bc, export);
+  return NULL;
+}
+
+int ExportReply(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
+  return reply_with_export(ctx, RedisModule_GetBlockedClientPrivateData(ctx));
+}
+
+void ExportFree(RedisModuleCtx *ctx, void *privdata) {
+  free_export(privdata);
+}
+
+/* the matched cells are copied out, a thread writes the file off them
+*/
+int export_cells(RedisModuleCtx *ctx, OP_STATE *state, C_CHARS path,
+  int format) {
+  EXPORT *export = new_export(state, path, format);
+  if(export == NULL)
+    return RedisModule_ReplyWithSimpleString(ctx, ERR_MSG_NO_MEM);
+  if(!can_block(ctx)) {
+    write_export(export);
+    reply_with_export(ctx, export);
+    free_export(export);
+    return REDISMODULE_OK;
   }
-  size_t len; int resp = REDISMODULE_OK;
-  PARSER_STATE parser;
-  parser.err_msg = NULL;
-  parser.input = RedisModule_StringPtrLen(argv[SCHEMA_LOAD_ARG_LIST], &len);
-  bool fill = (op == S_OP_SET);
-  parser.handler= (op==S_OP_SET)? SchemaSet_handler : SchemaOperations_handler;
-  build_query(ctx, &parser.query, fill);
-  resp = parse_input(ctx, &parser);
-  if(resp<0)
-    resp = report_error(ctx, parser.err_msg, &parser); // ERR: change message
-  else if(op != S_OP_SET)
-    filter_results_and_reply(ctx, &parser.query, op);
+  export->bc = RedisModule_BlockClient(ctx, ExportReply, NULL, ExportFree, 0);
+  pthread_t tid;
+  if(pthread_create(&tid, NULL, write_export_thread, export) != 0)
+    write_export_thread(export);
   else
-    RedisModule_ReplyWithSimpleString(ctx, SCHEMA_SET_OK_STR);
+    pthread_detach(tid);
+  return REDISMODULE_OK;
+}
+
+/* SchemaEXPORT <schema> <filter> <file> [CSV|BINARY]
+   writes the numeric cells the filter matches to a new file in FileDir
+   SchemaIMPORT reads back, replies with how many
+*/
+int SchemaExportCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
+  int argc) {
+  if(argc < SCHEMA_EXPORT_ARGS_MIN || argc > SCHEMA_EXPORT_ARGS_MAX)
+    return RedisModule_WrongArity(ctx);
+  char *path;
+  int format;
+  size_t len;
+  OP_STATE state;
+  init_op_state(&state, S_OP_EXPORT);
+  state.schema = schema_of_command(ctx, argv);
+  if(state.schema == NULL)
+    return RedisModule_ReplyWithSimpleString(ctx, ERR_MSG_NO_SCHEMA);
+  //it is a read, only the flush of pending increments writes
+  if((RedisModule_GetContextFlags(ctx) & (REDISMODULE_CTX_FLAGS_READONLY |
+    REDISMODULE_CTX_FLAGS_OOM)) != 0 &&
+    schema_deltas_pending(ctx, state.schema->name))
+    return RedisModule_ReplyWithSimpleString(ctx, ERR_MSG_DELTAS_PENDING);
+  if(parse_file_args(argv, argc, SCHEMA_EXPORT_ARG_PATH,
+    SCHEMA_EXPORT_ARG_FORMAT, &path, &format) != REDISMODULE_OK)
+    return RedisModule_ReplyWithSimpleString(ctx, ERR_MSG_INVALID_FILE);
+  flush_schema_deltas(ctx, state.schema->name);
+  state.options = state.schema->options;
+  state.options.now = RedisModule_Milliseconds();
+  retain_schema(state.schema);
+  PARSER_STATE parser;
+  memset(&parser, 0, sizeof(parser));
+  parser.schema = state.schema;
+  parser.options = state.options;
+  parser.input = RedisModule_StringPtrLen(argv[SCHEMA_EXPORT_ARG_FILTER], &len);
+  parser.handler = SchemaOperations_handler;
+  parser.predicates = true;
+  build_query(state.schema, &parser.query, false);
+  parser.query.hashtag = state.options.hashtag;
+  if(parse_input(ctx, &parser) < 0)
+    report_error(ctx, parser.err_msg, &parser);
+  else {
+    if(state.options.sparse)
+      filter_store(ctx, &parser.query, &state);
+    else
+      filter_keys(ctx, &parser.query, &state);
+    if(state.stage == OP_ERR)
+      RedisModule_ReplyWithSimpleString(ctx, state.err_msg);
+    else
+      export_cells(ctx, &state, path, format);
+  }
+  free(path);
+  free(parser.tag);
   free_query(&parser.query);
-  return resp;
+  free_op_state(&state);
+  release_schema(state.schema);
+  return REDISMODULE_OK;
 }
 
-int SchemaSetCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    return schemaOperationsCommand(ctx, argv, argc, S_OP_SET);
+void *CellRingTypeRdbLoad(RedisModuleIO *rdb, int encver) {
+  if(encver != CELL_RING_ENCODING_VERSION)
+    return NULL;
+  long long resolution = RedisModule_LoadSigned(rdb);
+  size_t size = RedisModule_LoadUnsigned(rdb);
+  CELL_RING *ring = cell_ring_new(resolution, size);
+  if(ring == NULL)
+    return NULL;
+  ring->head = RedisModule_LoadSigned(rdb);
+  for(size_t i=0; i < size; ++i)
+    ring->buckets[i] = RedisModule_LoadSigned(rdb);
+  return ring;
 }
 
-int SchemaGetCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    return schemaOperationsCommand(ctx, argv, argc, S_OP_GET);
+void CellRingTypeRdbSave(RedisModuleIO *rdb, void *value) {
+  CELL_RING *ring = value;
+  RedisModule_SaveSigned(rdb, ring->resolution);
+  RedisModule_SaveUnsigned(rdb, ring->size);
+  RedisModule_SaveSigned(rdb, ring->head);
+  for(size_t i=0; i < ring->size; ++i)
+    RedisModule_SaveSigned(rdb, ring->buckets[i]);
 }
 
-int SchemaSumCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    return schemaOperationsCommand(ctx, argv, argc, S_OP_SUM);
+void CellRingTypeAofRewrite(RedisModuleIO *aof, RedisModuleString *key,
+  void *value) {
+  CELL_RING *ring = value;
+  char *buckets = join_ring_buckets(ring);
+  RedisModule_EmitAOF(aof, CELL_RING_RESTORE_CMD, "slllc", key,
+    ring->resolution, (long long)ring->size, ring->head, buckets);
+  free(buckets);
 }
 
-int SchemaAvgCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    return schemaOperationsCommand(ctx, argv, argc, S_OP_AVG);
+size_t CellRingTypeMemUsage(const void *value) {
+  return cell_ring_mem_usage(value);
 }
 
-int SchemaMinCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    return schemaOperationsCommand(ctx, argv, argc, S_OP_MIN);
+void CellRingTypeFree(void *value) {
+  cell_ring_free(value);
 }
 
-int SchemaMaxCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    return schemaOperationsCommand(ctx, argv, argc, S_OP_MAX);
+/* SchemaRingRestore <key> <resolution> <size> <head> <buckets>
+   recreates a time bucketed cell, this is what AOF rewrite emits
+*/
+int SchemaRingRestoreCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
+  int argc) {
+  if(argc != CELL_RING_RESTORE_ARGS)
+    return RedisModule_WrongArity(ctx);
+  long long resolution, size, head;
+  if(RedisModule_StringToLongLong(argv[2], &resolution) != REDISMODULE_OK ||
+    RedisModule_StringToLongLong(argv[3], &size) != REDISMODULE_OK ||
+    RedisModule_StringToLongLong(argv[4], &head) != REDISMODULE_OK ||
+    resolution <= 0 || size <= 0 || size > CELL_RING_MAX_BUCKETS)
+    return RedisModule_ReplyWithSimpleString(ctx, ERR_MSG_INVALID_RING);
+  CELL_RING *ring = cell_ring_new(resolution, size);
+  char *buckets = (ring == NULL)? NULL :
+    strdup(RedisModule_StringPtrLen(argv[5], NULL));
+  if(buckets == NULL) {
+    cell_ring_free(ring);
+    return RedisModule_ReplyWithSimpleString(ctx, ERR_MSG_NO_MEM);
+  }
+  ring->head = head;
+  long long i = 0;
+  for(char *tok = strtok(buckets, CELL_RING_BUCKET_DELIM); tok != NULL;
+    tok = strtok(NULL, CELL_RING_BUCKET_DELIM), ++i) {
+    if(i < size)
+      ring->buckets[i] = strtoll(tok, NULL, 10);
+  }
+  free(buckets);
+  if(i != size) {
+    cell_ring_free(ring);
+    return RedisModule_ReplyWithSimpleString(ctx, ERR_MSG_INVALID_RING);
+  }
+  RedisModuleKey *redis_key = RedisModule_OpenKey(ctx, argv[1],
+    REDISMODULE_WRITE);
+  RedisModule_ModuleTypeSetValue(redis_key, CellRingType, ring);
+  RedisModule_CloseKey(redis_key);
+  RedisModule_ReplicateVerbatim(ctx);
+  return RedisModule_ReplyWithSimpleString(ctx, OK_STR);
 }
 
-int SchemaClrCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    return schemaOperationsCommand(ctx, argv, argc, S_OP_CLR);
+void *SketchTypeRdbLoad(RedisModuleIO *rdb, int encver) {
+  if(encver != SKETCH_ENCODING_VERSION)
+    return NULL;
+  size_t len;
+  char *buf = RedisModule_LoadStringBuffer(rdb, &len);
+  SKETCH *sketch = sketch_deserialize(buf, len);
+  RedisModule_Free(buf);
+  return sketch;
 }
 
-int SchemaIncCommand(RedisModuleCtx *ctx, RedisModuleString **argv, int argc) {
-    return schemaOperationsCommand(ctx, argv, argc, S_OP_INC);
+void SketchTypeRdbSave(RedisModuleIO *rdb, void *value) {
+  size_t len;
+  char *buf = sketch_serialize(value, &len);
+  RedisModule_SaveStringBuffer(rdb, buf, len);
+  free(buf);
+}
+
+void SketchTypeAofRewrite(RedisModuleIO *aof, RedisModuleString *key,
+  void *value) {
+  size_t len;
+  char *buf = sketch_serialize(value, &len);
+  RedisModule_EmitAOF(aof, SKETCH_RESTORE_CMD, "sb", key, buf, len);
+  free(buf);
+}
+
+size_t SketchTypeMemUsage(const void *value) {
+  return sketch_mem_usage(value);
+}
+
+void SketchTypeFree(void *value) {
+  sketch_free(value);
+}
+
+/* SchemaSketchRestore <key> <serialized sketch>
+   recreates a sketch cell, this is what AOF rewrite emits
+*/
+int SchemaSketchRestoreCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
+  int argc) {
+  if(argc != SKETCH_RESTORE_ARGS)
+    return RedisModule_WrongArity(ctx);
+  size_t len;
+  C_CHARS buf = RedisModule_StringPtrLen(argv[2], &len);
+  SKETCH *sketch = sketch_deserialize(buf, len);
+  if(sketch == NULL)
+    return RedisModule_ReplyWithSimpleString(ctx, ERR_MSG_INVALID_SKETCH);
+  RedisModuleKey *redis_key = RedisModule_OpenKey(ctx, argv[1],
+    REDISMODULE_WRITE);
+  RedisModule_ModuleTypeSetValue(redis_key, SketchType, sketch);
+  RedisModule_CloseKey(redis_key);
+  RedisModule_ReplicateVerbatim(ctx);
+  return RedisModule_ReplyWithSimpleString(ctx, OK_STR);
+}
+
+void *CellStoreTypeRdbLoad(RedisModuleIO *rdb, int encver) {
+  if(encver != CELL_STORE_ENCODING_VERSION)
+    return NULL;
+  size_t len;
+  char *buf = RedisModule_LoadStringBuffer(rdb, &len);
+  CELL_STORE *store = cell_store_deserialize(buf, len);
+  RedisModule_Free(buf);
+  return store;
+}
+
+void CellStoreTypeRdbSave(RedisModuleIO *rdb, void *value) {
+  size_t len;
+  cell_store_compact(value);
+  char *buf = cell_store_serialize(value, &len);
+  RedisModule_SaveStringBuffer(rdb, buf, len);
+  free(buf);
+}
+
+void CellStoreTypeAofRewrite(RedisModuleIO *aof, RedisModuleString *key,
+  void *value) {
+  size_t len;
+  cell_store_compact(value);
+  char *buf = cell_store_serialize(value, &len);
+  RedisModule_EmitAOF(aof, CELL_STORE_RESTORE_CMD, "sb", key, buf, len);
+  free(buf);
+}
+
+size_t CellStoreTypeMemUsage(const void *value) {
+  return cell_store_mem_usage(value);
+}
+
+void CellStoreTypeFree(void *value) {
+  cell_store_free(value);
+}
+
+/* SchemaStoreRestore <key> <serialized cells>
+   recreates the packed cells of a sparse schema, this is what AOF rewrite
+   emits
+*/
+int SchemaStoreRestoreCommand(RedisModuleCtx *ctx, RedisModuleString **argv,
+  int argc) {
+  if(argc != CELL_STORE_RESTORE_ARGS)
+    return RedisModule_WrongArity(ctx);
+  size_t len;
+  C_CHARS buf = RedisModule_StringPtrLen(argv[2], &len);
+  CELL_STORE *store = cell_store_deserialize(buf, len);
+  if(store == NULL)
+    return RedisModule_ReplyWithSimpleString(ctx, ERR_MSG_INVALID_STORE);
+  RedisModuleKey *redis_key = RedisModule_OpenKey(ctx, argv[1],
+    REDISMODULE_WRITE);
+  RedisModule_ModuleTypeSetValue(redis_key, CellStoreType, store);
+  RedisModule_CloseKey(redis_key);
+  RedisModule_ReplicateVerbatim(ctx);
+  return RedisModule_ReplyWithSimpleString(ctx, OK_STR);
+}
+
+/* loadmodule redischema.so [SLICE_KEYS <count>] [SLICE_MICROS <us>]
+   [BACKGROUND_CELLS <count>] [BACKGROUND_READS <count>] [COALESCE_MS <ms>]
+   [APPROX_SAMPLE_MAX <count>] [FILE_DIR <directory>]
+*/
+int parse_module_args(RedisModuleString **argv, int argc) {
+  if(argc % 2 != 0)
+    return MODULE_ERROR;
+  for(int i=0; i < argc; i += 2) {
+    C_CHARS name = RedisModule_StringPtrLen(argv[i], NULL);
+    long long val;
+    if(strcasecmp(name, ARG_FILE_DIR) == 0) {
+      free(FileDir);
+      FileDir = strdup(RedisModule_StringPtrLen(argv[i + 1], NULL));
+      if(FileDir == NULL || FileDir[0] == '\0')
+        return MODULE_ERROR;
+      continue;
+    }
+    if(RedisModule_StringToLongLong(argv[i + 1], &val) != REDISMODULE_OK ||
+      val < 0)
+      return MODULE_ERROR;
+    if(strcasecmp(name, ARG_SLICE_KEYS) == 0)
+      SliceKeys = val;
+    else if(strcasecmp(name, ARG_SLICE_MICROS) == 0)
+      SliceMicros = val;
+    else if(strcasecmp(name, ARG_BACKGROUND_CELLS) == 0)
+      BackgroundCells = val;
+    else if(strcasecmp(name, ARG_BACKGROUND_READS) == 0)
+      BackgroundReads = val;
+    else if(strcasecmp(name, ARG_COALESCE_MS) == 0)
+      CoalesceMs = val;
+    else if(strcasecmp(name, ARG_APPROX_SAMPLE_MAX) == 0)
+      ApproxSampleMax = val;
+    else
+      return MODULE_ERROR;
+  }
+  return REDISMODULE_OK;
 }
 
-int RedisModule_OnLoad(RedisModuleCtx *ctx) {
+int RedisModule_OnLoad(RedisModuleCtx *ctx, RedisModuleString **argv,
+  int argc) {
     // Register the module itself
     if (RedisModule_Init(ctx, MODULE_NAME, 1, REDISMODULE_APIVER_1) ==
       REDISMODULE_ERR) {
         return REDISMODULE_ERR;
     }
+    if (parse_module_args(argv, argc) != REDISMODULE_OK) {
+      RedisModule_Log(ctx, "warning", ERR_MSG_INVALID_MODULE_ARGS);
+      return REDISMODULE_ERR;
+    }
+    if (CoalesceMs > 0 && RedisModule_SubscribeToKeyspaceEvents(ctx,
+      REDISMODULE_NOTIFY_GENERIC | REDISMODULE_NOTIFY_STRING |
+      REDISMODULE_NOTIFY_EXPIRED | REDISMODULE_NOTIFY_EVICTED,
+      CellNotified) != REDISMODULE_OK)
+      return REDISMODULE_ERR;
+
+    RedisModuleTypeMethods ring_methods = {
+      .version = REDISMODULE_TYPE_METHOD_VERSION,
+      .rdb_load = CellRingTypeRdbLoad,
+      .rdb_save = CellRingTypeRdbSave,
+      .aof_rewrite = CellRingTypeAofRewrite,
+      .mem_usage = CellRingTypeMemUsage,
+      .free = CellRingTypeFree
+    };
+    CellRingType = RedisModule_CreateDataType(ctx, CELL_RING_TYPE_NAME,
+      CELL_RING_ENCODING_VERSION, &ring_methods);
+    if (CellRingType == NULL)
+      return REDISMODULE_ERR;
+    RedisModuleTypeMethods sketch_methods = {
+      .version = REDISMODULE_TYPE_METHOD_VERSION,
+      .rdb_load = SketchTypeRdbLoad,
+      .rdb_save = SketchTypeRdbSave,
+      .aof_rewrite = SketchTypeAofRewrite,
+      .mem_usage = SketchTypeMemUsage,
+      .free = SketchTypeFree
+    };
+    SketchType = RedisModule_CreateDataType(ctx, SKETCH_TYPE_NAME,
+      SKETCH_ENCODING_VERSION, &sketch_methods);
+    if (SketchType == NULL)
+      return REDISMODULE_ERR;
+    RedisModuleTypeMethods store_methods = {
+      .version = REDISMODULE_TYPE_METHOD_VERSION,
+      .rdb_load = CellStoreTypeRdbLoad,
+      .rdb_save = CellStoreTypeRdbSave,
+      .aof_rewrite = CellStoreTypeAofRewrite,
+      .mem_usage = CellStoreTypeMemUsage,
+      .free = CellStoreTypeFree
+    };
+    CellStoreType = RedisModule_CreateDataType(ctx, CELL_STORE_TYPE_NAME,
+      CELL_STORE_ENCODING_VERSION, &store_methods);
+    if (CellStoreType == NULL)
+      return REDISMODULE_ERR;
 
     // register Commands - using the shortened utility registration macro
-    RMUtil_RegisterReadCmd(ctx, "SchemaLoad",        SchemaLoadCommand);
-    RMUtil_RegisterReadCmd(ctx, "SchemaClean",       SchemaCleanCommand);
+    RMUtil_RegisterWriteCmd(ctx, "SchemaLoad",       SchemaLoadCommand);
+    RMUtil_RegisterWriteCmd(ctx, "SchemaClean",      SchemaCleanCommand);
+    RMUtil_RegisterWriteCmd(ctx, "SchemaADDVALUE",   SchemaAddValueCommand);
+    RMUtil_RegisterWriteCmd(ctx, "SchemaADDDIM",     SchemaAddDimCommand);
     RMUtil_RegisterReadCmd(ctx, "SchemaGet",         SchemaGetCommand);
-    RMUtil_RegisterReadCmd(ctx, "SchemaSet",         SchemaSetCommand);
+    RMUtil_RegisterRoutedWriteCmd(ctx, SCHEMA_SET_CMD, SchemaSetCommand);
     //schema operations
     RMUtil_RegisterReadCmd(ctx, "SchemaSUM",         SchemaSumCommand);
     RMUtil_RegisterReadCmd(ctx, "SchemaAVG",         SchemaAvgCommand);
     RMUtil_RegisterReadCmd(ctx, "SchemaMIN",         SchemaMinCommand);
     RMUtil_RegisterReadCmd(ctx, "SchemaMAX",         SchemaMaxCommand);
-    RMUtil_RegisterReadCmd(ctx, "SchemaCLR",         SchemaClrCommand);
-    RMUtil_RegisterReadCmd(ctx, "SchemaINC",         SchemaIncCommand);
+    RMUtil_RegisterWriteCmd(ctx, "SchemaCLR",        SchemaClrCommand);
+    RMUtil_RegisterWriteCmd(ctx, SCHEMA_INC_CMD,     SchemaIncCommand);
+    RMUtil_RegisterRoutedWriteCmd(ctx, "SchemaADD",  SchemaAddCommand);
+    RMUtil_RegisterReadCmd(ctx, "SchemaDISTINCT",    SchemaDistinctCommand);
+    RMUtil_RegisterReadCmd(ctx, "SchemaFREQ",        SchemaFreqCommand);
+    RMUtil_RegisterReadCmd(ctx, "SchemaHEAVY",       SchemaHeavyCommand);
+    RMUtil_RegisterReadCmd(ctx, "SchemaTOPK",        SchemaTopkCommand);
+    RMUtil_RegisterReadCmd(ctx, "SchemaQUANTILE",    SchemaQuantileCommand);
+    RMUtil_RegisterReadCmd(ctx, "SchemaHIST",        SchemaHistCommand);
+    RMUtil_RegisterReadCmd(ctx, "SchemaPARTIAL",     SchemaPartialCommand);
+    RMUtil_RegisterReadCmd(ctx, "SchemaEVAL",        SchemaEvalCommand);
+    RMUtil_RegisterReadCmd(ctx, "SchemaMEMORY",      SchemaMemoryCommand);
+    RMUtil_RegisterReadCmd(ctx, "SchemaPREPARE",     SchemaPrepareCommand);
+    RMUtil_RegisterReadCmd(ctx, "SchemaEXEC",        SchemaExecCommand);
+    RMUtil_RegisterWriteCmd(ctx, "SchemaEXECWRITE",  SchemaExecWriteCommand);
+    RMUtil_RegisterWriteCmd(ctx, "SchemaIMPORT",     SchemaImportCommand);
+    RMUtil_RegisterReadCmd(ctx, "SchemaEXPORT",      SchemaExportCommand);
+    RMUtil_RegisterKeyWriteCmd(ctx, CELL_RING_RESTORE_CMD, SchemaRingRestoreCommand);
+    RMUtil_RegisterKeyWriteCmd(ctx, SKETCH_RESTORE_CMD, SchemaSketchRestoreCommand);
+    RMUtil_RegisterKeyWriteCmd(ctx, CELL_STORE_RESTORE_CMD, SchemaStoreRestoreCommand);
 
     return REDISMODULE_OK;
 }
@@ -3,74 +3,541 @@
 
 #define MODULE_NAME "redischema"
 
-#define SCHEMA_LOAD_ARGS_LIMIT 2
-#define SCHEMA_LOAD_ARG_LIST 1
+#define SCHEMA_NAME_ARG 1
+#define SCHEMA_CLEAN_ARGS 2
+#define SCHEMA_LOAD_ARGS_LIMIT 3
+#define SCHEMA_ADDVALUE_ARGS_MIN 4
+#define SCHEMA_ADDDIM_ARGS_MIN 3
+#define SCHEMA_EVOLVE_ARG_DIM 2
+#define SCHEMA_EVOLVE_ARG_VALS 3
+#define SCHEMA_LOAD_ARG_LIST 2
+#define SCHEMA_OP_ARGS_WINDOW 5
+#define SCHEMA_OP_ARG_WINDOW 4
+#define SCHEMA_OP_ARGS_APPROX 5
+#define SCHEMA_OP_ARG_APPROX 4
+#define SCHEMA_OP_ARGS_NOW 5
+#define SCHEMA_OP_ARG_NOW 4
+#define SCHEMA_OP_ARGS_ITEM 4
+#define SCHEMA_TOPK_ARGS_MIN 4
+#define SCHEMA_TOPK_ARGS_MAX 5
+#define SCHEMA_TOPK_ARG_ORDER 4
+#define TOPK_INITIAL_CAP 64
+#define SCHEMA_QUANTILE_ARGS_MIN 4
+#define SCHEMA_GROUPBY_ARGS 5
+#define SCHEMA_GROUPBY_ARG_DIM 4
+#define SCHEMA_HIST_ARGS 6
+#define SCHEMA_HIST_ARG_MAX 4
+#define SCHEMA_HIST_ARG_BUCKETS 5
+#define HIST_MAX_BUCKETS 4096
+#define SCHEMA_OPT_ARG 3
+#define SCHEMA_EVAL_ARGS_MIN 6
+#define SCHEMA_EVAL_ARG_EXPR 2
+#define SCHEMA_EVAL_ARG_TERMS 3
+#define SCHEMA_EVAL_TERM_ARGS 3
+#define SCHEMA_MEMORY_ARGS 2
+#define SCHEMA_PREPARE_ARGS_MIN 4
+#define SCHEMA_PREPARE_ARG_CMD 1
+#define SCHEMA_EXEC_ARGS 2
+#define SCHEMA_EXEC_ARG_HANDLE 1
+#define PREPARED_MAX 1024 //handles kept, the least recently run go first
+#define SCHEMA_IMPORT_ARGS_MIN 3
+#define SCHEMA_IMPORT_ARGS_MAX 4
+#define SCHEMA_IMPORT_ARG_PATH 2
+#define SCHEMA_IMPORT_ARG_FORMAT 3
+#define SCHEMA_EXPORT_ARGS_MIN 4
+#define SCHEMA_EXPORT_ARGS_MAX 5
+#define SCHEMA_EXPORT_ARG_FILTER 2
+#define SCHEMA_EXPORT_ARG_PATH 3
+#define SCHEMA_EXPORT_ARG_FORMAT 4
+#define IMPORT_BATCH_CELLS 1000 //cells applied, and replicated, as one SchemaSET
+#define IMPORT_QUEUE_MAX 16 //batches read ahead of the one being applied
+#define IMPORT_POLL_MS 1 //wait for the reader when no batch is ready
+#define FILE_NAME_SELF "."
+#define FILE_NAME_PARENT ".."
+#define ARG_TIMEBUCKETS "TIMEBUCKETS"
+#define ARG_SKETCH "SKETCH"
+#define ARG_HLL "HLL"
+#define ARG_CMS "CMS"
+#define ARG_HASHTAG "HASHTAG"
+#define ARG_NAME "NAME"
+#define ARG_TAG "TAG"
+#define ARG_SPARSE "SPARSE"
+#define ARG_PARENTS "PARENTS"
+#define ARG_GROUPBY "GROUPBY"
+#define ARG_ASC "ASC"
+#define ARG_DESC "DESC"
+#define ARG_WINDOW "WINDOW"
+#define ARG_APPROX "APPROX"
+#define ARG_SUM "SUM"
+#define ARG_AVG "AVG"
+#define ARG_MIN "MIN"
+#define ARG_MAX "MAX"
+#define ARG_NOW "NOW"
+#define ARG_CURSOR "CURSOR"
+#define ARG_COUNT "COUNT"
+#define ARG_WITHVALUES "WITHVALUES"
+#define ARG_WITHCOORDS "WITHCOORDS"
+#define ARG_CSV "CSV"
+#define ARG_BINARY "BINARY"
+#define GET_PAGE_DEFAULT 10
+#define GET_CURSOR_MAX_LEN 21
+#define GET_CURSOR_IDLE_MS 300000
+#define GET_CURSORS_MAX 1024
+#define SLICE_KEYS_DEFAULT 1000 //cells a sweep writes before yielding
+#define SLICE_MICROS_DEFAULT 1000 //time a sweep runs before yielding
+#define SLICE_PERIOD_MS 0 //go on in the next event loop iteration
+#define BACKGROUND_CELLS_DEFAULT 100000 //packed cells worth a thread
+#define BACKGROUND_READS_DEFAULT 4 //threads reading at once, more reads run in place
+#define COALESCE_MS_DEFAULT 0 //increments are written right away
+#define COALESCE_CELLS_MAX 65536 //cells with increments pending, others are written right away
+#define PINNED_KEYS_MAX 1024 //cells a filter fixing every dimension opens by name
+#define PINNED_GLOBS_MAX 1 //each SCAN MATCH pass walks the whole keyspace, one at most
+#define SCAN_CMD "SCAN"
+#define APPROX_SCAN_COUNT "1" //keys a SCAN from a random cursor asks for, the first is sampled
+#define APPROX_SCAN_TRIES 4 //SCANs per sampled cell at most, one may find no key
+#define APPROX_Z 1.96 //of the 95% confidence interval
+#define APPROX_NONE_BOUND 3.0 //rule of three, of the cells that match per cell sampled when none did
+#define APPROX_SAMPLE_MAX_DEFAULT 100000 //cells APPROX samples at most
+#define SCAN_CURSOR_START "0"
+#define SCAN_MATCH_COUNT "1000"
+#define ARG_MATCH "MATCH"
+#define GLOB_SPECIAL_CHARS "*?[]\\"
+#define ARG_SLICE_KEYS "SLICE_KEYS"
+#define ARG_SLICE_MICROS "SLICE_MICROS"
+#define ARG_BACKGROUND_CELLS "BACKGROUND_CELLS"
+#define ARG_BACKGROUND_READS "BACKGROUND_READS"
+#define ARG_COALESCE_MS "COALESCE_MS"
+#define ARG_APPROX_SAMPLE_MAX "APPROX_SAMPLE_MAX"
+#define ARG_FILE_DIR "FILE_DIR"
+#define SCHEMA_SET_CMD "SchemaSet"
+#define SCHEMA_INC_CMD "SchemaINC"
+#define REPLICATE_NOW_FMT "sscl"
+#define REPLICATE_RING_FMT "clllc"
+#define REPLICATE_BATCH_FMT "cc"
+#define REPLICATE_BATCH_NOW_FMT "cccl"
+
+#define PRED_GT "gt"
+#define PRED_GTE "gte"
+#define PRED_LT "lt"
+#define PRED_LTE "lte"
+#define PRED_NOT "not"
 
 #define REDIS_HIERARCHY_DELIM ":"
-#define SCHEMA_KEY_SET "module:schema:order"
-#define SCHEMA_KEY_PREFIX "module:schema:keys:"
+#define SCHEMA_META_PREFIX "module:schema:"
+#define SCHEMA_KEY_SET ":order"
+#define SCHEMA_KEY_PREFIX ":keys:"
+#define SCHEMA_OPTIONS_KEY ":options"
+#define SCHEMA_PARENTS_PREFIX ":parents:"
+#define SCHEMA_ROLLUP_KEY ":rollup"
+#define SCHEMA_VERSION_KEY "version"
+#define SCHEMA_STORE_KEY "cells"
+#define SCHEMA_NAME_CHARS "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-."
+#define SCHEMA_RESERVED_NAME "module"
+#define EVAL_NAME_CHARS "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_"
+#define OPT_BUCKET_RESOLUTION "bucket_resolution"
+#define OPT_BUCKET_COUNT "bucket_count"
+#define OPT_SKETCH "sketch"
+#define OPT_HASHTAG "hashtag"
+#define OPT_SPARSE "sparse"
+#define HASHTAG_OPEN '{'
+#define HASHTAG_NONE 0
+#define HASHTAG_NAME -1 //cells and metadata hash by the schema name
+#define HASHTAG_CLOSE '}'
+#define CELL_RING_TYPE_NAME "schemring"
+#define CELL_RING_ENCODING_VERSION 0
+#define CELL_RING_MAX_BUCKETS 65536
+#define CELL_RING_RESTORE_CMD "SchemaRingRestore"
+#define CELL_RING_RESTORE_ARGS 6
+#define CELL_RING_BUCKET_DELIM ","
+#define CELL_RING_BUCKET_MAX_LEN 21
+#define SKETCH_TYPE_NAME "schsketch"
+#define SKETCH_ENCODING_VERSION 0
+#define SKETCH_RESTORE_CMD "SchemaSketchRestore"
+#define SKETCH_RESTORE_ARGS 3
+#define CELL_STORE_TYPE_NAME "schcellst"
+#define CELL_STORE_ENCODING_VERSION 0
+#define CELL_STORE_RESTORE_CMD "SchemaStoreRestore"
+#define CELL_STORE_RESTORE_ARGS 3
+#define MEM_KEY_OVERHEAD 48 //dict entry, key sds header and value object
+#define MEM_SDS_OVERHEAD 4 //header and terminator of a string value
+#define MEM_LISTPACK_OVERHEAD 16 //header of a small zset or hash
+#define MEM_ZSET_ENTRY_OVERHEAD 12 //encodings of a small zset member and score
+#define MEM_HASH_FIELD_BYTES 32 //an option field and its value
+#define MEM_REPLY_FIELDS 12
+#define ROLLUP_INTS 1 //the parent sums of integer cells
+#define ROLLUP_DOUBLES 2 //the parent sums of the other cells
+#define ROLLUP_DOUBLE_COUNT 3 //how many of those there are
+#define ROLLUP_KINDS 3
+#define ROLLUP_COMPLETE 0 //coordinate of the cell kept while the sums cover every cell
+#define MS_IN_SEC 1000
 #define OK_STR "OK"
-#define ZRANGE_CMD "ZRANGE"
-#define ZRANGE_FMT "cll"
-#define ZRANK_CMD "ZRANK"
-#define ZRANK_FMT "cc"
-#define ZCOUNT_CMD "ZCOUNT"
-#define ZCOUNT_FMT "cll"
-#define KEYS_CMD "keys"
-#define KEYS_FMT "c"
-#define ALL_KEYS "*"
-#define INCR_CMD "INCR"
-#define INCR_FMT "c"
-#define GET_CMD "GET"
-#define GET_FMT "c"
+#define CELL_VALUE_MAX_LEN 128
 #define RM_CreateString(ctx, str) RedisModule_CreateString(ctx,str,strlen(str))
 
 #define MODULE_ERROR -1
 #define ERR_MSG_NO_MEM "parse error - insufficient memory"
-#define ERR_MSG_TOO_MANY_KEYS "the query has too many keys"
 #define ERR_MSG_SINGLE_VALUE "key is expected to have a single value"
 #define ERR_MSG_GENERAL_ERROR "a general error has occured"
 #define ERR_MSG_INVALID_INPUT "json input is invalid"
 #define ERR_MSG_NOMEM "not enough tokens provided"
 #define ERR_MSG_MEMBER_NOT_FOUND "key or value not found in schema"
+#define ERR_MSG_INVALID_PREDICATE "filter predicates are gt, gte, lt, lte with a single value and not"
+#define ERR_MSG_NOT_A_NUMBER "cell value is not a number"
+#define ERR_MSG_INVALID_OPTIONS "schema options are TIMEBUCKETS <resolution> <retention>, SKETCH HLL|CMS, HASHTAG <dimension>|NAME, SPARSE and PARENTS <json>"
+#define ERR_MSG_INVALID_PARENTS "PARENTS maps a dimension to {\"<parent>\": [<children>]}, children are values or parents with a single parent and parents are not values"
+#define ERR_MSG_INVALID_WINDOW "window must be a positive number of seconds"
+#define ERR_MSG_INVALID_APPROX "APPROX takes a fraction of the cells below 1 or a count of cells to sample, with SchemaSUM and SchemaAVG"
+#define ERR_MSG_INVALID_NOW "NOW expects a positive time in milliseconds"
+#define ERR_MSG_INVALID_GET "SchemaGET options are CURSOR <cursor>, COUNT <positive count>, WITHVALUES and WITHCOORDS"
+#define ERR_MSG_UNKNOWN_CURSOR "cursor is unknown or expired"
+#define ERR_MSG_INVALID_RING "invalid time bucket ring"
+#define ERR_MSG_INVALID_SKETCH "invalid sketch"
+#define ERR_MSG_INVALID_STORE "invalid cell store"
+#define ERR_MSG_STORE_FULL "sparse schema needs more than 64 bits per cell"
+#define ERR_MSG_NO_SKETCH "schema cells do not hold sketches"
+#define ERR_MSG_INVALID_TOPK "top-k expects a positive count and ASC or DESC"
+#define ERR_MSG_INVALID_QUANTILE "quantiles must be numbers between 0 and 1"
+#define ERR_MSG_INVALID_HIST "histogram expects min < max and a positive bucket count"
+#define ERR_MSG_CROSS_TAG "cells written together must share the value of the HASHTAG dimension, the one TAG names"
+#define ERR_MSG_INVALID_TAG "TAG <value> routes writes of a schema tagged by a dimension, and cluster nodes need it"
+#define ERR_MSG_INVALID_GROUPBY "expected GROUPBY <dimension>"
+#define ERR_MSG_INVALID_EVAL "SchemaEVAL terms are <name> SUM|AVG|MIN|MAX|COUNT <filter>, names are unique identifiers"
+#define ERR_MSG_INVALID_PREPARE "SchemaPREPARE takes a SchemaGET, SUM, AVG, MIN, MAX, CLR, INC, DISTINCT, FREQ, HEAVY, TOPK, QUANTILE, HIST or PARTIAL command"
+#define ERR_MSG_UNKNOWN_PREPARED "prepared query is unknown or was dropped, prepare it again"
+#define ERR_MSG_PREPARED_WRITE "prepared writes run on a writable master"
+#define ERR_MSG_PREPARED_READONLY "SchemaEXEC runs prepared reads, prepared writes run by SchemaEXECWRITE"
+#define ERR_MSG_INVALID_EXPR "expression must be arithmetic over numbers and term names"
+#define ERR_MSG_INVALID_MODULE_ARGS "module arguments are SLICE_KEYS <count>, SLICE_MICROS <microseconds> and BACKGROUND_CELLS <count>, 0 for no bound, BACKGROUND_READS <count>, 0 to read in place, and COALESCE_MS <milliseconds>, 0 to write increments right away, APPROX_SAMPLE_MAX <count>, 0 for no bound, and FILE_DIR <directory> for SchemaIMPORT and SchemaEXPORT files"
+#define ERR_MSG_INVALID_SCHEMA_NAME "schema names are made of letters, digits, '_', '-' and '.'"
+#define ERR_MSG_NO_SCHEMA "schema not found"
+#define ERR_MSG_DIM_EXISTS "dimension already exists in schema"
+#define ERR_MSG_WRONG_CELL_TYPE "cell holds a different kind of value"
+#define ERR_MSG_INVALID_FILE "files are CSV or BINARY, named without a directory, within the directory the FILE_DIR module argument sets"
+#define ERR_MSG_FILE_READ "file can not be read or holds a malformed cell"
+#define ERR_MSG_FILE_WRITE "file already exists or can not be written"
+#define ERR_MSG_DELTAS_PENDING "increments are pending and the server takes no writes to flush them, it is a read only replica or out of memory"
 #define NO_KEYS_MATCHED "no keys matched the given filter"
 #define SCHEMA_SET_OK_STR "schema values loaded"
+#define SCHEMA_ADD_OK_STR "schema items added"
 
 typedef enum { PARSER_INIT, PARSER_KEY, PARSER_VAL, PARSER_DONE, PARSER_ERR } PARSER_STAGE;
 typedef enum { OP_INIT, OP_MID, OP_DONE, OP_ERR } OP_STAGE;
 typedef enum { false, true } bool;
-typedef enum { S_OP_SUM, S_OP_AVG, S_OP_MIN, S_OP_MAX, S_OP_CLR, S_OP_INC, S_OP_GET, S_OP_SET } SCHEMA_OP;
+typedef enum { S_OP_SUM, S_OP_AVG, S_OP_MIN, S_OP_MAX, S_OP_CLR, S_OP_INC, S_OP_GET, S_OP_SET,
+  S_OP_ADD, S_OP_DISTINCT, S_OP_FREQ, S_OP_HEAVY, S_OP_TOPK,
+  S_OP_QUANTILE, S_OP_HIST, S_OP_PARTIAL, S_OP_EVAL, S_OP_ROLLUP, S_OP_EXPORT } SCHEMA_OP;
+typedef enum { EVAL_SUM, EVAL_AVG, EVAL_MIN, EVAL_MAX, EVAL_COUNT } EVAL_AGG;
 typedef struct PARSER_STATE PARSER_STATE; //forward declaration
 typedef int (*parser_handler)(RedisModuleCtx*, PARSER_STATE*);
 typedef const char *C_CHARS;
-typedef char* schema_elem_t;
 typedef struct Query {
-  schema_elem_t **key_set;
+  struct schema *schema;
+  unsigned char **masks; //per dimension, which ordinals (rank + 1) pass, NULL when any does
+  unsigned char **groups; //per dimension, which parents the filter named, NULL when none
   size_t key_set_size;
-  size_t *val_sizes;
+  int hashtag; //as in SCHEMA_OPTIONS, which key segment is wrapped in {}
+  bool partial_keys; //keys may stop short of the last dimension
 } Query;
+typedef struct schema_options {
+  long long bucket_resolution; //ms, cells are plain counters when 0
+  long long bucket_count;
+  SKETCH_TYPE sketch; //kind of sketch held by each cell, if any
+  int hashtag; //HASHTAG_NONE, HASHTAG_NAME or 1 + the rank of the dimension wrapped in {}
+  bool sparse; //cells are packed into a single CELL_STORE
+  long long now; //ms, the clock of the current command's bucketed writes
+} SCHEMA_OPTIONS;
+typedef struct schema_dim {
+  char *name;
+  char **vals; //in schema order, a value's index is its rank
+  size_t *by_name; //ranks sorted by value, for lookups
+  size_t val_count;
+  int *val_parents; //per rank, index into groups, -1 for a value at the top
+  char **groups; //the parents named by PARENTS, at any level
+  int *group_parents; //per group, index of its own parent or -1
+  size_t group_count;
+} SCHEMA_DIM;
+typedef struct schema {
+  char *name;
+  long long version; //metadata of each version lives under its own keys
+  int refs; //the registry and every command using it hold one
+  char *prefix; //"<name>:", every cell of the schema lives under it
+  char *version_key; //holds the published version
+  char *order_key; //zset of dimensions
+  char *keys_prefix; //followed by a dimension, zset of its values
+  char *options_key;
+  char *store_key; //CELL_STORE of a sparse schema, shared by all versions
+  char *parents_prefix; //followed by a dimension, zset of "<child>:<parent>"
+  char *rollup_key; //CELL_STORE of the sums at the parent levels
+  SCHEMA_DIM *dims;
+  size_t dim_count;
+  SCHEMA_OPTIONS options;
+  unsigned long long changes; //SchemaADDVALUE and SchemaADDDIM grow it in place
+  struct schema *next;
+} SCHEMA;
 typedef struct PARSER_STATE {
   const char *input;
   jsmntok_t *key;
   int key_ord;
   jsmntok_t *val;
   int val_ord;
+  jsmntok_t *pred; //the operator while walking {"gte": "medium"}
+  bool predicates; //filters may compare values instead of listing them
   int schema_key_ord; //this field is used in operation parser, remembers the current elem ord in schema
   bool single_value; //this field is used in parse_next_token, false if vale is in an array
   Query query;
+  SCHEMA_OPTIONS options;
+  SCHEMA *schema;
+  char *tag; //value of the HASHTAG dimension every cell written must have
   parser_handler handler;
   PARSER_STAGE stage;
   const char *err_msg;
 } PARSER_STATE;
+typedef enum { CELL_OK, CELL_MISSING, CELL_NAN } CELL_STATUS;
+typedef struct cell_value {
+  bool is_int; //ival holds the value when true, dval otherwise
+  long long ival;
+  double dval;
+} CELL_VALUE;
+typedef struct aggregate {
+  size_t count;
+  bool is_int; //false once a double was seen or the integer sum overflowed
+  long long isum;
+  double dsum; //compensated (Neumaier) sum, used once is_int is false
+  double dcomp;
+  CELL_VALUE min;
+  CELL_VALUE max;
+} AGGREGATE;
+typedef struct group_entry {
+  char *group;
+  AGGREGATE agg;
+} GROUP_ENTRY;
+typedef struct topk_entry {
+  char *key;
+  CELL_VALUE val;
+} TOPK_ENTRY;
+typedef struct eval_term {
+  char *name;
+  EVAL_AGG agg;
+  Query query;
+} EVAL_TERM;
+/* SchemaEVAL folds every term in one pass over the cells
+*/
+typedef struct eval_state {
+  EVAL_TERM *terms;
+  size_t term_count;
+  EXPR *expr;
+  uint32_t *ords; //the ordinals of the cell being folded
+  size_t group_count; //1, or the values of the GROUPBY dimension + 1
+  AGGREGATE *aggs; //term_count per group, by ordinal of the group value
+} EVAL_STATE;
+/* APPROX reads a sample of every cell in the population, those the filter
+   does not match count as 0 towards the sum
+*/
+typedef struct approx_sample {
+  size_t count;
+  double mean; //of the sampled values, running
+  double m2; //squared deviations from mean, running
+  size_t matched;
+  double matched_mean;
+  double matched_m2;
+} APPROX_SAMPLE;
+typedef struct get_entry {
+  char *key;
+  CELL_VALUE val;
+  CELL_STATUS status; //of val, read for WITHVALUES only
+} GET_ENTRY;
+/* where a paged SchemaGET over plain keys stopped: the keyspace scan and
+   the matches its last batch found past the end of the page
+*/
+typedef struct key_cursor {
+  unsigned long long id;
+  char *schema;
+  RedisModuleScanCursor *scan;
+  char **pending;
+  size_t pending_len;
+  size_t pending_cap;
+  long long last_used;
+  struct key_cursor *next;
+} KEY_CURSOR;
+/* a command whose filter SchemaPREPARE parsed once. SchemaEXEC, or
+   SchemaEXECWRITE for a write, runs it on a copy of the query, parsed again first when the schema changed
+*/
+typedef struct prepared {
+  unsigned long long id;
+  RedisModuleString **argv; //the command prepared, its name first
+  int argc;
+  SCHEMA_OP op;
+  SCHEMA *schema; //retained, the one query was parsed against
+  unsigned long long changes; //schema->changes then
+  Query query;
+  struct prepared *next;
+} PREPARED;
+typedef struct op_command {
+  C_CHARS name;
+  SCHEMA_OP op;
+} OP_COMMAND;
+/* bytes a schema takes, as SchemaMEMORY reports them. the redis side is
+   estimated from the encodings of small keys, modules can not ask the
+   allocator
+*/
+typedef struct mem_state {
+  C_CHARS prefix;
+  size_t prefix_len;
+  size_t cell_count;
+  size_t cells; //the cells in the layout they are in
+  size_t metadata; //version, dimension, option and parent keys, parent sums
+  size_t compiled; //the copy get_schema caches
+  size_t indexes; //by_name and parent links of each compiled dimension
+  size_t cursors; //SchemaGET cursors left open on the schema
+  size_t prepared; //SchemaPREPARE handles on the schema
+  long long alt_cells; //the cells in the other layout, -1 if they do not fit it
+} MEM_STATE;
 typedef struct op_state {
   OP_STAGE stage;
   SCHEMA_OP op;
   size_t match_count;
-  float aggregate;
+  size_t value_count; //cells folded into the aggregate
+  AGGREGATE agg;
+  long long window; //ms of time buckets to aggregate, 0 for the whole ring
+  double approx; //cells to sample, a fraction of them below 1, 0 for all
+  SCHEMA *schema;
+  SCHEMA_OPTIONS options;
+  SKETCH *sketch; //merge of the sketches of all matching cells
+  CELL_STORE *store; //set while scanning a sparse schema
+  size_t cell; //index of the matched cell in store
+  RedisModuleKey *scan_key; //the matched cell as opened by the keyspace scan
+  const char *item; //the item looked up by S_OP_FREQ
+  size_t item_len;
+  TOPK_ENTRY *topk; //heap rooted at the entry to evict first
+  size_t topk_len;
+  size_t topk_cap;
+  long long k;
+  bool ascending;
+  TDIGEST *digest; //S_OP_QUANTILE streams values into it
+  double *quantiles;
+  size_t quantile_count;
+  long long *hist; //underflow, hist_buckets buckets, overflow
+  long long hist_buckets;
+  double hist_min;
+  double hist_max;
+  bool grouped; //S_OP_PARTIAL keeps a partial per value of group_ord
+  int group_ord;
+  GROUP_ENTRY *groups;
+  size_t group_len;
+  size_t group_cap;
+  EVAL_STATE *eval; //S_OP_EVAL
+  bool paged; //SchemaGET replies with one page and a cursor
+  unsigned long long cursor; //where the page starts, then where the next does
+  long long page_size;
+  bool with_values;
+  bool with_coords;
+  GET_ENTRY *page;
+  size_t page_len;
+  size_t page_cap;
+  bool prepared; //run by SchemaEXEC, replicates as the command prepared
+  bool coalesce; //SchemaINC leaves its increments in PendingDeltas
+  const char *err_msg;
 } OP_STATE;
 
+typedef struct scan_state {
+  Query *query;
+  OP_STATE *state;
+  C_CHARS prefix;
+  size_t prefix_len;
+  KEY_CURSOR *cursor; //set when paging
+  struct sweep *sweep; //set when the scan runs in slices
+} SCAN_STATE;
+
+/* a SchemaINC or SchemaCLR over plain keys that outgrew its first slice.
+   it goes on from a timer while its client stays blocked, on a private
+   copy of the schema
+*/
+typedef struct sweep {
+  RedisModuleBlockedClient *bc;
+  OP_STATE state;
+  Query query;
+  SCAN_STATE scan;
+  RedisModuleScanCursor *cursor;
+  char **written; //cells the first slice wrote, replicated once it blocks
+  size_t written_len;
+  size_t written_cap;
+  DELTA_BUF *seen; //cells matched so far, SCAN may return a key twice
+  bool blocked; //cells are replicated as they are written
+} SWEEP;
+
+/* an aggregate over a sparse schema read off the main thread, from a
+   snapshot of the cells and a private copy of the schema
+*/
+typedef struct snapshot_read {
+  RedisModuleBlockedClient *bc;
+  OP_STATE state;
+  Query query;
+  CELL_STORE *store;
+} SNAPSHOT_READ;
+
+/* cells SchemaIMPORT read as the json of a SchemaSET
+*/
+typedef struct import_batch {
+  char *cells;
+  size_t len; //of the json, the closing brace left out
+  size_t cap;
+  size_t count;
+  struct import_batch *next;
+} IMPORT_BATCH;
+
+/* a thread reads the file into batches while timers apply them, in the
+   context of the blocked client. the reader stays at most
+   IMPORT_QUEUE_MAX batches ahead
+*/
+typedef struct import {
+  RedisModuleBlockedClient *bc;
+  char *name;
+  CELL_FILE *file;
+  int tag_dim; //a batch holds the cells of one value of it, -1 for any
+  CELL_RECORD held; //read past the end of the last batch
+  bool has_held;
+  pthread_mutex_t lock;
+  pthread_cond_t drained;
+  IMPORT_BATCH *head;
+  IMPORT_BATCH *tail;
+  size_t queued;
+  bool read; //the reader is done with the file and the import
+  bool stop; //a batch failed, the reader drops the rest
+  const char *err_msg;
+  long long imported;
+} IMPORT;
+
+/* the cells a SchemaEXPORT matched, written to the file off the main
+   thread
+*/
+typedef struct export {
+  RedisModuleBlockedClient *bc;
+  char *path;
+  int format;
+  CELL_RECORD *records;
+  size_t len;
+  int rsp;
+} EXPORT;
+
+//schema commands take a json filter rather than key names, so they declare
+//no keys and cluster nodes run them against their local cells.
+//they scan every cell of a schema, so none of them is "fast"
 #define RMUtil_RegisterReadCmd(ctx, cmd, f) \
-    if (RedisModule_CreateCommand(ctx, cmd, f, "readonly fast allow-loading allow-stale", \
+    if (RedisModule_CreateCommand(ctx, cmd, f, "readonly allow-loading allow-stale", \
+        0, 0, 0) == REDISMODULE_ERR) return REDISMODULE_ERR;
+
+#define RMUtil_RegisterWriteCmd(ctx, cmd, f) \
+    if (RedisModule_CreateCommand(ctx, cmd, f, "write deny-oom", \
+        0, 0, 0) == REDISMODULE_ERR) return REDISMODULE_ERR;
+
+//cell writes name the key cluster nodes route them by, see route_cell_write
+#define RMUtil_RegisterRoutedWriteCmd(ctx, cmd, f) \
+    if (RedisModule_CreateCommand(ctx, cmd, f, "write deny-oom getkeys-api", \
+        0, 0, 0) == REDISMODULE_ERR) return REDISMODULE_ERR;
+
+//restore commands name the key they recreate
+#define RMUtil_RegisterKeyWriteCmd(ctx, cmd, f) \
+    if (RedisModule_CreateCommand(ctx, cmd, f, "write deny-oom", \
         1, 1, 1) == REDISMODULE_ERR) return REDISMODULE_ERR;
 
 #endif /* REDISCHEMA_H */
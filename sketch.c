@@ -0,0 +1,290 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "sketch.h"
+
+/* MurmurHash2, 64-bit versions, by Austin Appleby
+*/
+static uint64_t murmur_hash64(const void *key, size_t len, uint64_t seed) {
+  const uint64_t m = 0xc6a4a7935bd1e995ULL;
+  const int r = 47;
+  uint64_t h = seed ^ (len * m);
+  const uint8_t *data = key;
+  const uint8_t *end = data + (len - (len & 7));
+  while(data != end) {
+    uint64_t k;
+    memcpy(&k, data, sizeof(k));
+    k *= m; k ^= k >> r; k *= m;
+    h ^= k; h *= m;
+    data += 8;
+  }
+  switch(len & 7) {
+    case 7: h ^= (uint64_t)data[6] << 48;
+    case 6: h ^= (uint64_t)data[5] << 40;
+    case 5: h ^= (uint64_t)data[4] << 32;
+    case 4: h ^= (uint64_t)data[3] << 24;
+    case 3: h ^= (uint64_t)data[2] << 16;
+    case 2: h ^= (uint64_t)data[1] << 8;
+    case 1: h ^= (uint64_t)data[0];
+            h *= m;
+  }
+  h ^= h >> r; h *= m; h ^= h >> r;
+  return h;
+}
+
+static size_t cms_index(uint64_t hash, int row) {
+  uint32_t h1 = hash, h2 = hash >> 32;
+  return row * SKETCH_CMS_WIDTH + (h1 + row * h2) % SKETCH_CMS_WIDTH;
+}
+
+SKETCH *sketch_new(SKETCH_TYPE type) {
+  SKETCH *sketch = calloc(1, sizeof(SKETCH));
+  if(sketch == NULL)
+    return NULL;
+  sketch->type = type;
+  if(type == SKETCH_HLL)
+    sketch->registers = calloc(SKETCH_HLL_REGISTERS, sizeof(uint8_t));
+  else if(type == SKETCH_CMS) {
+    sketch->counters = calloc(SKETCH_CMS_DEPTH * SKETCH_CMS_WIDTH,
+      sizeof(uint64_t));
+    sketch->top_cap = SKETCH_MERGE_TOP_SIZE;
+    sketch->top = calloc(sketch->top_cap, sizeof(SKETCH_ITEM));
+  }
+  if((type == SKETCH_HLL && sketch->registers == NULL) ||
+    (type == SKETCH_CMS && (sketch->counters == NULL || sketch->top == NULL)) ||
+    type == SKETCH_NONE) {
+    sketch_free(sketch);
+    return NULL;
+  }
+  return sketch;
+}
+
+void sketch_free(SKETCH *sketch) {
+  if(sketch == NULL)
+    return;
+  for(size_t i=0; i < sketch->top_len; ++i)
+    free(sketch->top[i].item);
+  free(sketch->top);
+  free(sketch->counters);
+  free(sketch->registers);
+  free(sketch);
+}
+
+size_t sketch_mem_usage(const SKETCH *sketch) {
+  size_t bytes = sizeof(SKETCH) + sketch->top_cap * sizeof(SKETCH_ITEM);
+  if(sketch->registers != NULL)
+    bytes += SKETCH_HLL_REGISTERS * sizeof(uint8_t);
+  if(sketch->counters != NULL)
+    bytes += SKETCH_CMS_DEPTH * SKETCH_CMS_WIDTH * sizeof(uint64_t);
+  for(size_t i=0; i < sketch->top_len; ++i)
+    bytes += sketch->top[i].len + 1;
+  return bytes;
+}
+
+static void hll_add_hash(SKETCH *sketch, uint64_t hash) {
+  size_t index = hash & (SKETCH_HLL_REGISTERS - 1);
+  uint64_t rest = hash >> SKETCH_HLL_BITS;
+  uint8_t rank = 1;
+  while(rank <= 64 - SKETCH_HLL_BITS && (rest & 1) == 0) {
+    rank++;
+    rest >>= 1;
+  }
+  if(rank > sketch->registers[index])
+    sketch->registers[index] = rank;
+}
+
+static uint64_t cms_estimate(const SKETCH *sketch, uint64_t hash) {
+  uint64_t min = UINT64_MAX;
+  for(int row=0; row < SKETCH_CMS_DEPTH; ++row) {
+    uint64_t c = sketch->counters[cms_index(hash, row)];
+    if(c < min)
+      min = c;
+  }
+  return min;
+}
+
+static SKETCH_ITEM *find_candidate(SKETCH *sketch, const char *item,
+  size_t len) {
+  for(size_t i=0; i < sketch->top_len; ++i) {
+    if(sketch->top[i].len == len && memcmp(sketch->top[i].item, item, len)==0)
+      return &sketch->top[i];
+  }
+  return NULL;
+}
+
+/* keeps item as a candidate if there is room or it beats the lightest one
+*/
+static void offer_candidate(SKETCH *sketch, size_t limit, const char *item,
+  size_t len, uint64_t count) {
+  SKETCH_ITEM *cand = find_candidate(sketch, item, len);
+  if(cand != NULL) {
+    cand->count = count;
+    return;
+  }
+  if(sketch->top_len < limit) {
+    cand = &sketch->top[sketch->top_len++];
+  }
+  else {
+    cand = &sketch->top[0];
+    for(size_t i=1; i < sketch->top_len; ++i) {
+      if(sketch->top[i].count < cand->count)
+        cand = &sketch->top[i];
+    }
+    if(cand->count >= count)
+      return;
+    free(cand->item);
+  }
+  cand->item = malloc(len + 1);
+  memcpy(cand->item, item, len);
+  cand->item[len] = '\0';
+  cand->len = len;
+  cand->count = count;
+}
+
+void sketch_add(SKETCH *sketch, const char *item, size_t len) {
+  uint64_t hash = murmur_hash64(item, len, 0xadc83b19ULL);
+  sketch->total++;
+  if(sketch->type == SKETCH_HLL) {
+    hll_add_hash(sketch, hash);
+    return;
+  }
+  for(int row=0; row < SKETCH_CMS_DEPTH; ++row)
+    sketch->counters[cms_index(hash, row)]++;
+  offer_candidate(sketch, SKETCH_TOP_SIZE, item, len,
+    cms_estimate(sketch, hash));
+}
+
+int sketch_merge(SKETCH *dst, const SKETCH *src) {
+  if(dst->type != src->type)
+    return -1;
+  dst->total += src->total;
+  if(dst->type == SKETCH_HLL) {
+    for(size_t i=0; i < SKETCH_HLL_REGISTERS; ++i) {
+      if(src->registers[i] > dst->registers[i])
+        dst->registers[i] = src->registers[i];
+    }
+    return 0;
+  }
+  for(size_t i=0; i < SKETCH_CMS_DEPTH * SKETCH_CMS_WIDTH; ++i)
+    dst->counters[i] += src->counters[i];
+  //estimates are refreshed against the merged counters, the bound keeps the
+  //candidate list from growing with the number of merged cells
+  for(size_t i=0; i < src->top_len; ++i) {
+    SKETCH_ITEM *cand = &src->top[i];
+    uint64_t hash = murmur_hash64(cand->item, cand->len, 0xadc83b19ULL);
+    offer_candidate(dst, dst->top_cap, cand->item, cand->len,
+      cms_estimate(dst, hash));
+  }
+  return 0;
+}
+
+static uint64_t hll_estimate(const SKETCH *sketch) {
+  double m = SKETCH_HLL_REGISTERS, sum = 0;
+  int zeros = 0;
+  for(size_t i=0; i < SKETCH_HLL_REGISTERS; ++i) {
+    sum += ldexp(1.0, -sketch->registers[i]);
+    if(sketch->registers[i] == 0)
+      zeros++;
+  }
+  double estimate = (0.7213 / (1 + 1.079 / m)) * m * m / sum;
+  if(estimate <= 2.5 * m && zeros > 0)
+    estimate = m * log(m / zeros); //linear counting for small cardinalities
+  return (uint64_t)(estimate + 0.5);
+}
+
+uint64_t sketch_count(const SKETCH *sketch) {
+  return (sketch->type == SKETCH_HLL)? hll_estimate(sketch) : sketch->total;
+}
+
+uint64_t sketch_frequency(const SKETCH *sketch, const char *item, size_t len) {
+  if(sketch->type != SKETCH_CMS)
+    return 0;
+  return cms_estimate(sketch, murmur_hash64(item, len, 0xadc83b19ULL));
+}
+
+static int compare_items_desc(const void *a, const void *b) {
+  const SKETCH_ITEM *ia = a, *ib = b;
+  return (ia->count < ib->count) - (ia->count > ib->count);
+}
+
+size_t sketch_top(SKETCH *sketch) {
+  if(sketch->type != SKETCH_CMS)
+    return 0;
+  for(size_t i=0; i < sketch->top_len; ++i)
+    sketch->top[i].count = sketch_frequency(sketch, sketch->top[i].item,
+      sketch->top[i].len);
+  qsort(sketch->top, sketch->top_len, sizeof(SKETCH_ITEM), compare_items_desc);
+  return (sketch->top_len < SKETCH_TOP_SIZE)? sketch->top_len : SKETCH_TOP_SIZE;
+}
+
+/* layout: version, type, total, registers or counters, then for CMS the
+   candidate count followed by (len, bytes, count) per candidate
+*/
+char *sketch_serialize(const SKETCH *sketch, size_t *len) {
+  size_t body = (sketch->type == SKETCH_HLL)? SKETCH_HLL_REGISTERS :
+    SKETCH_CMS_DEPTH * SKETCH_CMS_WIDTH * sizeof(uint64_t);
+  size_t size = 2 + sizeof(uint64_t) + body + sizeof(uint64_t);
+  for(size_t i=0; i < sketch->top_len; ++i)
+    size += 2 * sizeof(uint64_t) + sketch->top[i].len;
+  char *buf = malloc(size), *pos = buf;
+  if(buf == NULL)
+    return NULL;
+  uint64_t top_len = sketch->top_len;
+  *pos++ = SKETCH_SERIAL_VERSION;
+  *pos++ = sketch->type;
+  memcpy(pos, &sketch->total, sizeof(uint64_t)); pos += sizeof(uint64_t);
+  memcpy(pos, (sketch->type == SKETCH_HLL)? (void*)sketch->registers :
+    (void*)sketch->counters, body);
+  pos += body;
+  memcpy(pos, &top_len, sizeof(uint64_t)); pos += sizeof(uint64_t);
+  for(size_t i=0; i < sketch->top_len; ++i) {
+    uint64_t item_len = sketch->top[i].len;
+    memcpy(pos, &item_len, sizeof(uint64_t)); pos += sizeof(uint64_t);
+    memcpy(pos, sketch->top[i].item, item_len); pos += item_len;
+    memcpy(pos, &sketch->top[i].count, sizeof(uint64_t));
+    pos += sizeof(uint64_t);
+  }
+  *len = size;
+  return buf;
+}
+
+SKETCH *sketch_deserialize(const char *buf, size_t len) {
+  const char *pos = buf, *end = buf + len;
+  if(len < 2 + 2 * sizeof(uint64_t) || buf[0] != SKETCH_SERIAL_VERSION ||
+    (buf[1] != SKETCH_HLL && buf[1] != SKETCH_CMS))
+    return NULL;
+  SKETCH *sketch = sketch_new(buf[1]);
+  if(sketch == NULL)
+    return NULL;
+  size_t body = (sketch->type == SKETCH_HLL)? SKETCH_HLL_REGISTERS :
+    SKETCH_CMS_DEPTH * SKETCH_CMS_WIDTH * sizeof(uint64_t);
+  uint64_t top_len;
+  pos += 2;
+  if(end - pos < sizeof(uint64_t) * 2 + body)
+    goto corrupt;
+  memcpy(&sketch->total, pos, sizeof(uint64_t)); pos += sizeof(uint64_t);
+  memcpy((sketch->type == SKETCH_HLL)? (void*)sketch->registers :
+    (void*)sketch->counters, pos, body);
+  pos += body;
+  memcpy(&top_len, pos, sizeof(uint64_t)); pos += sizeof(uint64_t);
+  if(top_len > sketch->top_cap)
+    goto corrupt;
+  for(size_t i=0; i < top_len; ++i) {
+    uint64_t item_len;
+    if(end - pos < sizeof(uint64_t))
+      goto corrupt;
+    memcpy(&item_len, pos, sizeof(uint64_t)); pos += sizeof(uint64_t);
+    if(end - pos < item_len + sizeof(uint64_t))
+      goto corrupt;
+    SKETCH_ITEM *cand = &sketch->top[sketch->top_len++];
+    cand->item = malloc(item_len + 1);
+    memcpy(cand->item, pos, item_len); pos += item_len;
+    cand->item[item_len] = '\0';
+    cand->len = item_len;
+    memcpy(&cand->count, pos, sizeof(uint64_t)); pos += sizeof(uint64_t);
+  }
+  return sketch;
+  corrupt:
+  sketch_free(sketch);
+  return NULL;
+}
@@ -0,0 +1,61 @@
+#ifndef SKETCH_H
+#define SKETCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SKETCH_HLL_BITS 12
+#define SKETCH_HLL_REGISTERS (1 << SKETCH_HLL_BITS)
+#define SKETCH_CMS_DEPTH 4
+#define SKETCH_CMS_WIDTH 512
+#define SKETCH_TOP_SIZE 16 //heavy hitter candidates kept per cell
+#define SKETCH_MERGE_TOP_SIZE (SKETCH_TOP_SIZE * 4)
+#define SKETCH_SERIAL_VERSION 1
+
+/* HLL counts distinct items, CMS counts item frequencies and keeps the
+   items that look heaviest as heavy hitter candidates
+*/
+typedef enum { SKETCH_NONE, SKETCH_HLL, SKETCH_CMS } SKETCH_TYPE;
+
+typedef struct sketch_item {
+  char *item;
+  size_t len;
+  uint64_t count;
+} SKETCH_ITEM;
+
+typedef struct sketch {
+  SKETCH_TYPE type;
+  uint64_t total; //number of items added
+  uint8_t *registers; //HLL only
+  uint64_t *counters; //CMS only, SKETCH_CMS_DEPTH rows of SKETCH_CMS_WIDTH
+  SKETCH_ITEM *top; //CMS only, heavy hitter candidates
+  size_t top_len;
+  size_t top_cap;
+} SKETCH;
+
+/* returned pointer must be freed with sketch_free
+*/
+SKETCH *sketch_new(SKETCH_TYPE type);
+void sketch_free(SKETCH *sketch);
+/* bytes allocated for the sketch, its candidates included
+*/
+size_t sketch_mem_usage(const SKETCH *sketch);
+void sketch_add(SKETCH *sketch, const char *item, size_t len);
+/* adds src into dst, both must be of the same type.
+   the merged candidates are only trimmed to SKETCH_TOP_SIZE by sketch_top
+*/
+int sketch_merge(SKETCH *dst, const SKETCH *src);
+/* estimated distinct items for HLL, items added for CMS
+*/
+uint64_t sketch_count(const SKETCH *sketch);
+uint64_t sketch_frequency(const SKETCH *sketch, const char *item, size_t len);
+/* sorts the heavy hitter candidates by estimated count, returns how many
+   of them (up to SKETCH_TOP_SIZE) are valid
+*/
+size_t sketch_top(SKETCH *sketch);
+/* returned pointer must be freed
+*/
+char *sketch_serialize(const SKETCH *sketch, size_t *len);
+SKETCH *sketch_deserialize(const char *buf, size_t len);
+
+#endif /* SKETCH_H */
@@ -0,0 +1,115 @@
+#include <stdlib.h>
+#include <math.h>
+#include "tdigest.h"
+
+TDIGEST *tdigest_new(double compression) {
+  TDIGEST *digest = calloc(1, sizeof(TDIGEST));
+  if(digest == NULL)
+    return NULL;
+  digest->compression = compression;
+  digest->cap = (size_t)(compression * TDIGEST_BUFFER_FACTOR);
+  digest->centroids = malloc(digest->cap * sizeof(TD_CENTROID));
+  if(digest->centroids == NULL) {
+    free(digest);
+    return NULL;
+  }
+  digest->min = INFINITY;
+  digest->max = -INFINITY;
+  return digest;
+}
+
+void tdigest_free(TDIGEST *digest) {
+  if(digest == NULL)
+    return;
+  free(digest->centroids);
+  free(digest);
+}
+
+static int compare_centroids(const void *a, const void *b) {
+  const TD_CENTROID *ca = a, *cb = b;
+  return (ca->mean > cb->mean) - (ca->mean < cb->mean);
+}
+
+/* the k1 scale function, centroids near the tails are kept small
+*/
+static double scale_k(TDIGEST *digest, double q) {
+  return digest->compression / (2 * M_PI) * asin(2 * q - 1);
+}
+
+void tdigest_compress(TDIGEST *digest) {
+  if(digest->len <= 1)
+    return;
+  qsort(digest->centroids, digest->len, sizeof(TD_CENTROID),
+    compare_centroids);
+  double total = digest->total_weight, so_far = 0;
+  double k_lower = scale_k(digest, 0);
+  size_t out = 0;
+  TD_CENTROID cur = digest->centroids[0];
+  for(size_t i=1; i < digest->len; ++i) {
+    TD_CENTROID *next = &digest->centroids[i];
+    double q = (so_far + cur.weight + next->weight) / total;
+    if(scale_k(digest, q) - k_lower <= 1) {
+      cur.weight += next->weight;
+      cur.mean += (next->mean - cur.mean) * next->weight / cur.weight;
+      continue;
+    }
+    so_far += cur.weight;
+    k_lower = scale_k(digest, so_far / total);
+    digest->centroids[out++] = cur;
+    cur = *next;
+  }
+  digest->centroids[out++] = cur;
+  digest->len = out;
+}
+
+void tdigest_add(TDIGEST *digest, double val, double weight) {
+  if(weight <= 0 || isnan(val))
+    return;
+  if(digest->len == digest->cap)
+    tdigest_compress(digest);
+  digest->centroids[digest->len].mean = val;
+  digest->centroids[digest->len].weight = weight;
+  digest->len++;
+  digest->total_weight += weight;
+  if(val < digest->min)
+    digest->min = val;
+  if(val > digest->max)
+    digest->max = val;
+}
+
+void tdigest_merge(TDIGEST *dst, TDIGEST *src) {
+  double min = src->min, max = src->max;
+  for(size_t i=0; i < src->len; ++i)
+    tdigest_add(dst, src->centroids[i].mean, src->centroids[i].weight);
+  if(min < dst->min)
+    dst->min = min;
+  if(max > dst->max)
+    dst->max = max;
+}
+
+double tdigest_quantile(TDIGEST *digest, double q) {
+  if(digest->len == 0)
+    return NAN;
+  tdigest_compress(digest);
+  TD_CENTROID *c = digest->centroids;
+  if(q <= 0)
+    return digest->min;
+  if(q >= 1)
+    return digest->max;
+  double index = q * digest->total_weight;
+  //the first and last half centroids interpolate towards min and max
+  if(index < c[0].weight / 2)
+    return digest->min + (c[0].mean - digest->min) * index / (c[0].weight / 2);
+  double so_far = c[0].weight / 2;
+  for(size_t i=0; i + 1 < digest->len; ++i) {
+    double gap = (c[i].weight + c[i+1].weight) / 2;
+    if(so_far + gap > index)
+      return c[i].mean + (c[i+1].mean - c[i].mean) * (index - so_far) / gap;
+    so_far += gap;
+  }
+  TD_CENTROID *last = &c[digest->len - 1];
+  double tail = digest->total_weight - so_far;
+  if(tail <= 0)
+    return digest->max;
+  return last->mean + (digest->max - last->mean) * (index - so_far) / tail;
+}
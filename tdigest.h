@@ -0,0 +1,40 @@
+#ifndef TDIGEST_H
+#define TDIGEST_H
+
+#include <stddef.h>
+
+#define TDIGEST_COMPRESSION 100
+#define TDIGEST_BUFFER_FACTOR 5 //unmerged points kept per unit of compression
+
+/* a merging t-digest: values are buffered and periodically folded into a
+   bounded set of centroids, two digests merge by folding one into the other
+*/
+typedef struct td_centroid {
+  double mean;
+  double weight;
+} TD_CENTROID;
+
+typedef struct tdigest {
+  double compression;
+  TD_CENTROID *centroids; //sorted by mean once compressed
+  size_t len;
+  size_t cap;
+  double total_weight;
+  double min;
+  double max;
+} TDIGEST;
+
+/* returned pointer must be freed with tdigest_free
+*/
+TDIGEST *tdigest_new(double compression);
+void tdigest_free(TDIGEST *digest);
+void tdigest_add(TDIGEST *digest, double val, double weight);
+void tdigest_merge(TDIGEST *dst, TDIGEST *src);
+/* folds the buffered values into centroids, done implicitly when needed
+*/
+void tdigest_compress(TDIGEST *digest);
+/* q in [0, 1], NAN when the digest is empty
+*/
+double tdigest_quantile(TDIGEST *digest, double q);
+
+#endif /* TDIGEST_H */